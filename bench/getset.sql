@@ -0,0 +1,2 @@
+-- One getset call returning a synthetic kdb+ table (variables set by run.sh)
+select count(*) from pgtokdb_bench.bench_:case('rows=:rows types=:types strlen=:strlen width=:width');
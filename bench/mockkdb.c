@@ -0,0 +1,610 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stand-in for a kdb+ process, used by the benchmarks (see bench/run.sh) so
+ * that they don't need q. It speaks the kdb+ IPC protocol and answers each
+ * synchronous call with a synthetic table, described by the first string in
+ * the call that starts with "rows=", e.g.
+ *
+ *     select count(*) from bench_j('rows=100000 types=jfps strlen=16 width=8');
+ *
+ * types has one kdb+ type code per column (the columns are named c0, c1, ...):
+ * b h i j e f c s p d g for simple columns, C for strings of strlen characters,
+ * and H I J E F for lists of width items. Any other call is answered with a
+ * kdb+ error, and asynchronous messages are ignored. Each connection is served
+ * by a process of its own.
+ *
+ *     $ bench/mockkdb -p 5099
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* A growable output buffer */
+typedef struct
+{
+	char	   *data;
+	size_t		len;
+	size_t		cap;
+} Buf;
+
+/* Shape of a synthetic table */
+typedef struct
+{
+	long		rows;
+	char		types[64];
+	int			strlen;
+	int			width;
+} Spec;
+
+/* Prototypes */
+static void put(Buf *, const void *, size_t);
+static void put_byte(Buf *, signed char);
+static void put_vector(Buf *, signed char, int32_t);
+static int	atom_size(int);
+static const char *walk(const char *, const char *, const char **, int32_t *);
+static int	parse_spec(const char *, int32_t, Spec *, char *);
+static int	put_column(Buf *, char, const Spec *);
+static int	put_table(Buf *, const Spec *, char *);
+static int	read_full(int, void *, size_t);
+static int	write_full(int, const void *, size_t);
+static int	reply(int, const Buf *);
+static int	reply_error(int, const char *);
+static void serve(int);
+
+
+/*
+ * Append bytes to a buffer
+ */
+static void put(Buf *b, const void *p, size_t n)
+{
+	if (b->len + n > b->cap)
+	{
+		size_t cap = b->cap == 0 ? 65536 : b->cap;
+		while (cap < b->len + n)
+			cap *= 2;
+		b->data = realloc(b->data, cap);
+		if (b->data == NULL)
+		{
+			perror("mockkdb");
+			exit(1);
+		}
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+
+static void put_byte(Buf *b, signed char c)
+{
+	put(b, &c, 1);
+}
+
+
+/*
+ * Type, attribute and length that start a vector
+ */
+static void put_vector(Buf *b, signed char type, int32_t n)
+{
+	put_byte(b, type);
+	put_byte(b, 0);
+	put(b, &n, sizeof(n));
+}
+
+
+/*
+ * Bytes taken by an item of a simple kdb+ type (-1 if not a simple type)
+ */
+static int atom_size(int t)
+{
+	switch (t)
+	{
+		case 1: case 4: case 10: return 1;
+		case 5: return 2;
+		case 6: case 8: case 13: case 14: case 17: case 18: case 19: return 4;
+		case 7: case 9: case 12: case 15: case 16: return 8;
+		case 2: return 16;
+		default: return -1;
+	}
+}
+
+
+/*
+ * Skip over a serialized kdb+ object, noting the first char vector that
+ * starts with "rows=". Returns the end of the object (NULL if it can't be
+ * parsed).
+ */
+static const char *walk(const char *p, const char *end, const char **spec, int32_t *speclen)
+{
+	if (p >= end)
+		return NULL;
+
+	signed char t = *p++;
+
+	/* Atoms (and errors), symbols being null-terminated */
+	if (t < 0)
+	{
+		if (t == -11 || t == -128)
+		{
+			const char *z = memchr(p, 0, end - p);
+			return z != NULL ? z + 1 : NULL;
+		}
+		int size = atom_size(-t);
+		return size > 0 && p + size <= end ? p + size : NULL;
+	}
+
+	/* Lists and vectors */
+	if (t <= 19)
+	{
+		int32_t n;
+		if (end - p < 5)
+			return NULL;
+		memcpy(&n, p + 1, sizeof(n));
+		p += 5;
+
+		if (t == 0)
+		{
+			for (int32_t i = 0; i < n && p != NULL; i++)
+				p = walk(p, end, spec, speclen);
+			return p;
+		}
+		if (t == 11)
+		{
+			for (int32_t i = 0; i < n && p != NULL; i++)
+			{
+				const char *z = memchr(p, 0, end - p);
+				p = z != NULL ? z + 1 : NULL;
+			}
+			return p;
+		}
+		if (t == 10 && *spec == NULL && n >= 5 && end - p >= 5 && memcmp(p, "rows=", 5) == 0)
+		{
+			*spec = p;
+			*speclen = n;
+		}
+
+		int size = atom_size(t);
+		return size > 0 && n >= 0 && (end - p) / size >= n ? p + (size_t) n * size : NULL;
+	}
+
+	switch (t)
+	{
+		case 98: /* Table: attribute, then a dictionary */
+			return walk(p + 1, end, spec, speclen);
+		case 99: case 127: /* Dictionary: keys, then values */
+			p = walk(p, end, spec, speclen);
+			return p != NULL ? walk(p, end, spec, speclen) : NULL;
+		case 100: /* Lambda: context, then source */
+		{
+			const char *z = memchr(p, 0, end - p);
+			return z != NULL ? walk(z + 1, end, spec, speclen) : NULL;
+		}
+		case 101: case 102: case 103: /* Primitives */
+			return p + 1 <= end ? p + 1 : NULL;
+		default:
+			return NULL;
+	}
+}
+
+
+/*
+ * Read a table description (e.g. "rows=1000 types=jf strlen=8 width=4")
+ */
+static int parse_spec(const char *p, int32_t n, Spec *spec, char *err)
+{
+	char text[256];
+
+	if (n >= (int32_t) sizeof(text))
+	{
+		strcpy(err, "spec too long");
+		return -1;
+	}
+	memcpy(text, p, n);
+	text[n] = '\0';
+
+	spec->rows = 0;
+	strcpy(spec->types, "j");
+	spec->strlen = 8;
+	spec->width = 4;
+
+	for (char *tok = strtok(text, " "); tok != NULL; tok = strtok(NULL, " "))
+	{
+		if (strncmp(tok, "rows=", 5) == 0)
+			spec->rows = atol(tok + 5);
+		else if (strncmp(tok, "types=", 6) == 0 && strlen(tok + 6) < sizeof(spec->types))
+			strcpy(spec->types, tok + 6);
+		else if (strncmp(tok, "strlen=", 7) == 0)
+			spec->strlen = atoi(tok + 7);
+		else if (strncmp(tok, "width=", 6) == 0)
+			spec->width = atoi(tok + 6);
+		else
+		{
+			snprintf(err, 128, "bad spec item: %.64s", tok);
+			return -1;
+		}
+	}
+
+	if (spec->rows < 0 || spec->rows > INT32_MAX || spec->strlen < 0 || spec->width < 0 ||
+		spec->types[0] == '\0' || strspn(spec->types, "bhijefcspdgCHIJEF") != strlen(spec->types))
+	{
+		strcpy(err, "bad spec");
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Append a column of synthetic values of a kdb+ type
+ */
+static int put_column(Buf *b, char code, const Spec *spec)
+{
+	int32_t n = (int32_t) spec->rows;
+
+	switch (code)
+	{
+		case 'b':
+			put_vector(b, 1, n);
+			for (int32_t i = 0; i < n; i++)
+				put_byte(b, i & 1);
+			return 0;
+		case 'g':
+			put_vector(b, 2, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				int64_t u[2] = { i, 0x5eed };
+				put(b, u, sizeof(u));
+			}
+			return 0;
+		case 'h':
+			put_vector(b, 5, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				int16_t h = (int16_t) (i % 32768);
+				put(b, &h, sizeof(h));
+			}
+			return 0;
+		case 'i':
+			put_vector(b, 6, n);
+			for (int32_t i = 0; i < n; i++)
+				put(b, &i, sizeof(i));
+			return 0;
+		case 'j':
+			put_vector(b, 7, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				int64_t j = i;
+				put(b, &j, sizeof(j));
+			}
+			return 0;
+		case 'e':
+			put_vector(b, 8, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				float e = i * 0.5f;
+				put(b, &e, sizeof(e));
+			}
+			return 0;
+		case 'f':
+			put_vector(b, 9, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				double f = i * 0.25;
+				put(b, &f, sizeof(f));
+			}
+			return 0;
+		case 'c':
+			put_vector(b, 10, n);
+			for (int32_t i = 0; i < n; i++)
+				put_byte(b, 'a' + i % 26);
+			return 0;
+		case 's':
+			put_vector(b, 11, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				char s[16];
+				int len = snprintf(s, sizeof(s), "s%d", i % 1000);
+				put(b, s, len + 1);
+			}
+			return 0;
+		case 'p': /* Nanoseconds since 2000.01.01, a second apart */
+			put_vector(b, 12, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				int64_t p = (int64_t) i * 1000000000;
+				put(b, &p, sizeof(p));
+			}
+			return 0;
+		case 'd': /* Days since 2000.01.01 */
+			put_vector(b, 14, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				int32_t d = i % 36500;
+				put(b, &d, sizeof(d));
+			}
+			return 0;
+		case 'C':
+			put_vector(b, 0, n);
+			for (int32_t i = 0; i < n; i++)
+			{
+				put_vector(b, 10, spec->strlen);
+				for (int k = 0; k < spec->strlen; k++)
+					put_byte(b, 'a' + (i + k) % 26);
+			}
+			return 0;
+		case 'H': case 'I': case 'J': case 'E': case 'F':
+		{
+			/* Same values as the matching simple column, width at a time */
+			Spec item = *spec;
+			item.rows = spec->width;
+			put_vector(b, 0, n);
+			for (int32_t i = 0; i < n; i++)
+				put_column(b, code - 'A' + 'a', &item);
+			return 0;
+		}
+		default:
+			return -1;
+	}
+}
+
+
+/*
+ * Append a table with a column per type code (c0, c1, ...)
+ */
+static int put_table(Buf *b, const Spec *spec, char *err)
+{
+	int ncols = (int) strlen(spec->types);
+
+	put_byte(b, 98);
+	put_byte(b, 0);
+	put_byte(b, 99);
+
+	put_vector(b, 11, ncols);
+	for (int i = 0; i < ncols; i++)
+	{
+		char name[16];
+		int len = snprintf(name, sizeof(name), "c%d", i);
+		put(b, name, len + 1);
+	}
+
+	put_vector(b, 0, ncols);
+	for (int i = 0; i < ncols; i++)
+		if (put_column(b, spec->types[i], spec) != 0)
+		{
+			snprintf(err, 128, "unsupported type: %c", spec->types[i]);
+			return -1;
+		}
+
+	return 0;
+}
+
+
+static int read_full(int fd, void *p, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (char *) p + r;
+		n -= r;
+	}
+	return 0;
+}
+
+
+static int write_full(int fd, const void *p, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t r = write(fd, p, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (const char *) p + r;
+		n -= r;
+	}
+	return 0;
+}
+
+
+/*
+ * Send a response message holding a serialized object
+ */
+static int reply(int fd, const Buf *body)
+{
+	int one = 1;
+	char header[8] = { *(char *) &one, 2, 0, 0 };
+
+	if (body->len > INT32_MAX - sizeof(header))
+		return reply_error(fd, "limit");
+
+	int32_t len = (int32_t) (body->len + sizeof(header));
+	memcpy(header + 4, &len, sizeof(len));
+
+	if (write_full(fd, header, sizeof(header)) != 0)
+		return -1;
+	return write_full(fd, body->data, body->len);
+}
+
+
+static int reply_error(int fd, const char *msg)
+{
+	Buf b = { NULL, 0, 0 };
+	put_byte(&b, -128);
+	put(&b, msg, strlen(msg) + 1);
+	int r = reply(fd, &b);
+	free(b.data);
+	return r;
+}
+
+
+/*
+ * Answer the calls made on a connection until it is closed. The last table
+ * is kept, since a benchmark makes the same call over and over.
+ */
+static void serve(int fd)
+{
+	char c;
+	Buf out = { NULL, 0, 0 };
+	char last[256] = "";
+	char *in = NULL;
+
+	/* Handshake: credentials and a capability byte, then a null byte */
+	signed char cap = 0;
+	do
+	{
+		if (read_full(fd, &c, 1) != 0)
+			return;
+		if (c != 0)
+			cap = c;
+	} while (c != 0);
+
+	cap = cap >= 1 && cap <= 3 ? cap : 3;
+	if (write_full(fd, &cap, 1) != 0)
+		return;
+
+	for (;;)
+	{
+		char header[8];
+		int32_t len;
+
+		if (read_full(fd, header, sizeof(header)) != 0)
+			break;
+		memcpy(&len, header + 4, sizeof(len));
+		if (len < (int32_t) sizeof(header))
+			break;
+
+		in = realloc(in, len - sizeof(header) + 1);
+		if (in == NULL || read_full(fd, in, len - sizeof(header)) != 0)
+			break;
+
+		/* Only synchronous calls get a response */
+		if (header[1] != 1)
+			continue;
+
+		if (header[2] != 0)
+		{
+			if (reply_error(fd, "mock: compressed requests are not supported") != 0)
+				break;
+			continue;
+		}
+
+		const char *p = NULL;
+		int32_t plen = 0;
+		if (walk(in, in + len - sizeof(header), &p, &plen) == NULL || p == NULL)
+		{
+			if (reply_error(fd, "mock: expected a rows= spec") != 0)
+				break;
+			continue;
+		}
+
+		/* Build the table, unless it is the same as the last one */
+		if (plen >= (int32_t) sizeof(last) || strlen(last) != (size_t) plen ||
+			memcmp(last, p, plen) != 0)
+		{
+			Spec spec;
+			char err[128];
+
+			out.len = 0;
+			last[0] = '\0';
+			if (parse_spec(p, plen, &spec, err) != 0 || put_table(&out, &spec, err) != 0)
+			{
+				if (reply_error(fd, err) != 0)
+					break;
+				continue;
+			}
+			memcpy(last, p, plen);
+			last[plen] = '\0';
+		}
+
+		if (reply(fd, &out) != 0)
+			break;
+	}
+
+	free(in);
+	free(out.data);
+}
+
+
+int main(int argc, char **argv)
+{
+	int port = 5099;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			port = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "usage: %s [-p port]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if (s < 0 || setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+		bind(s, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(s, 64) != 0)
+	{
+		perror("mockkdb");
+		return 1;
+	}
+
+	/* Children are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (;;)
+	{
+		int fd = accept(s, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("mockkdb");
+			return 1;
+		}
+
+		if (fork() == 0)
+		{
+			close(s);
+			serve(fd);
+			close(fd);
+			_exit(0);
+		}
+		close(fd);
+	}
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# End-to-end benchmark of getset against the mock kdb+ server (make bench).
+# For each kdb+ column type, pgbench calls a function that returns ROWS rows
+# of that type for DURATION seconds, and the rows/s, MB/s (of kdb+ IPC data)
+# and latency per row are printed and appended to bench_output.txt.
+#
+# Settings come from the environment: ROWS, DURATION, CLIENTS, STRLEN (of
+# strings), WIDTH (of arrays), PORT (of the mock server), and the libpq
+# variables (PGHOST, PGDATABASE, ...) of the Postgres server, which must have
+# pgtokdb installed.
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+ROWS=${ROWS:-100000}
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-1}
+STRLEN=${STRLEN:-16}
+WIDTH=${WIDTH:-8}
+PORT=${PORT:-5099}
+OUTPUT=bench_output.txt
+
+bench/mockkdb -p "$PORT" &
+MOCK=$!
+trap 'kill $MOCK 2>/dev/null' EXIT INT TERM
+sleep 1
+
+psql -q -X -v ON_ERROR_STOP=1 -f bench/setup.sql || exit 1
+
+# The mock server listens on the IPv4 loopback only
+PGOPTIONS="$PGOPTIONS -c pgtokdb.host=127.0.0.1 -c pgtokdb.port=$PORT"
+export PGOPTIONS
+
+{
+	echo "# $(date) rows=$ROWS duration=${DURATION}s clients=$CLIENTS strlen=$STRLEN width=$WIDTH"
+	printf "%-10s %-6s %14s %10s %10s\n" case types rows/s MB/s ns/row
+} | tee -a "$OUTPUT"
+
+# Case, kdb+ type codes, and kdb+ IPC bytes per row
+while read -r case types bytes
+do
+	tps=$(pgbench -n -T "$DURATION" -c "$CLIENTS" -f bench/getset.sql \
+		-D case="$case" -D rows="$ROWS" -D types="$types" \
+		-D strlen="$STRLEN" -D width="$WIDTH" 2>&1 | awk '/^tps/ { print $3; exit }')
+
+	if [ -z "$tps" ]
+	then
+		echo "$case: pgbench failed" | tee -a "$OUTPUT"
+		continue
+	fi
+
+	awk -v c="$case" -v t="$types" -v tps="$tps" -v rows="$ROWS" -v bytes="$bytes" \
+		-v clients="$CLIENTS" 'BEGIN {
+			r = tps * rows
+			printf "%-10s %-6s %14.0f %10.1f %10.1f\n", c, t, r, r * bytes / 1e6, 1e9 * clients / r
+		}' | tee -a "$OUTPUT"
+done <<EOF
+bool b 1
+short h 2
+int i 4
+long j 8
+real e 4
+float f 8
+sym s 5
+string C $((STRLEN + 6))
+timestamp p 8
+date d 4
+guid g 16
+longs J $((WIDTH * 8 + 6))
+floats F $((WIDTH * 8 + 6))
+mixed jfps 29
+EOF
@@ -0,0 +1,52 @@
+--
+-- Functions called by the benchmarks (see run.sh). Each one returns the 
+-- synthetic table the mock kdb+ server builds for its first argument, with 
+-- one column per kdb+ type code (c0, c1, ...).
+--
+create extension if not exists pgtokdb;
+
+drop schema if exists pgtokdb_bench cascade;
+create schema pgtokdb_bench;
+set search_path = pgtokdb_bench;
+
+create type bool_t as (c0 boolean);
+create function bench_bool(varchar) returns setof bool_t as 'pgtokdb', 'getset' language c;
+
+create type short_t as (c0 smallint);
+create function bench_short(varchar) returns setof short_t as 'pgtokdb', 'getset' language c;
+
+create type int_t as (c0 integer);
+create function bench_int(varchar) returns setof int_t as 'pgtokdb', 'getset' language c;
+
+create type long_t as (c0 bigint);
+create function bench_long(varchar) returns setof long_t as 'pgtokdb', 'getset' language c;
+
+create type real_t as (c0 real);
+create function bench_real(varchar) returns setof real_t as 'pgtokdb', 'getset' language c;
+
+create type float_t as (c0 double precision);
+create function bench_float(varchar) returns setof float_t as 'pgtokdb', 'getset' language c;
+
+create type sym_t as (c0 varchar);
+create function bench_sym(varchar) returns setof sym_t as 'pgtokdb', 'getset' language c;
+
+create type string_t as (c0 varchar);
+create function bench_string(varchar) returns setof string_t as 'pgtokdb', 'getset' language c;
+
+create type timestamp_t as (c0 timestamp);
+create function bench_timestamp(varchar) returns setof timestamp_t as 'pgtokdb', 'getset' language c;
+
+create type date_t as (c0 date);
+create function bench_date(varchar) returns setof date_t as 'pgtokdb', 'getset' language c;
+
+create type guid_t as (c0 uuid);
+create function bench_guid(varchar) returns setof guid_t as 'pgtokdb', 'getset' language c;
+
+create type longs_t as (c0 bigint[]);
+create function bench_longs(varchar) returns setof longs_t as 'pgtokdb', 'getset' language c;
+
+create type floats_t as (c0 double precision[]);
+create function bench_floats(varchar) returns setof floats_t as 'pgtokdb', 'getset' language c;
+
+create type mixed_t as (c0 bigint, c1 double precision, c2 timestamp, c3 varchar);
+create function bench_mixed(varchar) returns setof mixed_t as 'pgtokdb', 'getset' language c;
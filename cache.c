@@ -0,0 +1,611 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Cache of kdb+ results shared by all backends. A result is stored in
+ * serialized form (b9) in a DSA area that lives in the main shared memory
+ * segment, and is found through a shared hash table keyed by the hash of
+ * the function, the connection and the serialized call. Entries expire
+ * after pgtokdb.cache_ttl seconds, and the least recently used ones are
+ * evicted when the area or the table is full. While one backend fetches a
+ * result, the others asking for the same one wait for it rather than send
+ * the same call to kdb+.
+ *
+ * The shared memory is only set up when the library is loaded through
+ * shared_preload_libraries; otherwise calls go straight to kdb+.
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <access/htup_details.h>
+#include <storage/condition_variable.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/dsa.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#if PG_VERSION_NUM >= 130000
+#include <common/hashfn.h>
+#else
+#include <access/hash.h>
+#endif
+
+/* A cached result (or one being fetched) */
+typedef struct
+{
+	uint64		hash;		/* Hash of the key (hash table key) */
+	Oid			fnoid;		/* Function that made the call */
+	dsa_pointer	key;		/* Serialized call */
+	Size		keylen;
+	dsa_pointer	data;		/* Serialized result */
+	Size		datalen;
+	bool		ready;		/* False while the result is being fetched */
+	int			pid;		/* Backend fetching the result */
+	TimestampTz	created;	/* When the result was stored */
+	TimestampTz	lastused;	/* When the result was last returned */
+	int64		hits;		/* Number of calls served by the entry */
+} KCacheEntry;
+
+/* Cache state shared by all backends, followed by the DSA area */
+typedef struct
+{
+	LWLock	   *lock;		/* Protects this struct and the entries */
+	ConditionVariable cv;	/* Broadcast when a fetch completes */
+	int			tranche;	/* LWLock tranche of the DSA area */
+	bool		created;	/* Whether the DSA area has been created */
+	int			entries;	/* Entries in the hash table */
+	Size		bytes;		/* Bytes of keys and results held */
+	int64		hits;
+	int64		misses;
+	int64		waits;
+	int64		evictions;
+} KCacheShared;
+
+/* Configuration globals */
+static int kcache_ttl = 0;
+static int kcache_size = 64;
+static int kcache_entries = 1024;
+
+/* Shared state, as attached by this backend */
+static KCacheShared *kcache = NULL;
+static HTAB *kcache_htab = NULL;
+static dsa_area *kcache_area = NULL;
+
+/* Entry this backend is fetching the result of */
+static bool kcache_fetching = false;
+static uint64 kcache_fetchhash = 0;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* Prototypes */
+Size	kcache_bytes(void);
+Size	kcache_shmem_size(void);
+void	kcache_shmem_request(void);
+void	kcache_shmem_startup(void);
+dsa_area *kcache_attach(void);
+void	kcache_remove(dsa_area *, KCacheEntry *);
+bool	kcache_evict(dsa_area *);
+dsa_pointer kcache_alloc(dsa_area *, Size);
+K		kcache_key(Oid, const char *, int, const char *, S, K);
+K		kcache_lookup(Oid, uint64, K);
+void	kcache_store(K);
+void	kcache_abandon(int, Datum);
+
+
+/*
+ * Define the configuration settings of the result cache, and reserve its
+ * shared memory when loaded through shared_preload_libraries
+ */
+void kcache_init(void)
+{
+	DefineCustomIntVariable("pgtokdb.cache_ttl",
+		"Seconds a kdb+ result may be served from the shared result cache.",
+		"Zero does not cache results.",
+		&kcache_ttl, 0, 0, INT_MAX / 1000,
+		PGC_USERSET, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.cache_size",
+		"Shared memory used to hold cached kdb+ results.",
+		"Zero disables the result cache.",
+		&kcache_size, 64, 0, INT_MAX / 2,
+		PGC_POSTMASTER, GUC_UNIT_MB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.cache_entries",
+		"Maximum number of results held by the shared result cache.",
+		NULL, &kcache_entries, 1024, 16, INT_MAX / 2,
+		PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || kcache_size == 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = kcache_shmem_request;
+#else
+	kcache_shmem_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = kcache_shmem_startup;
+}
+
+
+/*
+ * Size of the DSA area holding the keys and results
+ */
+Size kcache_bytes(void)
+{
+	return (Size) kcache_size * 1024 * 1024;
+}
+
+
+/*
+ * Shared memory needed by the cache
+ */
+Size kcache_shmem_size(void)
+{
+	return add_size(add_size(MAXALIGN(sizeof(KCacheShared)), kcache_bytes()),
+		hash_estimate_size(kcache_entries, sizeof(KCacheEntry)));
+}
+
+
+/*
+ * Request the shared memory and the lock of the cache
+ */
+void kcache_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(kcache_shmem_size());
+	RequestNamedLWLockTranche("pgtokdb", 1);
+}
+
+
+/*
+ * Set up (or attach to) the shared state and the hash table of the cache
+ */
+void kcache_shmem_startup(void)
+{
+	bool found;
+	HASHCTL info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	kcache = (KCacheShared *) ShmemInitStruct("pgtokdb cache",
+		MAXALIGN(sizeof(KCacheShared)) + kcache_bytes(), &found);
+
+	if (!found)
+	{
+		memset(kcache, 0, sizeof(KCacheShared));
+		kcache->lock = &(GetNamedLWLockTranche("pgtokdb"))->lock;
+		kcache->tranche = LWLockNewTrancheId();
+		ConditionVariableInit(&kcache->cv);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint64);
+	info.entrysize = sizeof(KCacheEntry);
+	kcache_htab = ShmemInitHash("pgtokdb cache entries",
+		kcache_entries, kcache_entries, &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Attach to the DSA area of the cache, creating it on first use
+ */
+dsa_area *kcache_attach(void)
+{
+	if (kcache_area != NULL)
+		return kcache_area;
+
+	void *place = (char *) kcache + MAXALIGN(sizeof(KCacheShared));
+
+	LWLockRegisterTranche(kcache->tranche, "pgtokdb_cache");
+	LWLockAcquire(kcache->lock, LW_EXCLUSIVE);
+
+	if (!kcache->created)
+	{
+		/* The area never grows beyond the memory reserved for it */
+		kcache_area = dsa_create_in_place(place, kcache_bytes(), kcache->tranche, NULL);
+		dsa_set_size_limit(kcache_area, kcache_bytes());
+		dsa_pin(kcache_area);
+		kcache->created = true;
+	}
+	else
+		kcache_area = dsa_attach_in_place(place, NULL);
+
+	dsa_pin_mapping(kcache_area);
+	LWLockRelease(kcache->lock);
+
+	/* Don't leave other backends waiting on a fetch that will never end */
+	before_shmem_exit(kcache_abandon, (Datum) 0);
+
+	return kcache_area;
+}
+
+
+/*
+ * Drop an entry (lock held exclusively)
+ */
+void kcache_remove(dsa_area *area, KCacheEntry *e)
+{
+	if (DsaPointerIsValid(e->key))
+		dsa_free(area, e->key);
+	if (DsaPointerIsValid(e->data))
+		dsa_free(area, e->data);
+
+	kcache->bytes -= e->keylen + e->datalen;
+	kcache->entries--;
+	hash_search(kcache_htab, &e->hash, HASH_REMOVE, NULL);
+}
+
+
+/*
+ * Drop the least recently used result (lock held exclusively). Returns false
+ * when there is nothing left to evict.
+ */
+bool kcache_evict(dsa_area *area)
+{
+	HASH_SEQ_STATUS status;
+	KCacheEntry *e;
+	KCacheEntry *lru = NULL;
+
+	hash_seq_init(&status, kcache_htab);
+	while ((e = (KCacheEntry *) hash_seq_search(&status)) != NULL)
+		if (e->ready && (lru == NULL || e->lastused < lru->lastused))
+			lru = e;
+
+	if (lru == NULL)
+		return false;
+
+	kcache_remove(area, lru);
+	kcache->evictions++;
+	return true;
+}
+
+
+/*
+ * Allocate memory in the DSA area, evicting results until it fits (lock held
+ * exclusively). Returns InvalidDsaPointer when it cannot fit.
+ */
+dsa_pointer kcache_alloc(dsa_area *area, Size size)
+{
+	for (;;)
+	{
+		dsa_pointer p = dsa_allocate_extended(area, size, DSA_ALLOC_NO_OOM | DSA_ALLOC_HUGE);
+		if (DsaPointerIsValid(p))
+		{
+			kcache->bytes += size;
+			return p;
+		}
+		if (!kcache_evict(area))
+			return InvalidDsaPointer;
+	}
+}
+
+
+/*
+ * Serialize what identifies a call: the function, the kdb+ process and
+ * credentials, the expression and the arguments (which are not consumed)
+ */
+K kcache_key(Oid fnoid, const char *host, int port, const char *userpass, S ef, K args)
+{
+	K call = knk(5, ki((I) fnoid), kp((S) host), ki(port), kp((S) userpass),
+		knk(2, kp(ef), args != NULL ? r1(args) : ktn(0, 0)));
+	K key = b9(2, call);
+	r0(call);
+	return key;
+}
+
+
+/*
+ * Return a copy of the cached result of a call, waiting for it when another
+ * backend is fetching it. Returns NULL on a miss, in which case this backend
+ * has usually been made the one to fetch the result (kcache_fetching).
+ */
+K kcache_lookup(Oid fnoid, uint64 hash, K key)
+{
+	dsa_area *area = kcache_attach();
+	K bytes = NULL;
+	bool waited = false;
+
+	for (;;)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		LWLockAcquire(kcache->lock, LW_EXCLUSIVE);
+		KCacheEntry *e = (KCacheEntry *) hash_search(kcache_htab, &hash, HASH_FIND, NULL);
+
+		if (e != NULL && e->ready &&
+			TimestampDifferenceExceeds(e->created, now, kcache_ttl * 1000))
+		{
+			kcache_remove(area, e);
+			e = NULL;
+		}
+
+		/* A different call with the same hash is simply not cached */
+		if (e != NULL && (e->fnoid != fnoid || e->keylen != (Size) key->n ||
+			memcmp(dsa_get_address(area, e->key), kG(key), key->n) != 0))
+		{
+			LWLockRelease(kcache->lock);
+			break;
+		}
+
+		if (e != NULL && e->ready)
+		{
+			bytes = ktn(KG, e->datalen);
+			memcpy(kG(bytes), dsa_get_address(area, e->data), e->datalen);
+			e->hits++;
+			e->lastused = now;
+			kcache->hits++;
+			LWLockRelease(kcache->lock);
+			break;
+		}
+
+		if (e != NULL)
+		{
+			/* Wait for the backend fetching the result */
+			if (!waited)
+				kcache->waits++;
+			LWLockRelease(kcache->lock);
+			ConditionVariableSleep(&kcache->cv, PG_WAIT_EXTENSION);
+			waited = true;
+			continue;
+		}
+
+		/* Miss: claim the entry, and fetch the result */
+		kcache->misses++;
+
+		dsa_pointer p = kcache_alloc(area, key->n);
+		if (DsaPointerIsValid(p))
+		{
+			bool found;
+
+			while (kcache->entries >= kcache_entries && kcache_evict(area))
+				;
+			e = kcache->entries < kcache_entries ? (KCacheEntry *)
+				hash_search(kcache_htab, &hash, HASH_ENTER_NULL, &found) : NULL;
+
+			if (e != NULL)
+			{
+				memcpy(dsa_get_address(area, p), kG(key), key->n);
+				e->fnoid = fnoid;
+				e->key = p;
+				e->keylen = key->n;
+				e->data = InvalidDsaPointer;
+				e->datalen = 0;
+				e->ready = false;
+				e->pid = MyProcPid;
+				e->hits = 0;
+				kcache->entries++;
+				kcache_fetching = true;
+				kcache_fetchhash = hash;
+			}
+			else
+			{
+				dsa_free(area, p);
+				kcache->bytes -= key->n;
+			}
+		}
+
+		LWLockRelease(kcache->lock);
+		break;
+	}
+
+	if (waited)
+		ConditionVariableCancelSleep();
+
+	if (bytes == NULL)
+		return NULL;
+
+	/* A hit counts as many bytes as the response it keeps */
+	kconn_bytes += bytes->n;
+	K result = d9(bytes);
+	r0(bytes);
+	return result;
+}
+
+
+/*
+ * Store the result fetched by this backend (a result that is not a table, or
+ * that does not fit, is dropped) and wake up the backends waiting for it
+ */
+void kcache_store(K result)
+{
+	if (!kcache_fetching)
+		return;
+	kcache_fetching = false;
+
+	K bytes = result != NULL && result->t == XT ? b9(2, result) : NULL;
+	dsa_area *area = kcache_attach();
+
+	LWLockAcquire(kcache->lock, LW_EXCLUSIVE);
+
+	KCacheEntry *e = (KCacheEntry *) hash_search(kcache_htab, &kcache_fetchhash, HASH_FIND, NULL);
+
+	/* The entry may have been invalidated in the meantime */
+	if (e != NULL && !e->ready && e->pid == MyProcPid)
+	{
+		dsa_pointer p = bytes != NULL && bytes->t == KG ?
+			kcache_alloc(area, bytes->n) : InvalidDsaPointer;
+
+		if (DsaPointerIsValid(p))
+		{
+			memcpy(dsa_get_address(area, p), kG(bytes), bytes->n);
+			e->data = p;
+			e->datalen = bytes->n;
+			e->ready = true;
+			e->created = GetCurrentTimestamp();
+			e->lastused = e->created;
+		}
+		else
+			kcache_remove(area, e);
+	}
+
+	LWLockRelease(kcache->lock);
+	ConditionVariableBroadcast(&kcache->cv);
+
+	if (bytes != NULL)
+		r0(bytes);
+}
+
+
+/*
+ * Give up the fetch of this backend (on error or exit), so that a waiting
+ * backend takes it over
+ */
+void kcache_abandon(int code, Datum arg)
+{
+	if (!kcache_fetching)
+		return;
+	kcache_fetching = false;
+
+	LWLockAcquire(kcache->lock, LW_EXCLUSIVE);
+
+	KCacheEntry *e = (KCacheEntry *) hash_search(kcache_htab, &kcache_fetchhash, HASH_FIND, NULL);
+	if (e != NULL && !e->ready && e->pid == MyProcPid)
+		kcache_remove(kcache_area, e);
+
+	LWLockRelease(kcache->lock);
+	ConditionVariableBroadcast(&kcache->cv);
+}
+
+
+/*
+ * Call kdb+ like kconn_call, serving the result from the shared cache when
+ * pgtokdb.cache_ttl is set. The arguments are consumed either way.
+ */
+K kcache_call(Oid fnoid, const char *host, int port, const char *userpass, S ef, K args)
+{
+	if (kcache_ttl == 0 || kcache == NULL)
+		return kconn_call(host, port, userpass, ef, args);
+
+	K key = kcache_key(fnoid, host, port, userpass, ef, args);
+	if (key->t != KG)
+	{
+		r0(key);
+		return kconn_call(host, port, userpass, ef, args);
+	}
+
+	uint64 hash = DatumGetUInt64(hash_any_extended((unsigned char *) kG(key), key->n, 0));
+	K result = kcache_lookup(fnoid, hash, key);
+	r0(key);
+
+	if (result != NULL)
+	{
+		if (args != NULL)
+			r0(args);
+		return result;
+	}
+
+	PG_TRY();
+	{
+		result = kconn_call(host, port, userpass, ef, args);
+	}
+	PG_CATCH();
+	{
+		kcache_abandon(0, (Datum) 0);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	kcache_store(result);
+	return result;
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(cache_stats);
+
+/*
+ * Report the size and effectiveness of the shared result cache
+ */
+PGDLLEXPORT Datum cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[7];
+	bool nulls[7] = { false };
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	memset(values, 0, sizeof(values));
+	if (kcache != NULL)
+	{
+		LWLockAcquire(kcache->lock, LW_SHARED);
+		values[0] = Int32GetDatum(kcache->entries);
+		values[1] = Int64GetDatum((int64) kcache->bytes);
+		values[2] = Int64GetDatum((int64) kcache_bytes());
+		values[3] = Int64GetDatum(kcache->hits);
+		values[4] = Int64GetDatum(kcache->misses);
+		values[5] = Int64GetDatum(kcache->waits);
+		values[6] = Int64GetDatum(kcache->evictions);
+		LWLockRelease(kcache->lock);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(cache_invalidate);
+
+/*
+ * Drop the cached results of a function (of all functions when null), and
+ * return how many were dropped
+ */
+PGDLLEXPORT Datum cache_invalidate(PG_FUNCTION_ARGS)
+{
+	Oid fnoid = PG_ARGISNULL(0) ? InvalidOid : PG_GETARG_OID(0);
+	int64 n = 0;
+
+	if (kcache == NULL)
+		PG_RETURN_INT64(0);
+
+	dsa_area *area = kcache_attach();
+	HASH_SEQ_STATUS status;
+	KCacheEntry *e;
+
+	LWLockAcquire(kcache->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, kcache_htab);
+	while ((e = (KCacheEntry *) hash_seq_search(&status)) != NULL)
+		if (!OidIsValid(fnoid) || e->fnoid == fnoid)
+		{
+			kcache_remove(area, e);
+			n++;
+		}
+
+	LWLockRelease(kcache->lock);
+	ConditionVariableBroadcast(&kcache->cv);
+
+	PG_RETURN_INT64(n);
+}
@@ -0,0 +1,982 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-backend cache of kdb+ connections. Handles are keyed by host, port and
+ * credentials, and are kept open across calls until they have been idle for
+ * pgtokdb.idle_timeout seconds or the backend exits. Calls are sent and their
+ * responses awaited here rather than in the blocking k() of the C API, so
+ * that a cancel request, statement_timeout or pgtokdb.query_timeout closes
+ * the connection instead of leaving the backend stuck on a runaway query.
+ * When pgtokdb.host lists several replicas, each call is routed to one of
+ * them (see replica.c), and may be hedged on a second.
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <fmgr.h>
+#include <funcapi.h>
+#include <errno.h>
+#include <miscadmin.h>
+#include <nodes/execnodes.h>
+#include <storage/ipc.h>
+#include <utils/guc.h>
+#include <utils/tuplestore.h>
+
+#ifdef WIN32
+#define poll WSAPoll
+#define KCONN_PEEK MSG_PEEK		/* Winsock refuses MSG_WAITALL with MSG_PEEK */
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#define KCONN_PEEK (MSG_PEEK | MSG_WAITALL)
+#endif
+
+/* A cached connection to a kdb+ process */
+typedef struct
+{
+	char	host[256];		/* Host name or IP address */
+	int		port;			/* TCP/IP port */
+	char	userpass[256];	/* Credentials used for the handshake */
+	I		handle;			/* kdb+ socket handle (0 if the slot is free) */
+	int64	uses;			/* Number of calls served by this handle */
+	TimestampTz created;	/* When the connection was opened */
+	TimestampTz lastused;	/* When the connection last served a call */
+} KConn;
+
+#define KCONN_MAX 16
+
+static KConn kconns[KCONN_MAX];
+static bool kconn_atexit_set = false;
+
+/* Seconds a cached connection may stay idle before it is closed (0 = never) */
+static int kconn_idle_timeout = 300;
+
+/* Milliseconds allowed to open a connection and to wait for a response (0 = no limit) */
+int kconn_connect_timeout = 10000;
+int kconn_query_timeout = 0;
+
+/* Milliseconds between checks for a cancel request while waiting for kdb+ */
+#define KCONN_POLL_MS 100
+
+/* Rows fetched per round trip from a kdb+ cursor (0 = fetch the whole result) */
+int kconn_chunk_rows = 0;
+
+/* Milliseconds spent opening connections (see pgtokdb.stat_statements) */
+double kconn_connect_ms = 0;
+
+/* Bytes of responses received from kdb+, as sized by their IPC headers */
+int64 kconn_bytes = 0;
+
+/* Have kdb+ compress results larger than kconn_compress_threshold bytes */
+static bool kconn_compress = false;
+static int kconn_compress_threshold = 2000;
+
+/* Read responses with the built-in reader (ipc.c) rather than k() */
+static bool kconn_builtin_reader = false;
+
+/*
+ * Wrapper applied to a call when compressing: x is the expression (or the
+ * function and its arguments) and t the threshold. A compressed result is
+ * tagged, so that it can't be mistaken for a byte list returned by the call.
+ */
+#define COMPRESS_LAMBDA "{[t;x] r:value x; $[t<(-22)!r; (`pgtokdb_z;-18!r); r]}"
+
+/* Prototypes */
+bool	kconn_alive(I);
+void	kconn_close(KConn *);
+void	kconn_expire(void);
+void	kconn_atexit(int, Datum);
+KConn  *kconn_get(const char *, int, const char *, bool);
+void	kconn_send(const char *, int, const char *, S, K);
+K		kconn_inflate(K);
+void	kconn_wait(KConn *, short, instr_time);
+K		kconn_message(K);
+bool	kconn_post(KConn *, K, instr_time);
+K		kconn_request(KConn *, K);
+int		kconn_race(KConn **, int, instr_time, double);
+K		kconn_hedge(KReplica *, KReplica *, const char *, K, double, int *, volatile int *);
+K		kconn_direct(const char *, int, const char *, K, bool, bool);
+K		kconn_route(const char *, int, const char *, K, int *, bool);
+K		kconn_invoke(const char *, int, const char *, S, K, int *, bool);
+void	kcursor_replica(const char **, int *, J *);
+
+
+/*
+ * Define the configuration settings used by the connection cache
+ */
+void kconn_init(void)
+{
+	DefineCustomIntVariable("pgtokdb.idle_timeout",
+		"Seconds a cached kdb+ connection may remain idle before it is closed.",
+		"Zero keeps connections open until the backend exits.",
+		&kconn_idle_timeout, 300, 0, INT_MAX / 1000,
+		PGC_USERSET, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.chunk_rows",
+		"Rows fetched from kdb+ per round trip when streaming a result.",
+		"Zero fetches the whole result in one call.",
+		&kconn_chunk_rows, 0, 0, INT_MAX,
+		PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgtokdb.compress",
+		"Have kdb+ compress large results before sending them.",
+		NULL, &kconn_compress, false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.compress_threshold",
+		"Size above which kdb+ compresses a result when pgtokdb.compress is on.",
+		NULL, &kconn_compress_threshold, 2000, 0, INT_MAX,
+		PGC_USERSET, GUC_UNIT_BYTE, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.connect_timeout",
+		"Time allowed to open a connection to kdb+.",
+		"Zero waits as long as the operating system does.",
+		&kconn_connect_timeout, 10000, 0, INT_MAX,
+		PGC_USERSET, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.query_timeout",
+		"Time allowed for kdb+ to respond to a call.",
+		"Zero waits until kdb+ responds or the statement is cancelled.",
+		&kconn_query_timeout, 0, 0, INT_MAX,
+		PGC_USERSET, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgtokdb.builtin_reader",
+		"Decode kdb+ responses as they are received, rather than with the C API.",
+		NULL, &kconn_builtin_reader, false, PGC_USERSET, 0, NULL, NULL, NULL);
+}
+
+
+/*
+ * Cheap health check of an idle handle. A synchronous connection should have
+ * nothing to read between calls, so readability means the peer has closed the
+ * socket (or sent something we don't expect).
+ */
+bool kconn_alive(I handle)
+{
+	struct pollfd pfd;
+
+	pfd.fd = handle;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, 0) == 0;
+}
+
+
+/*
+ * Close a cached connection and free its slot
+ */
+void kconn_close(KConn *c)
+{
+	if (c->handle > 0)
+		kclose(c->handle);
+	memset(c, 0, sizeof(KConn));
+}
+
+
+/*
+ * Close the connections that have been idle for too long
+ */
+void kconn_expire(void)
+{
+	if (kconn_idle_timeout == 0)
+		return;
+
+	TimestampTz now = GetCurrentTimestamp();
+
+	for (int i = 0; i < KCONN_MAX; i++)
+		if (kconns[i].handle > 0 &&
+			TimestampDifferenceExceeds(kconns[i].lastused, now, kconn_idle_timeout * 1000))
+			kconn_close(&kconns[i]);
+}
+
+
+/*
+ * Release all cached connections when the backend exits
+ */
+void kconn_atexit(int code, Datum arg)
+{
+	for (int i = 0; i < KCONN_MAX; i++)
+		kconn_close(&kconns[i]);
+}
+
+
+/*
+ * Return a healthy cached connection for host/port/userpass, opening one if
+ * necessary. When the cache is full, the least recently used entry is closed.
+ * A connection that can't be opened is reported, or when report is false,
+ * NULL is returned.
+ */
+KConn *kconn_get(const char *host, int port, const char *userpass, bool report)
+{
+	KConn *c = NULL;
+	KConn *lru = &kconns[0];
+
+	for (int i = 0; i < KCONN_MAX; i++)
+	{
+		KConn *p = &kconns[i];
+		if (p->handle > 0 && p->port == port &&
+			strcmp(p->host, host) == 0 && strcmp(p->userpass, userpass) == 0)
+		{
+			c = p;
+			break;
+		}
+		if (p->handle <= 0 || (lru->handle > 0 && p->lastused < lru->lastused))
+			lru = p;
+	}
+
+	/* Discard a cached handle whose peer has gone away */
+	if (c != NULL && !kconn_alive(c->handle))
+	{
+		kconn_close(c);
+		lru = c;
+		c = NULL;
+	}
+
+	if (c == NULL)
+	{
+		kconn_close(lru);
+
+		instr_time start, elapsed;
+		INSTR_TIME_SET_CURRENT(start);
+		I handle = kconn_connect_timeout > 0 ?
+			khpun((S) host, port, (S) userpass, kconn_connect_timeout) :
+			khpu((S) host, port, (S) userpass);
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		kconn_connect_ms += INSTR_TIME_GET_MILLISEC(elapsed);
+
+		if (handle <= 0 && !report)
+			return NULL;
+		if (handle == -2)
+			elog(ERROR, "Timed out after %d ms attempting to connect to kdb+ at %s:%d",
+				kconn_connect_timeout, host, port);
+		else if (handle <= 0)
+			elog(ERROR, "Socket connection error (%d) attempting to connect to kdb+ at %s:%d", 
+				handle, host, port);
+
+		if (!kconn_atexit_set)
+		{
+			on_proc_exit(kconn_atexit, (Datum) 0);
+			kconn_atexit_set = true;
+		}
+
+		c = lru;
+		safecpy(c->host, host, sizeof(c->host));
+		c->port = port;
+		safecpy(c->userpass, userpass, sizeof(c->userpass));
+		c->handle = handle;
+		c->created = GetCurrentTimestamp();
+	}
+
+	return c;
+}
+
+
+/*
+ * Decompress a result tagged by COMPRESS_LAMBDA (consumed); any other result
+ * is returned as is
+ */
+K kconn_inflate(K result)
+{
+	if (result == NULL || result->t != 0 || result->n != 2 ||
+		kK(result)[0]->t != -KS || strcmp(kK(result)[0]->s, "pgtokdb_z") != 0 ||
+		kK(result)[1]->t != KG)
+		return result;
+
+	K x = d9(kK(result)[1]);
+	r0(result);
+	return x;
+}
+
+
+/*
+ * Wait until the socket of a connection is ready for events (POLLIN or
+ * POLLOUT), checking for a cancel request and pgtokdb.query_timeout (counted
+ * from start) meanwhile
+ */
+void kconn_wait(KConn *c, short events, instr_time start)
+{
+	kconn_poll(c->handle, c->host, c->port, events, start);
+}
+
+
+/*
+ * Report that kdb+ at host:port has not responded within pgtokdb.query_timeout
+ */
+void kconn_timeout(const char *host, int port)
+{
+	ereport(ERROR,
+		(errcode(ERRCODE_KDB_QUERY_TIMEOUT),
+		 errmsg("kdb+ at %s:%d did not respond within pgtokdb.query_timeout (%d ms)",
+			host, port, kconn_query_timeout)));
+}
+
+
+/*
+ * Wait until a kdb+ handle (to host:port) is ready for events, as kconn_wait
+ * does
+ */
+void kconn_poll(I handle, const char *host, int port, short events, instr_time start)
+{
+	struct pollfd pfd;
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (kconn_query_timeout > 0)
+		{
+			instr_time elapsed;
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, start);
+			if (INSTR_TIME_GET_MILLISEC(elapsed) >= kconn_query_timeout)
+				kconn_timeout(host, port);
+		}
+
+		pfd.fd = handle;
+		pfd.events = events;
+		pfd.revents = 0;
+
+		int rc = poll(&pfd, 1, KCONN_POLL_MS);
+		if (rc < 0 && errno != EINTR)
+			elog(ERROR, "Error waiting for kdb+ at %s:%d: %m", host, port);
+		if (rc > 0)
+			return;
+	}
+}
+
+
+/*
+ * Serialize x (the expression, or the function followed by its arguments) as
+ * a synchronous request, as k() would send it
+ */
+K kconn_message(K x)
+{
+	K msg = b9(3, x);
+	if (msg == NULL)
+		elog(ERROR, "Unable to serialize call to kdb+");
+	kG(msg)[1] = 1;
+	return msg;
+}
+
+
+/*
+ * Send a serialized request over a connection. Returns false on a network
+ * error.
+ */
+bool kconn_post(KConn *c, K msg, instr_time start)
+{
+	J sent = 0;
+
+	while (sent < msg->n)
+	{
+		kconn_wait(c, POLLOUT, start);
+		J n = send(c->handle, (char *) kG(msg) + sent, msg->n - sent, 0);
+		if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+		if (n > 0)
+			sent += n;
+	}
+
+	return true;
+}
+
+
+/*
+ * Read the response to a call sent over a kdb+ handle (to host:port), with
+ * the built-in reader when pgtokdb.builtin_reader is on, or else once it
+ * starts arriving, with k(). Returns NULL on a network error.
+ */
+K kconn_receive(I handle, const char *host, int port, instr_time start)
+{
+	if (kconn_builtin_reader)
+		return kipc_receive(handle, host, port, start);
+
+	kconn_poll(handle, host, port, POLLIN, start);
+
+	/* The size of the message is peeked from its header, left for k() to read */
+	G header[8];
+	if (recv(handle, (char *) header, sizeof(header), KCONN_PEEK) == sizeof(header))
+	{
+		I size;
+		memcpy(&size, header + 4, sizeof(I));
+		kconn_bytes += size;
+	}
+
+	return k(handle, (S) 0);
+}
+
+
+/*
+ * Send x to kdb+ as a synchronous request and return the response. Returns
+ * NULL on a network error. When the wait is cancelled or times out, the
+ * connection is closed (its response would otherwise be read by the next
+ * call) and the error is raised again; kdb+ then drops the response.
+ */
+K kconn_request(KConn *c, K x)
+{
+	K result = NULL;
+	instr_time start;
+	K msg = kconn_message(x);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	PG_TRY();
+	{
+		if (kconn_post(c, msg, start))
+			result = kconn_receive(c->handle, c->host, c->port, start);
+	}
+	PG_CATCH();
+	{
+		r0(msg);
+		kconn_close(c);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	r0(msg);
+	return result;
+}
+
+
+/*
+ * Wait until one of n connections has a response to read, and return its
+ * index, or return -1 once limit ms (when not negative) have passed since
+ * start. A cancel request and pgtokdb.query_timeout are checked meanwhile.
+ */
+int kconn_race(KConn **cs, int n, instr_time start, double limit)
+{
+	struct pollfd pfd[2];
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		instr_time elapsed;
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		double ms = INSTR_TIME_GET_MILLISEC(elapsed);
+
+		if (kconn_query_timeout > 0 && ms >= kconn_query_timeout)
+			kconn_timeout(cs[0]->host, cs[0]->port);
+		if (limit >= 0 && ms >= limit)
+			return -1;
+
+		for (int i = 0; i < n; i++)
+		{
+			pfd[i].fd = cs[i]->handle;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+
+		int timeout = KCONN_POLL_MS;
+		if (limit >= 0 && limit - ms < timeout)
+			timeout = (int) (limit - ms) + 1;
+
+		int rc = poll(pfd, n, timeout);
+		if (rc < 0 && errno != EINTR)
+			elog(ERROR, "Error waiting for kdb+ at %s:%d: %m", cs[0]->host, cs[0]->port);
+
+		for (int i = 0; rc > 0 && i < n; i++)
+			if (pfd[i].revents != 0)
+				return i;
+	}
+}
+
+
+/*
+ * Send x to the replica primary and, when it has not responded within delay
+ * ms (or has failed), to the replica secondary as well. Returns the first
+ * response (NULL when both fail) and sets *winner to the replica (0 or 1)
+ * that sent it. *sent is kept up to date with the number of replicas the
+ * request has been sent to, which the caller needs when an error is raised.
+ * A connection whose response is left unread is closed.
+ */
+K kconn_hedge(KReplica *primary, KReplica *secondary, const char *userpass, K x,
+	double delay, int *winner, volatile int *sent)
+{
+	KReplica *rs[2] = { primary, secondary };
+	KConn *volatile cs[2] = { NULL, NULL };
+	instr_time start, senttime[2];
+	int nsent = 0;
+	K result = NULL;
+	K msg = kconn_message(x);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			KConn *waiting[2];
+			int which[2];
+			int nwaiting = 0;
+
+			for (int i = 0; i < nsent; i++)
+				if (cs[i] != NULL)
+				{
+					waiting[nwaiting] = cs[i];
+					which[nwaiting++] = i;
+				}
+
+			if (nwaiting == 0 && nsent == 2)
+				break;
+
+			int ready = nwaiting == 0 ? -1 :
+				kconn_race(waiting, nwaiting, start, nsent < 2 ? delay : -1);
+
+			if (ready < 0)
+			{
+				/* The next replica is sent the request (the primary is late or has failed) */
+				int i = nsent++;
+				*sent = nsent;
+				INSTR_TIME_SET_CURRENT(senttime[i]);
+				cs[i] = kconn_get(rs[i]->host, rs[i]->port, userpass, false);
+				if (cs[i] != NULL)
+				{
+					/* Most recently used, so that the other replica's connection can't evict it */
+					cs[i]->lastused = GetCurrentTimestamp();
+					if (!kconn_post(cs[i], msg, start))
+					{
+						kconn_close(cs[i]);
+						cs[i] = NULL;
+					}
+				}
+				if (cs[i] == NULL)
+					kreplica_record(rs[i], 0, false);
+				continue;
+			}
+
+			int i = which[ready];
+			K r = kconn_receive(cs[i]->handle, cs[i]->host, cs[i]->port, start);
+
+			instr_time elapsed;
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, senttime[i]);
+			kreplica_record(rs[i], INSTR_TIME_GET_MILLISEC(elapsed), r != NULL);
+
+			if (r == NULL)
+			{
+				kconn_close(cs[i]);
+				cs[i] = NULL;
+				continue;
+			}
+
+			cs[i]->uses++;
+			cs[i]->lastused = GetCurrentTimestamp();
+			result = r;
+			*winner = i;
+
+			/* A primary that lost took at least as long as it has been waiting */
+			if (i == 1 && cs[0] != NULL)
+			{
+				INSTR_TIME_SET_CURRENT(elapsed);
+				INSTR_TIME_SUBTRACT(elapsed, senttime[0]);
+				kreplica_record(rs[0], INSTR_TIME_GET_MILLISEC(elapsed), true);
+			}
+
+			/* The other response would otherwise be read by the next call */
+			if (nsent == 2 && cs[1 - i] != NULL)
+				kconn_close(cs[1 - i]);
+			break;
+		}
+	}
+	PG_CATCH();
+	{
+		r0(msg);
+		for (int i = 0; i < 2; i++)
+			if (cs[i] != NULL)
+				kconn_close(cs[i]);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	r0(msg);
+	return result;
+}
+
+
+/*
+ * Send x to one kdb+ process, through a proxy worker (see proxy.c) unless
+ * proxy is false, or a cached connection. If a reused handle turns out to be
+ * broken, it is reopened and the call is sent once more. Returns NULL on a
+ * network error (the handle is then dropped from the cache) and, unless
+ * report is set, when no connection can be opened.
+ */
+K kconn_direct(const char *host, int port, const char *userpass, K x, bool report, bool proxy)
+{
+	/* Calls to the processes served by the proxy workers go through them */
+	int target = proxy ? kproxy_target(host, port, userpass) : -1;
+	if (target >= 0)
+	{
+		bool queued;
+		K result = kproxy_call(target, x, kconn_query_timeout, &queued);
+		if (queued)
+			return result;
+	}
+
+	KConn *c = kconn_get(host, port, userpass, report);
+	if (c == NULL)
+		return NULL;
+	bool reused = c->uses > 0;
+
+	K result = kconn_request(c, x);
+
+	if (result == NULL && reused)
+	{
+		kconn_close(c);
+		if ((c = kconn_get(host, port, userpass, report)) == NULL)
+			return NULL;
+		result = kconn_request(c, x);
+	}
+
+	if (result == NULL)
+	{
+		kconn_close(c);
+		return NULL;
+	}
+
+	c->uses++;
+	c->lastused = GetCurrentTimestamp();
+	return result;
+}
+
+
+/*
+ * Send x to the best of a list of replicas (see replica.c), trying the others
+ * in turn while it fails, including when it doesn't respond within
+ * pgtokdb.query_timeout. Unless the caller needs the index into the list of
+ * the replica that responded (in *replica), a slow call is hedged. proxy is
+ * passed on to kconn_direct. Returns NULL when no replica responds.
+ */
+K kconn_route(const char *hosts, int port, const char *userpass, K x, int *replica, bool proxy)
+{
+	KReplica *list[KREPLICA_LIST];
+	int order[KREPLICA_LIST];
+	int n = kreplica_list(hosts, port, list);
+	MemoryContext mcxt = CurrentMemoryContext;
+
+	kreplica_rank(list, n, order);
+
+	for (int i = 0; i < n; i++)
+	{
+		KReplica *r = list[order[i]];
+		KReplica *next = i + 1 < n ? list[order[i + 1]] : NULL;
+		double delay = replica == NULL && next != NULL ? kreplica_hedge_ms(r) : -1;
+		K volatile result = NULL;
+		volatile int sent = 0;
+		bool timedout = false;
+
+		instr_time start, elapsed;
+		INSTR_TIME_SET_CURRENT(start);
+
+		/*
+		 * A replica that doesn't respond before the call is given up is
+		 * failing. The call moves on when the replica times out, whose error
+		 * is raised while only waiting (the connection is closed by then), 
+		 * and fails on a cancel request or statement_timeout, which say
+		 * nothing about the replicas.
+		 */
+		PG_TRY();
+		{
+			if (delay >= 0)
+			{
+				int winner = 0;
+				result = kconn_hedge(r, next, userpass, x, delay, &winner, &sent);
+			}
+			else
+				result = kconn_direct(r->host, r->port, userpass, x, false, proxy);
+		}
+		PG_CATCH();
+		{
+			MemoryContextSwitchTo(mcxt);
+			ErrorData *err = CopyErrorData();
+
+			if (err->sqlerrcode != ERRCODE_KDB_QUERY_TIMEOUT)
+				PG_RE_THROW();
+
+			/* The next replica is late too only if the hedge had reached it */
+			kreplica_record(r, 0, false);
+			if (delay >= 0 && sent == 2)
+				kreplica_record(next, 0, false);
+
+			FlushErrorState();
+			elog(DEBUG1, "%s", err->message);
+			FreeErrorData(err);
+			timedout = true;
+		}
+		PG_END_TRY();
+
+		/* A hedged call has been sent to this replica and the next */
+		if (delay >= 0)
+		{
+			i++;
+			if (result != NULL)
+				return result;
+			continue;
+		}
+
+		if (timedout)
+			continue;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		kreplica_record(r, INSTR_TIME_GET_MILLISEC(elapsed), result != NULL);
+
+		if (result != NULL)
+		{
+			if (replica != NULL)
+				*replica = order[i];
+			return result;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Call kdb+ on the process named by host and port, or on one of the replicas
+ * when host is a list (see kconn_route). Returns NULL on a network error.
+ * With pgtokdb.compress on, kdb+ compresses a large result, which is
+ * decompressed here. Unless proxy is set, the call is sent over the
+ * backend's own connection even to a process served by the proxy workers.
+ */
+K kconn_invoke(const char *host, int port, const char *userpass, S expr, K args, int *replica,
+	bool proxy)
+{
+	kconn_expire();
+
+	K x = getset_expr(expr, args != NULL ? args : ktn(0, 0));
+
+	if (kconn_compress)
+		x = getset_expr(COMPRESS_LAMBDA, knk(2, kj(kconn_compress_threshold), x));
+
+	K result = kreplica_is_list(host) ?
+		kconn_route(host, port, userpass, x, replica, proxy) :
+		kconn_direct(host, port, userpass, x, true, proxy);
+
+	r0(x);
+	return kconn_compress ? kconn_inflate(result) : result;
+}
+
+
+/*
+ * Call kdb+ through a cached connection, a proxy worker, or (for a list of
+ * replicas in pgtokdb.host) the best replica. Returns NULL on a network
+ * error.
+ */
+K kconn_call(const char *host, int port, const char *userpass, S expr, K args)
+{
+	return kconn_invoke(host, port, userpass, expr, args, NULL, true);
+}
+
+
+/*
+ * Return a healthy cached handle for a caller that exchanges messages on it
+ * directly (e.g. asynchronous requests). A handle left in an unknown state
+ * must be given back with kconn_discard.
+ */
+I kconn_open(const char *host, int port, const char *userpass)
+{
+	kconn_expire();
+
+	/* The caller exchanges messages with a single replica */
+	kreplica_pick(&host, &port);
+
+	KConn *c = kconn_get(host, port, userpass, true);
+	c->uses++;
+	c->lastused = GetCurrentTimestamp();
+	return c->handle;
+}
+
+
+/*
+ * Close a cached handle, e.g. one with a reply still outstanding
+ */
+void kconn_discard(I handle)
+{
+	for (int i = 0; i < KCONN_MAX; i++)
+		if (kconns[i].handle == handle)
+			kconn_close(&kconns[i]);
+}
+
+
+/*
+ * Send an asynchronous message over a cached connection that is already open.
+ * Used for cleanup, so it never raises an error; the message is dropped when
+ * there is no usable handle.
+ */
+void kconn_send(const char *host, int port, const char *userpass, S expr, K args)
+{
+	for (int i = 0; i < KCONN_MAX; i++)
+	{
+		KConn *c = &kconns[i];
+		if (c->handle > 0 && c->port == port &&
+			strcmp(c->host, host) == 0 && strcmp(c->userpass, userpass) == 0)
+		{
+			if (kconn_alive(c->handle))
+			{
+				/* Async k() gives back nothing but releases the arguments */
+				kk(-c->handle, expr, args);
+				args->n = 0;
+				r0(args);
+				return;
+			}
+			break;
+		}
+	}
+
+	r0(args);
+}
+
+
+/*
+ * The replica holding a cursor opened on a list of replicas (see
+ * kcursor_open), and the id of the cursor there
+ */
+void kcursor_replica(const char **host, int *port, J *id)
+{
+	KReplica *list[KREPLICA_LIST];
+
+	if (!kreplica_is_list(*host))
+		return;
+
+	int n = kreplica_list(*host, *port, list);
+	int i = (int) (*id % KREPLICA_LIST);
+	if (i >= n)
+		elog(ERROR, "kdb+ cursor is not on a replica listed by pgtokdb.host");
+
+	*host = list[i]->host;
+	*port = list[i]->port;
+	*id /= KREPLICA_LIST;
+}
+
+
+/*
+ * Evaluate x on kdb+ into a cursor holding the result, keeping only the
+ * columns named in cols (all columns when cols is empty). Returns the id of
+ * the cursor (see .pgtokdb.copen in pgtokdb.q). Cursors bypass the proxy
+ * workers: kdb+ releases a cursor when the handle that opened it closes, and
+ * kcursor_close sends over the backend's own connection.
+ */
+J kcursor_open(const char *host, int port, const char *userpass, K cols, K x)
+{
+	int replica = 0;
+	K result = kconn_invoke(host, port, userpass, ".pgtokdb.copen", knk(2, cols, x), &replica, false);
+
+	if (result != NULL && result->t == -KJ)
+	{
+		/* A cursor on one of a list of replicas is read from that one */
+		J id = kreplica_is_list(host) ? result->j * KREPLICA_LIST + replica : result->j;
+		r0(result);
+		return id;
+	}
+
+	/* Report a network error, a kdb+ error or a result that is not a table */
+	ktable_check(result);
+	r0(result);
+	elog(ERROR, "Result from kdb+ must be unkeyed table");
+	return 0;
+}
+
+
+/*
+ * Fetch the next n rows from a kdb+ cursor. A chunk with fewer than n rows
+ * is the last one; kdb+ has then already released the cursor.
+ */
+K kcursor_fetch(const char *host, int port, const char *userpass, J id, J n)
+{
+	kcursor_replica(&host, &port, &id);
+	K result = kconn_invoke(host, port, userpass, ".pgtokdb.cfetch", knk(2, kj(id), kj(n)), NULL, false);
+	ktable_check(result);
+	return result;
+}
+
+
+/*
+ * Claim the next n rows of a kdb+ cursor shared by several processes. The
+ * cursor stays open (past its end, the slices are empty) until it is closed.
+ */
+K kcursor_slice(const char *host, int port, const char *userpass, J id, J n)
+{
+	kcursor_replica(&host, &port, &id);
+	K result = kconn_invoke(host, port, userpass, ".pgtokdb.cslice", knk(2, kj(id), kj(n)), NULL, false);
+	ktable_check(result);
+	return result;
+}
+
+
+/*
+ * Release a kdb+ cursor that has not been read to the end
+ */
+void kcursor_close(const char *host, int port, const char *userpass, J id)
+{
+	kcursor_replica(&host, &port, &id);
+	kconn_send(host, port, userpass, ".pgtokdb.cclose", knk(1, kj(id)));
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(connections);
+
+/*
+ * Report the connections cached by the calling backend
+ */
+PGDLLEXPORT Datum connections(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "Function must be called in a context that accepts a set");
+
+	TupleDesc tupdesc;
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	Tuplestorestate *tupstore = tuplestore_begin_heap(false, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	for (int i = 0; i < KCONN_MAX; i++)
+	{
+		KConn *c = &kconns[i];
+		Datum values[6];
+		bool nulls[6] = { false };
+
+		if (c->handle <= 0)
+			continue;
+
+		values[0] = PointerGetDatum(cstring_to_text(c->host));
+		values[1] = Int32GetDatum(c->port);
+		values[2] = Int32GetDatum(c->handle);
+		values[3] = Int64GetDatum(c->uses);
+		values[4] = TimestampTzGetDatum(c->created);
+		values[5] = TimestampTzGetDatum(c->lastused);
+		nulls[5] = c->uses == 0;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
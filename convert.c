@@ -16,6 +16,8 @@
  */
 
 #include "pgtokdb.h"
+#include <utils/memutils.h>
+#include <utils/lsyscache.h>
 
 int		_k2p_bool(K, int, char *);
 int16	_k2p_int2(K, int, char *);
@@ -27,6 +29,11 @@ uint8	_k2p_char(K, int, char *);
 int64	_k2p_timestamp(K, int, char *);
 int32	_k2p_date(K, int, char *);
 Datum 	_k2p_array(K, int, signed char, char *, char *);
+K		_p2k_array(Datum, Oid, signed char);
+K		_p2k_strarray(Datum, bool);
+K		_p2k_tsarray(Datum, Oid);
+Datum	ksym_text(KSymCache *, S);
+void	ksym_grow(KSymCache *);
 
 
 K p2k_bool(Datum x)
@@ -94,6 +101,209 @@ K p2k_bytea(Datum x)
 }
 
 
+K p2k_numeric(Datum x)
+{
+	return kf(DatumGetFloat8(DirectFunctionCall1(numeric_float8, x)));
+}
+
+/* Convert a Postgres smallint[] to a kdb+ short list (H) */
+K p2k_int2array(Datum x)
+{
+	return _p2k_array(x, INT2OID, KH);
+}
+
+/* Convert a Postgres integer[] to a kdb+ int list (I) */
+K p2k_int4array(Datum x)
+{
+	return _p2k_array(x, INT4OID, KI);
+}
+
+/* Convert a Postgres bigint[] to a kdb+ long list (J) */
+K p2k_int8array(Datum x)
+{
+	return _p2k_array(x, INT8OID, KJ);
+}
+
+/* Convert a Postgres real[] to a kdb+ real list (E) */
+K p2k_float4array(Datum x)
+{
+	return _p2k_array(x, FLOAT4OID, KE);
+}
+
+/* Convert a Postgres double precision[] to a kdb+ float list (F) */
+K p2k_float8array(Datum x)
+{
+	return _p2k_array(x, FLOAT8OID, KF);
+}
+
+/* Convert a Postgres boolean[] to a kdb+ boolean list (B) */
+K p2k_boolarray(Datum x)
+{
+	return _p2k_array(x, BOOLOID, KB);
+}
+
+/* Convert a Postgres date[] to a kdb+ date list (D); both count days from 2000.01.01 */
+K p2k_datearray(Datum x)
+{
+	return _p2k_array(x, DATEOID, KD);
+}
+
+/* Convert a Postgres uuid[] to a kdb+ GUID list (G) */
+K p2k_uuidarray(Datum x)
+{
+	return _p2k_array(x, UUIDOID, UU);
+}
+
+/* Convert a Postgres timestamp[] to a kdb+ timestamp list (P) */
+K p2k_timestamparray(Datum x)
+{
+	return _p2k_tsarray(x, TIMESTAMPOID);
+}
+
+/* Convert a Postgres timestamptz[] to a kdb+ timestamp list (P), as UTC */
+K p2k_timestamptzarray(Datum x)
+{
+	return _p2k_tsarray(x, TIMESTAMPTZOID);
+}
+
+/* Convert a Postgres numeric[] to a kdb+ float list (F), as p2k_numeric does */
+K p2k_numericarray(Datum x)
+{
+	ArrayType *array = DatumGetArrayTypeP(x);
+	Datum *elems;
+	bool *nulls;
+	int n;
+
+	if (ARR_ELEMTYPE(array) != NUMERICOID || ARR_NDIM(array) > 1)
+		elog(ERROR, "Only one-dimensional arrays can be converted to kdb+ lists");
+
+	deconstruct_array(array, NUMERICOID, -1, false, 'i', &elems, &nulls, &n);
+
+	K list = ktn(KF, n);
+	for (int i = 0; i < n; i++)
+		kF(list)[i] = nulls[i] ? nf : 
+			DatumGetFloat8(DirectFunctionCall1(numeric_float8, elems[i]));
+
+	pfree(elems);
+	pfree(nulls);
+	return list;
+}
+
+/* Convert a Postgres text[] to a kdb+ symbol list (S) */
+K p2k_textarray(Datum x)
+{
+	return _p2k_strarray(x, true);
+}
+
+/* Convert a Postgres varchar[] to a kdb+ list of strings */
+K p2k_varchararray(Datum x)
+{
+	return _p2k_strarray(x, false);
+}
+
+/*
+ * Convert a one-dimensional Postgres array of a fixed-width type to a kdb+ 
+ * list. The array's payload has the layout of the kdb+ list, so without
+ * nulls it is copied in one go; nulls become kdb+ nulls (zeros for types
+ * without one).
+ *
+ * x      - Postgres array
+ * elmtype - Expected element type
+ * ktype  - Type of the kdb+ list
+ */
+K _p2k_array(Datum x, Oid elmtype, signed char ktype)
+{
+	ArrayType *array = DatumGetArrayTypeP(x);
+
+	if (ARR_ELEMTYPE(array) != elmtype || ARR_NDIM(array) > 1)
+		elog(ERROR, "Only one-dimensional arrays can be converted to kdb+ lists");
+
+	int n = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	int16 elmlen = get_typlen(elmtype);
+	K list = ktn(ktype, n);
+
+	if (!ARR_HASNULL(array))
+	{
+		memcpy(kG(list), ARR_DATA_PTR(array), (Size) n * elmlen);
+		return list;
+	}
+
+	bits8 *bitmap = ARR_NULLBITMAP(array);
+	char *p = ARR_DATA_PTR(array);
+	char *q = (char *) kG(list);
+
+	for (int i = 0; i < n; i++, q += elmlen)
+	{
+		if (bitmap[i / 8] & (1 << (i % 8)))
+		{
+			memcpy(q, p, elmlen);
+			p += elmlen; /* Elements are aligned on their own width */
+			continue;
+		}
+
+		switch (ktype)
+		{
+			case KH: *(H *) q = nh; break;
+			case KI: case KD: *(I *) q = ni; break;
+			case KJ: case KP: *(J *) q = nj; break;
+			case KE: *(E *) q = (E) nf; break;
+			case KF: *(F *) q = nf; break;
+			default: memset(q, 0, elmlen); break;
+		}
+	}
+
+	return list;
+}
+
+/*
+ * Convert a one-dimensional Postgres array of timestamps (elmtype of 
+ * timestamp or timestamptz, both microseconds from 2000.01.01) to a kdb+ 
+ * timestamp list
+ */
+K _p2k_tsarray(Datum x, Oid elmtype)
+{
+	K list = _p2k_array(x, elmtype, KP);
+	for (J i = 0; i < list->n; i++)
+		if (kJ(list)[i] != nj)
+			kJ(list)[i] *= 1000; /* Microseconds to nanoseconds */
+	return list;
+}
+
+/*
+ * Convert a one-dimensional Postgres array of text or varchar to a kdb+ list 
+ * of symbols (syms true) or strings. Nulls become empty symbols or strings.
+ */
+K _p2k_strarray(Datum x, bool syms)
+{
+	ArrayType *array = DatumGetArrayTypeP(x);
+	Datum *elems;
+	bool *nulls;
+	int n;
+
+	if (ARR_NDIM(array) > 1)
+		elog(ERROR, "Only one-dimensional arrays can be converted to kdb+ lists");
+
+	deconstruct_array(array, ARR_ELEMTYPE(array), -1, false, 'i', &elems, &nulls, &n);
+
+	K list = ktn(syms ? KS : 0, n);
+	for (int i = 0; i < n; i++)
+	{
+		if (syms)
+			kS(list)[i] = ss(nulls[i] ? "" : text_to_cstring(DatumGetTextPP(elems[i])));
+		else if (nulls[i])
+			kK(list)[i] = ktn(KC, 0);
+		else
+		{
+			text *t = DatumGetTextPP(elems[i]);
+			kK(list)[i] = kpn(VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+		}
+	}
+
+	pfree(elems);
+	pfree(nulls);
+	return list;
+}
+
 
 static const char *k2p_msg = "Unable to convert kdb+ column '%s' to %s";
 
@@ -211,6 +421,20 @@ double _k2p_float8(K c, int i, char *n)
 	}
 }
 
+/* Numeric results mostly come from pushed-down aggregates (e.g. sum of bigint) */
+Datum k2p_numeric(K c, int i, char *n)
+{
+	switch (c->t)
+	{
+		case KH: return DirectFunctionCall1(int2_numeric, Int16GetDatum(kH(c)[i]));
+		case KI: return DirectFunctionCall1(int4_numeric, Int32GetDatum(kI(c)[i]));
+		case KJ: return DirectFunctionCall1(int8_numeric, Int64GetDatum(kJ(c)[i]));
+		case KE: return DirectFunctionCall1(float4_numeric, Float4GetDatum(kE(c)[i]));
+		case KF: return DirectFunctionCall1(float8_numeric, Float8GetDatum(kF(c)[i]));
+		default: elog(ERROR, k2p_msg, n, "numeric");
+	}
+}
+
 //! cleanup
 Datum k2p_varchar(K c, int i, char *n)
 {
@@ -321,7 +545,10 @@ Datum k2p_float8array(K c, int i, char *n)
 }
 
 /*
- * Convert row of a table column (containing lists) to a Postgres array. 
+ * Convert row of a table column (containing lists) to a Postgres array. The
+ * elements of a kdb+ list have the same width and layout as those of the
+ * matching Postgres array, so the array is sized once and the list's payload
+ * is copied straight into it.
  *
  * klol   - kdb+ list of lists, representing a table column: ([] jj:(1 2;3 4 5))
  * krow   - Index into above (specifies a table row)
@@ -333,8 +560,6 @@ Datum _k2p_array(K klol, int krow, signed char ktype, char *kname, char *pgtype)
 {
 	Oid 	elmtype;
 	int 	elmlen;
-	char 	elmalign;
-	int 	i;
 
 	if (klol->t != 0) /* It must be a list */
 		elog(ERROR, k2p_msg, kname, pgtype);
@@ -343,46 +568,322 @@ Datum _k2p_array(K klol, int krow, signed char ktype, char *kname, char *pgtype)
 	if (list->t != ktype)
 		elog(ERROR, k2p_msg, kname, pgtype);
 
-	int arrlen = list->n;  /* Number of elements */
-	Datum *data = (Datum *) palloc0(arrlen * sizeof(Datum));
-
 	switch (list->t)
 	{
-		case KH:
-			elmtype = INT2OID; elmlen = sizeof(int16); elmalign = 's';
-			for (i = 0; i < arrlen; i++)
-				data[i] = Int16GetDatum(kH(list)[i]);
-			break;		
-
-		case KI:
-			elmtype = INT4OID; elmlen = sizeof(int32); elmalign = 'i';
-			for (i = 0; i < arrlen; i++)
-				data[i] = Int32GetDatum(kI(list)[i]);
-			break;
-
-		case KJ:
-			elmtype = INT8OID; elmlen = sizeof(int64); elmalign = 'd';
-			for (i = 0; i < arrlen; i++)
-				data[i] = Int64GetDatum(kJ(list)[i]);
-			break;
-
-		case KE:
-			elmtype = FLOAT4OID; elmlen = sizeof(float4); elmalign = 'i';
-			for (i = 0; i < arrlen; i++)
-				data[i] = Float4GetDatum(kE(list)[i]);
-			break;
-
-		case KF:
-			elmtype = FLOAT8OID; elmlen = sizeof(float8); elmalign = 'd';
-			for (i = 0; i < arrlen; i++)
-				data[i] = Float8GetDatum(kF(list)[i]);
-			break;
-
-		default:
-			elog(ERROR, k2p_msg, kname, pgtype);
+		case KH: elmtype = INT2OID; elmlen = sizeof(int16); break;
+		case KI: elmtype = INT4OID; elmlen = sizeof(int32); break;
+		case KJ: elmtype = INT8OID; elmlen = sizeof(int64); break;
+		case KE: elmtype = FLOAT4OID; elmlen = sizeof(float4); break;
+		case KF: elmtype = FLOAT8OID; elmlen = sizeof(float8); break;
+		default: elog(ERROR, k2p_msg, kname, pgtype);
 	}
 
-	ArrayType *array = construct_array(data, arrlen, elmtype, elmlen, true, elmalign);
-	pfree(data);
+	int arrlen = list->n;  /* Number of elements */
+	if (arrlen == 0)
+		return PointerGetDatum(construct_empty_array(elmtype));
+
+	/* One-dimensional array without a null bitmap; the data is MAXALIGN'ed */
+	Size nbytes = ARR_OVERHEAD_NONULLS(1) + (Size) arrlen * elmlen;
+	if (!AllocSizeIsValid(nbytes))
+		elog(ERROR, "Array in kdb+ column '%s' is too large", kname);
+
+	ArrayType *array = (ArrayType *) palloc(nbytes);
+	memset(array, 0, ARR_OVERHEAD_NONULLS(1)); /* Header and its padding */
+	SET_VARSIZE(array, nbytes);
+	array->ndim = 1;
+	array->dataoffset = 0; /* No null bitmap */
+	array->elemtype = elmtype;
+	ARR_DIMS(array)[0] = arrlen;
+	ARR_LBOUND(array)[0] = 1;
+	memcpy(ARR_DATA_PTR(array), kG(list), (Size) arrlen * elmlen);
+
 	return PointerGetDatum(array);
 }
+
+
+/*
+ * Column kernels convert a run of n rows of a kdb+ column, starting at row s,
+ * into a buffer of Datums. The kernel is chosen once per column from the
+ * Postgres type and the kdb+ column type, so the conversion loops carry no
+ * type dispatch and those over fixed-width columns can be vectorized.
+ */
+#define K2PCOL_COPY(fn, ctype, acc, todatum) \
+static void fn(K c, J s, int n, Datum *out, char *name) \
+{ \
+	const ctype *p = (const ctype *) acc(c) + s; \
+	for (int r = 0; r < n; r++) \
+		out[r] = todatum(p[r]); \
+}
+
+/* Kernels for columns that need a per-row conversion (references, lists) */
+#define K2PCOL_CELLS(fn, k2p) \
+static void fn(K c, J s, int n, Datum *out, char *name) \
+{ \
+	for (int r = 0; r < n; r++) \
+		out[r] = k2p(c, (int) (s + r), name); \
+}
+
+#define KP2TS(x) TimestampGetDatum((x) / 1000) /* Remove nanoseconds */
+
+K2PCOL_COPY(k2pc_bool_b, G, kG, BoolGetDatum)
+K2PCOL_COPY(k2pc_int2_g, G, kG, Int16GetDatum)
+K2PCOL_COPY(k2pc_int2_c, C, kC, Int16GetDatum)
+K2PCOL_COPY(k2pc_int2_h, H, kH, Int16GetDatum)
+K2PCOL_COPY(k2pc_int4_g, G, kG, Int32GetDatum)
+K2PCOL_COPY(k2pc_int4_c, C, kC, Int32GetDatum)
+K2PCOL_COPY(k2pc_int4_h, H, kH, Int32GetDatum)
+K2PCOL_COPY(k2pc_int4_i, I, kI, Int32GetDatum)
+K2PCOL_COPY(k2pc_int8_g, G, kG, Int64GetDatum)
+K2PCOL_COPY(k2pc_int8_c, C, kC, Int64GetDatum)
+K2PCOL_COPY(k2pc_int8_h, H, kH, Int64GetDatum)
+K2PCOL_COPY(k2pc_int8_i, I, kI, Int64GetDatum)
+K2PCOL_COPY(k2pc_int8_j, J, kJ, Int64GetDatum)
+K2PCOL_COPY(k2pc_float4_h, H, kH, Float4GetDatum)
+K2PCOL_COPY(k2pc_float4_i, I, kI, Float4GetDatum)
+K2PCOL_COPY(k2pc_float4_j, J, kJ, Float4GetDatum)
+K2PCOL_COPY(k2pc_float4_e, E, kE, Float4GetDatum)
+K2PCOL_COPY(k2pc_float4_f, F, kF, Float4GetDatum)
+K2PCOL_COPY(k2pc_float8_h, H, kH, Float8GetDatum)
+K2PCOL_COPY(k2pc_float8_i, I, kI, Float8GetDatum)
+K2PCOL_COPY(k2pc_float8_j, J, kJ, Float8GetDatum)
+K2PCOL_COPY(k2pc_float8_e, E, kE, Float8GetDatum)
+K2PCOL_COPY(k2pc_float8_f, F, kF, Float8GetDatum)
+K2PCOL_COPY(k2pc_timestamp_p, J, kJ, KP2TS)
+K2PCOL_COPY(k2pc_date_d, I, kI, Int32GetDatum)
+
+K2PCOL_CELLS(k2pc_varchar, k2p_varchar)
+K2PCOL_CELLS(k2pc_uuid, k2p_uuid)
+K2PCOL_CELLS(k2pc_bytea, k2p_bytea)
+K2PCOL_CELLS(k2pc_numeric, k2p_numeric)
+K2PCOL_CELLS(k2pc_int2array, k2p_int2array)
+K2PCOL_CELLS(k2pc_int4array, k2p_int4array)
+K2PCOL_CELLS(k2pc_int8array, k2p_int8array)
+K2PCOL_CELLS(k2pc_float4array, k2p_float4array)
+K2PCOL_CELLS(k2pc_float8array, k2p_float8array)
+
+/*
+ * Text Datums of kdb+ symbols, built once per distinct symbol for the
+ * duration of a call. The C API interns symbols (and never frees them), so
+ * a symbol is identified by its pointer, and a column such as sym of a 10M
+ * row result costs one text per distinct value instead of one per row. The
+ * kernel below uses the cache made current by ksym_use. The texts are shared
+ * by the rows, so they must not be pfree'd by the caller.
+ */
+struct KSymCache
+{
+	MemoryContext mcxt;		/* Holds the cache and its texts */
+	int			size;		/* Slots (a power of 2) */
+	int			used;		/* Symbols cached */
+	S		   *keys;		/* Symbol of each slot (NULL if free) */
+	Datum	   *values;		/* Its text */
+};
+
+/* Most symbols cached per call (0 disables the cache) */
+int ksym_max = 65536;
+
+static KSymCache *ksym_current = NULL;
+
+/* Slot of a symbol (Fibonacci hashing of its pointer) */
+#define KSYM_SLOT(s, size) \
+	((int) ((((uint64) (uintptr_t) (s) * UINT64CONST(0x9E3779B97F4A7C15)) >> 32) & ((size) - 1)))
+
+/*
+ * Create a symbol cache in a child of mcxt (NULL when pgtokdb.symbol_cache 
+ * is 0)
+ */
+KSymCache *ksym_create(MemoryContext mcxt)
+{
+	if (ksym_max == 0)
+		return NULL;
+
+	mcxt = AllocSetContextCreate(mcxt, "pgtokdb symbols", ALLOCSET_DEFAULT_SIZES);
+
+	KSymCache *sc = (KSymCache *) MemoryContextAlloc(mcxt, sizeof(KSymCache));
+	sc->mcxt = mcxt;
+	sc->size = 256;
+	sc->used = 0;
+	sc->keys = (S *) MemoryContextAllocZero(mcxt, sc->size * sizeof(S));
+	sc->values = (Datum *) MemoryContextAlloc(mcxt, sc->size * sizeof(Datum));
+	return sc;
+}
+
+/*
+ * Release a symbol cache and its texts
+ */
+void ksym_free(KSymCache *sc)
+{
+	if (ksym_current == sc)
+		ksym_current = NULL;
+	if (sc != NULL)
+		MemoryContextDelete(sc->mcxt);
+}
+
+/*
+ * Make the cache used by the conversions that follow (NULL for none). Every
+ * caller of the column kernels sets it before converting.
+ */
+void ksym_use(KSymCache *sc)
+{
+	ksym_current = sc;
+}
+
+/*
+ * Double the slots of a cache
+ */
+void ksym_grow(KSymCache *sc)
+{
+	int size = sc->size * 2;
+	S *keys = (S *) MemoryContextAllocZero(sc->mcxt, size * sizeof(S));
+	Datum *values = (Datum *) MemoryContextAlloc(sc->mcxt, size * sizeof(Datum));
+
+	for (int i = 0; i < sc->size; i++)
+	{
+		if (sc->keys[i] == NULL)
+			continue;
+		int j = KSYM_SLOT(sc->keys[i], size);
+		while (keys[j] != NULL)
+			j = (j + 1) & (size - 1);
+		keys[j] = sc->keys[i];
+		values[j] = sc->values[i];
+	}
+
+	pfree(sc->keys);
+	pfree(sc->values);
+	sc->keys = keys;
+	sc->values = values;
+	sc->size = size;
+}
+
+/*
+ * Text of a symbol, from the cache or added to it. Once the cache holds
+ * pgtokdb.symbol_cache symbols, others are converted in the current context.
+ */
+Datum ksym_text(KSymCache *sc, S s)
+{
+	int i = KSYM_SLOT(s, sc->size);
+
+	for (; sc->keys[i] != NULL; i = (i + 1) & (sc->size - 1))
+		if (sc->keys[i] == s)
+			return sc->values[i];
+
+	if (sc->used >= ksym_max)
+		return (Datum) cstring_to_text(s);
+
+	/* Keep the table at most half full */
+	if (2 * (sc->used + 1) > sc->size)
+	{
+		ksym_grow(sc);
+		for (i = KSYM_SLOT(s, sc->size); sc->keys[i] != NULL; i = (i + 1) & (sc->size - 1))
+			;
+	}
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(sc->mcxt);
+	sc->keys[i] = s;
+	sc->values[i] = (Datum) cstring_to_text(s);
+	sc->used++;
+	MemoryContextSwitchTo(oldcontext);
+
+	return sc->values[i];
+}
+
+/* Symbols to text, through the current symbol cache (runs of a symbol are common) */
+static void k2pc_varchar_s(K c, J s, int n, Datum *out, char *name)
+{
+	const S *p = kS(c) + s;
+	KSymCache *sc = ksym_current;
+
+	if (sc == NULL)
+	{
+		for (int r = 0; r < n; r++)
+			out[r] = (Datum) cstring_to_text(p[r]);
+		return;
+	}
+
+	S last = NULL;
+	Datum d = (Datum) 0;
+	for (int r = 0; r < n; r++)
+	{
+		if (p[r] != last)
+			d = ksym_text(sc, last = p[r]);
+		out[r] = d;
+	}
+}
+
+/* An empty column has nothing to convert, whatever its type */
+static void k2pc_none(K c, J s, int n, Datum *out, char *name)
+{
+}
+
+/* Kernel for each supported pair of Postgres type and kdb+ column type */
+static const struct
+{
+	Oid			typeoid;
+	signed char	ktype;
+	K2PCOL		kernel;
+} k2pcols[] =
+{
+	{ BOOLOID,			KB,	k2pc_bool_b },
+	{ INT2OID,			KG,	k2pc_int2_g },
+	{ INT2OID,			KC,	k2pc_int2_c },
+	{ INT2OID,			KH,	k2pc_int2_h },
+	{ INT4OID,			KG,	k2pc_int4_g },
+	{ INT4OID,			KC,	k2pc_int4_c },
+	{ INT4OID,			KH,	k2pc_int4_h },
+	{ INT4OID,			KI,	k2pc_int4_i },
+	{ INT8OID,			KG,	k2pc_int8_g },
+	{ INT8OID,			KC,	k2pc_int8_c },
+	{ INT8OID,			KH,	k2pc_int8_h },
+	{ INT8OID,			KI,	k2pc_int8_i },
+	{ INT8OID,			KJ,	k2pc_int8_j },
+	{ FLOAT4OID,		KH,	k2pc_float4_h },
+	{ FLOAT4OID,		KI,	k2pc_float4_i },
+	{ FLOAT4OID,		KJ,	k2pc_float4_j },
+	{ FLOAT4OID,		KE,	k2pc_float4_e },
+	{ FLOAT4OID,		KF,	k2pc_float4_f },
+	{ FLOAT8OID,		KH,	k2pc_float8_h },
+	{ FLOAT8OID,		KI,	k2pc_float8_i },
+	{ FLOAT8OID,		KJ,	k2pc_float8_j },
+	{ FLOAT8OID,		KE,	k2pc_float8_e },
+	{ FLOAT8OID,		KF,	k2pc_float8_f },
+	{ TIMESTAMPOID,		KP,	k2pc_timestamp_p },
+	{ TIMESTAMPTZOID,	KP,	k2pc_timestamp_p },
+	{ DATEOID,			KD,	k2pc_date_d },
+	{ VARCHAROID,		KS,	k2pc_varchar_s },
+	{ VARCHAROID,		KC,	k2pc_varchar },
+	{ VARCHAROID,		0,	k2pc_varchar },
+	{ TEXTOID,			KS,	k2pc_varchar_s },
+	{ TEXTOID,			KC,	k2pc_varchar },
+	{ TEXTOID,			0,	k2pc_varchar },
+	{ BPCHAROID,		KS,	k2pc_varchar_s },
+	{ BPCHAROID,		KC,	k2pc_varchar },
+	{ BPCHAROID,		0,	k2pc_varchar },
+	{ UUIDOID,			UU,	k2pc_uuid },
+	{ BYTEAOID,			0,	k2pc_bytea },
+	{ NUMERICOID,		KH,	k2pc_numeric },
+	{ NUMERICOID,		KI,	k2pc_numeric },
+	{ NUMERICOID,		KJ,	k2pc_numeric },
+	{ NUMERICOID,		KE,	k2pc_numeric },
+	{ NUMERICOID,		KF,	k2pc_numeric },
+	{ INT2ARRAYOID,		0,	k2pc_int2array },
+	{ INT4ARRAYOID,		0,	k2pc_int4array },
+	{ INT8ARRAYOID,		0,	k2pc_int8array },
+	{ FLOAT4ARRAYOID,	0,	k2pc_float4array },
+	{ FLOAT8ARRAYOID,	0,	k2pc_float8array }
+};
+
+/*
+ * Return the kernel that converts kdb+ column c to Postgres type typeoid. A 
+ * column whose type can't be converted is reported here, before any row.
+ */
+K2PCOL k2p_column(Oid typeoid, K c, char *name)
+{
+	for (int i = 0; i < sizeof(k2pcols) / sizeof(k2pcols[0]); i++)
+		if (k2pcols[i].typeoid == typeoid && k2pcols[i].ktype == c->t)
+			return k2pcols[i].kernel;
+
+	if (c->n == 0)
+		return k2pc_none;
+
+	elog(ERROR, k2p_msg, name, format_type_be(typeoid));
+	return NULL;
+}
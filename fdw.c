@@ -0,0 +1,1525 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Foreign data wrapper for kdb+ tables. Supported WHERE clauses, the columns
+ * that are needed, simple GROUP BY aggregates (sum, min, max, avg, count),
+ * ORDER BY and LIMIT/OFFSET are deparsed into a q functional select, so that
+ * kdb+ does the work and only the result crosses the wire. Rows are converted
+ * with the same type-oid dispatch table (todt) used by getset.
+ *
+ * Result columns are named c<n>, where n is the position of the attribute in
+ * the scan tuple, so the result can be mapped back regardless of its order.
+ * Aggregates without GROUP BY also return the number of rows aggregated (n),
+ * as kdb+ aggregates of no rows are 0 or infinities where Postgres has NULL.
+ */
+
+#include "pgtokdb.h"
+#include <fmgr.h>
+#include <ctype.h>
+#include <math.h>
+#include <access/htup_details.h>
+#include <access/reloptions.h>
+#include <access/stratnum.h>
+#include <access/sysattr.h>
+#include <access/table.h>
+#include <access/transam.h>
+#include <access/parallel.h>
+#include <catalog/pg_aggregate.h>
+#include <catalog/pg_am_d.h>
+#include <catalog/pg_attribute.h>
+#include <catalog/pg_foreign_server.h>
+#include <catalog/pg_foreign_table.h>
+#include <catalog/pg_namespace_d.h>
+#include <catalog/pg_user_mapping.h>
+#include <commands/defrem.h>
+#include <commands/explain.h>
+#if PG_VERSION_NUM >= 180000
+#include <access/cmptype.h>
+#include <commands/explain_format.h>
+#endif
+#include <foreign/fdwapi.h>
+#include <foreign/foreign.h>
+#include <miscadmin.h>
+#include <nodes/makefuncs.h>
+#include <nodes/nodeFuncs.h>
+#include <optimizer/cost.h>
+#include <optimizer/optimizer.h>
+#include <optimizer/pathnode.h>
+#include <optimizer/paths.h>
+#include <optimizer/planmain.h>
+#include <optimizer/restrictinfo.h>
+#include <optimizer/tlist.h>
+#include <utils/guc.h>
+#include <utils/date.h>
+#include <utils/lsyscache.h>
+#include <utils/rel.h>
+#include <utils/syscache.h>
+
+/* Cost of a round trip to kdb+ and per row shipped back */
+#define KFDW_STARTUP_COST	100.0
+#define KFDW_TUPLE_COST		0.01
+
+/* Rows per slice handed out to parallel participants (unless chunk_rows is set) */
+#define KFDW_SLICE_ROWS		65536
+
+/* Planner state of a base or upper relation that kdb+ can compute */
+typedef struct
+{
+	Oid			serverid;		/* Foreign server */
+	Oid			relid;			/* Foreign table */
+	Index		scanrelid;		/* Range table index of the foreign table */
+	char	   *table;			/* kdb+ table name */
+	double		rows;			/* Estimated number of rows produced */
+	List	   *remote_conds;	/* RestrictInfos evaluated by kdb+ */
+	List	   *local_conds;	/* RestrictInfos evaluated by Postgres */
+	Bitmapset  *attrs_used;		/* Columns needed from a base relation scan */
+	List	   *tlist;			/* Scan target list of an upper relation */
+	bool		grouped;		/* tlist contains grouping columns and aggregates */
+	List	   *orderby;		/* tlist positions (1-based, negative for descending) */
+	int64		limit;			/* Number of rows to return (-1 for all) */
+	int64		offset;			/* Number of rows to skip */
+} KFdwRel;
+
+/* Execution state of a foreign scan */
+typedef struct
+{
+	char	   *query;			/* q text sent to kdb+ */
+	char	   *host;
+	int			port;
+	char	   *userpass;
+	K			table;			/* kdb+ result (or current chunk of it) */
+	J			cursor;			/* kdb+ cursor being read (0 if none) */
+	bool		chunked;		/* table is only a chunk of the result */
+	J			pcursor;		/* kdb+ cursor sliced by parallel participants (0 if none) */
+	bool		powner;			/* pcursor was opened by this (leader) process */
+	J			row;			/* Next row of table to return */
+	J			nrows;			/* Number of rows in table */
+	int			ncols;			/* Number of mapped result columns */
+	int		   *kcol;			/* kdb+ column of each mapped column */
+	int		   *att;			/* Scan tuple attribute of each mapped column */
+	K2PCOL	   *kernels;		/* Conversion kernel of each mapped column */
+	KSymCache  *symbols;		/* Texts of the symbols converted so far */
+	List	   *nullempty;		/* Attributes that are null when no rows were aggregated */
+	int			ncount;			/* kdb+ column of that number of rows (-1 if none) */
+} KFdwScan;
+
+/* State of a parallel foreign scan in dynamic shared memory */
+typedef struct
+{
+	J			cursor;			/* kdb+ cursor whose slices the participants claim */
+} KFdwShared;
+
+/* Options accepted by the validator and the catalog they belong to */
+static const struct
+{
+	const char *name;
+	Oid			context;
+} kfdw_options[] =
+{
+	{ "host",		ForeignServerRelationId },
+	{ "port",		ForeignServerRelationId },
+	{ "userpass",	UserMappingRelationId },
+	{ "table",		ForeignTableRelationId },
+	{ "rows",		ForeignTableRelationId },
+	{ "column",		AttributeRelationId },
+	{ "ktype",		AttributeRelationId }
+};
+
+/* Prototypes */
+void	kfdw_rel_size(PlannerInfo *, RelOptInfo *, Oid);
+void	kfdw_paths(PlannerInfo *, RelOptInfo *, Oid);
+ForeignScan *kfdw_plan(PlannerInfo *, RelOptInfo *, Oid, ForeignPath *, List *, List *, Plan *);
+void	kfdw_upper_paths(PlannerInfo *, UpperRelationKind, RelOptInfo *, RelOptInfo *, void *);
+void	kfdw_begin(ForeignScanState *, int);
+TupleTableSlot *kfdw_iterate(ForeignScanState *);
+void	kfdw_rescan(ForeignScanState *);
+void	kfdw_end(ForeignScanState *);
+void	kfdw_explain(ForeignScanState *, ExplainState *);
+void	kfdw_add_path(PlannerInfo *, RelOptInfo *, KFdwRel *, PathTarget *, List *);
+bool	kfdw_group(PlannerInfo *, RelOptInfo *, KFdwRel *, void *);
+bool	kfdw_order(PlannerInfo *, KFdwRel *);
+bool	kfdw_limit(PlannerInfo *, KFdwRel *, void *);
+bool	kfdw_var_tlist(KFdwRel *, PathTarget *);
+Var	   *kfdw_var(Node *, KFdwRel *);
+bool	kfdw_agg(Aggref *, KFdwRel *);
+char   *kfdw_colname(Oid, AttrNumber);
+bool	kfdw_qname(const char *);
+List   *kfdw_nullempty(KFdwRel *);
+char	kfdw_ktype(Oid, AttrNumber);
+bool	kfdw_const(StringInfo, Oid, Datum, bool);
+bool	kfdw_expr(StringInfo, Node *, KFdwRel *);
+void	kfdw_dict(StringInfo, List *, List *);
+char   *kfdw_deparse(KFdwRel *);
+char   *kfdw_tle(TargetEntry *, KFdwRel *);
+void	kfdw_connopts(Oid, KFdwScan *);
+void	kfdw_release(KFdwScan *);
+void	kfdw_kernels(KFdwScan *, K, TupleDesc);
+K		kfdw_fetch(KFdwScan *);
+J		kfdw_slice_rows(void);
+bool	kfdw_parallel_safe(PlannerInfo *, RelOptInfo *, RangeTblEntry *);
+Size	kfdw_dsm_size(ForeignScanState *, ParallelContext *);
+void	kfdw_dsm_init(ForeignScanState *, ParallelContext *, void *);
+void	kfdw_dsm_reinit(ForeignScanState *, ParallelContext *, void *);
+void	kfdw_worker_init(ForeignScanState *, shm_toc *, void *);
+
+
+PG_FUNCTION_INFO_CUSTOM(fdw_handler);
+
+/*
+ * Entry point from Postgres that returns the wrapper's callbacks
+ */
+PGDLLEXPORT Datum fdw_handler(PG_FUNCTION_ARGS)
+{
+	FdwRoutine *routine = makeNode(FdwRoutine);
+
+	routine->GetForeignRelSize = kfdw_rel_size;
+	routine->GetForeignPaths = kfdw_paths;
+	routine->GetForeignPlan = kfdw_plan;
+	routine->GetForeignUpperPaths = kfdw_upper_paths;
+	routine->BeginForeignScan = kfdw_begin;
+	routine->IterateForeignScan = kfdw_iterate;
+	routine->ReScanForeignScan = kfdw_rescan;
+	routine->EndForeignScan = kfdw_end;
+	routine->ExplainForeignScan = kfdw_explain;
+	routine->IsForeignScanParallelSafe = kfdw_parallel_safe;
+	routine->EstimateDSMForeignScan = kfdw_dsm_size;
+	routine->InitializeDSMForeignScan = kfdw_dsm_init;
+	routine->ReInitializeDSMForeignScan = kfdw_dsm_reinit;
+	routine->InitializeWorkerForeignScan = kfdw_worker_init;
+
+	PG_RETURN_POINTER(routine);
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(fdw_validator);
+
+/*
+ * Validate the options given to the wrapper's servers, user mappings,
+ * foreign tables and their columns
+ */
+PGDLLEXPORT Datum fdw_validator(PG_FUNCTION_ARGS)
+{
+	List	   *options = untransformRelOptions(PG_GETARG_DATUM(0));
+	Oid			context = PG_GETARG_OID(1);
+	ListCell   *lc;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+		bool		found = false;
+
+		for (int i = 0; i < sizeof(kfdw_options) / sizeof(kfdw_options[0]); i++)
+			if (kfdw_options[i].context == context && strcmp(kfdw_options[i].name, def->defname) == 0)
+				found = true;
+
+		if (!found)
+			elog(ERROR, "Invalid option \"%s\" for kdb+ foreign data wrapper", def->defname);
+
+		if (strcmp(def->defname, "port") == 0 || strcmp(def->defname, "rows") == 0)
+		{
+			char *end;
+			double v = strtod(defGetString(def), &end);
+			if (*end != '\0' || v < 0)
+				elog(ERROR, "Option \"%s\" must be a non-negative number", def->defname);
+		}
+		else if (strcmp(def->defname, "ktype") == 0 && strlen(defGetString(def)) != 1)
+			elog(ERROR, "Option \"ktype\" must be a single kdb+ type character");
+		else if (strcmp(def->defname, "column") == 0 && !kfdw_qname(defGetString(def)))
+			elog(ERROR, "Option \"column\" must be a kdb+ column name (letters, digits and underscores)");
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * Split the restrictions into those kdb+ can evaluate and the rest, note the
+ * columns that are needed and estimate the number of rows
+ */
+void kfdw_rel_size(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+	KFdwRel    *fr = (KFdwRel *) palloc0(sizeof(KFdwRel));
+	ForeignTable *ft = GetForeignTable(foreigntableid);
+	ListCell   *lc;
+
+	fr->serverid = ft->serverid;
+	fr->relid = foreigntableid;
+	fr->scanrelid = baserel->relid;
+	fr->rows = 1000;
+	fr->limit = -1;
+
+	foreach(lc, ft->options)
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+		if (strcmp(def->defname, "table") == 0)
+			fr->table = defGetString(def);
+		else if (strcmp(def->defname, "rows") == 0)
+			fr->rows = strtod(defGetString(def), NULL);
+	}
+	if (fr->table == NULL)
+		fr->table = get_rel_name(foreigntableid);
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		if (kfdw_expr(&buf, (Node *) ri->clause, fr))
+			fr->remote_conds = lappend(fr->remote_conds, ri);
+		else
+			fr->local_conds = lappend(fr->local_conds, ri);
+		pfree(buf.data);
+	}
+
+	/* Columns needed for the output and for the conditions evaluated locally */
+	pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid, &fr->attrs_used);
+	foreach(lc, fr->local_conds)
+		pull_varattnos((Node *) lfirst_node(RestrictInfo, lc)->clause, baserel->relid, &fr->attrs_used);
+
+	baserel->rows = clamp_row_est(fr->rows *
+		clauselist_selectivity(root, baserel->baserestrictinfo, baserel->relid, JOIN_INNER, NULL));
+	fr->rows = baserel->rows;
+	baserel->fdw_private = fr;
+}
+
+
+/*
+ * Add a path for a base relation or an upper relation computed by kdb+
+ */
+void kfdw_add_path(PlannerInfo *root, RelOptInfo *rel, KFdwRel *fr, PathTarget *target, List *pathkeys)
+{
+	Cost startup = KFDW_STARTUP_COST;
+	Cost total = startup + fr->rows * (cpu_tuple_cost + KFDW_TUPLE_COST);
+	Path *path;
+
+	if (IS_SIMPLE_REL(rel))
+		path = (Path *) create_foreignscan_path(root, rel, NULL, fr->rows,
+#if PG_VERSION_NUM >= 180000
+			0,
+#endif
+			startup, total, pathkeys, rel->lateral_relids, NULL,
+#if PG_VERSION_NUM >= 170000
+			NIL,
+#endif
+			NIL);
+	else
+		path = (Path *) create_foreign_upper_path(root, rel, target, fr->rows,
+#if PG_VERSION_NUM >= 180000
+			0,
+#endif
+			startup, total, pathkeys, NULL,
+#if PG_VERSION_NUM >= 170000
+			NIL,
+#endif
+			NIL);
+
+	add_path(rel, path);
+}
+
+
+void kfdw_paths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+	KFdwRel *fr = (KFdwRel *) baserel->fdw_private;
+
+	kfdw_add_path(root, baserel, fr, NULL, NIL);
+
+	/*
+	 * A large scan can be split across parallel workers, each of which claims
+	 * slices of the same kdb+ cursor and converts them
+	 */
+	int workers = Min(max_parallel_workers_per_gather, (int) (fr->rows / kfdw_slice_rows()) - 1);
+	if (baserel->consider_parallel && baserel->lateral_relids == NULL && workers > 0)
+	{
+		double rows = clamp_row_est(fr->rows / (workers + 1));
+		Path *path = (Path *) create_foreignscan_path(root, baserel, NULL, rows,
+#if PG_VERSION_NUM >= 180000
+			0,
+#endif
+			KFDW_STARTUP_COST, KFDW_STARTUP_COST + rows * (cpu_tuple_cost + KFDW_TUPLE_COST),
+			NIL, NULL, NULL,
+#if PG_VERSION_NUM >= 170000
+			NIL,
+#endif
+			NIL);
+
+		path->parallel_aware = true;
+		path->parallel_safe = true;
+		path->parallel_workers = workers;
+		add_partial_path(baserel, path);
+	}
+}
+
+
+/*
+ * Offer kdb+ the grouping, ordering and limiting of a single foreign table
+ * whose restrictions have all been pushed down
+ */
+void kfdw_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+	RelOptInfo *input_rel, RelOptInfo *output_rel, void *extra)
+{
+	KFdwRel *in = (KFdwRel *) input_rel->fdw_private;
+
+	if (in == NULL || output_rel->fdw_private != NULL || in->local_conds != NIL)
+		return;
+	if (root->parse->commandType != CMD_SELECT || root->parse->hasTargetSRFs)
+		return;
+
+	KFdwRel *fr = (KFdwRel *) palloc(sizeof(KFdwRel));
+	memcpy(fr, in, sizeof(KFdwRel));
+
+	bool ok = false;
+	List *pathkeys = NIL;
+	switch (stage)
+	{
+		case UPPERREL_GROUP_AGG:
+			ok = IS_SIMPLE_REL(input_rel) && kfdw_group(root, output_rel, fr, extra);
+			break;
+		case UPPERREL_ORDERED:
+			ok = in->limit < 0 &&
+				(in->tlist != NIL || kfdw_var_tlist(fr, root->upper_targets[stage])) &&
+				kfdw_order(root, fr);
+			pathkeys = root->sort_pathkeys;
+			break;
+		case UPPERREL_FINAL:
+			ok = (root->sort_pathkeys == NIL || in->orderby != NIL) &&
+				(in->tlist != NIL || kfdw_var_tlist(fr, root->upper_targets[stage])) &&
+				kfdw_limit(root, fr, extra);
+			pathkeys = in->orderby != NIL ? root->sort_pathkeys : NIL;
+			break;
+		default:
+			break;
+	}
+
+	if (!ok)
+		return;
+
+	output_rel->fdw_private = fr;
+	kfdw_add_path(root, output_rel, fr,
+		stage == UPPERREL_GROUP_AGG ? output_rel->reltarget : root->upper_targets[stage], pathkeys);
+}
+
+
+/*
+ * Build the scan target list of grouping columns and aggregates. Returns
+ * false if a grouping expression or aggregate can't be computed by kdb+.
+ */
+bool kfdw_group(PlannerInfo *root, RelOptInfo *grouped_rel, KFdwRel *fr, void *extra)
+{
+	GroupPathExtraData *gextra = (GroupPathExtraData *) extra;
+	PathTarget *target = grouped_rel->reltarget;
+	Query	   *parse = root->parse;
+	List	   *tlist = NIL;
+	bool		hasagg = false;
+	int			ngroup = 0;
+	int			i = 0;
+	ListCell   *lc;
+
+	if (gextra->patype != PARTITIONWISE_AGGREGATE_NONE || gextra->havingQual != NULL ||
+		parse->groupingSets != NIL)
+		return false;
+
+	foreach(lc, target->exprs)
+	{
+		Expr *expr = (Expr *) lfirst(lc);
+		Index sgref = get_pathtarget_sortgroupref(target, i++);
+
+		if (sgref && get_sortgroupref_clause_noerr(sgref, parse->groupClause))
+		{
+			/* Grouping column */
+			if (!IsA(expr, Var) || kfdw_var((Node *) expr, fr) == NULL)
+				return false;
+			tlist = add_to_flat_tlist(tlist, list_make1(expr));
+			ngroup++;
+		}
+		else
+		{
+			/* Expression over aggregates (and grouping columns) */
+			List *vars = pull_var_clause((Node *) expr, PVC_INCLUDE_AGGREGATES);
+			ListCell *lv;
+
+			foreach(lv, vars)
+			{
+				Node *v = (Node *) lfirst(lv);
+				if (IsA(v, Aggref))
+				{
+					if (!kfdw_agg((Aggref *) v, fr))
+						return false;
+					hasagg = true;
+				}
+				else if (kfdw_var(v, fr) == NULL)
+					return false;
+			}
+			tlist = add_to_flat_tlist(tlist, vars);
+		}
+	}
+
+	if (!hasagg)
+		return false;
+
+	apply_pathtarget_labeling_to_tlist(tlist, target);
+	fr->tlist = tlist;
+	fr->grouped = true;
+	fr->rows = ngroup == 0 ? 1 : clamp_row_est(fr->rows / 10);
+	return true;
+}
+
+
+/*
+ * Translate the query's sort keys into positions of the scan target list.
+ * Only keys that sort like kdb+ does (numbers, dates and times) qualify.
+ */
+bool kfdw_order(PlannerInfo *root, KFdwRel *fr)
+{
+	ListCell *lc;
+
+	fr->orderby = NIL;
+
+	foreach(lc, root->sort_pathkeys)
+	{
+		PathKey *pk = (PathKey *) lfirst(lc);
+		EquivalenceClass *ec = pk->pk_eclass;
+		int pos = 0;
+		ListCell *lm;
+
+		if (ec->ec_has_volatile)
+			return false;
+
+		foreach(lm, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lm);
+			Node *expr = (Node *) em->em_expr;
+			ListCell *lt;
+			int i = 1;
+
+			while (expr && IsA(expr, RelabelType))
+				expr = (Node *) ((RelabelType *) expr)->arg;
+
+			foreach(lt, fr->tlist)
+			{
+				if (equal(expr, ((TargetEntry *) lfirst(lt))->expr))
+				{
+					pos = i;
+					break;
+				}
+				i++;
+			}
+			if (pos != 0)
+			{
+				Oid type = exprType(expr);
+				if (type != INT2OID && type != INT4OID && type != INT8OID &&
+					type != FLOAT4OID && type != FLOAT8OID && type != NUMERICOID &&
+					type != DATEOID && type != TIMESTAMPOID && type != TIMESTAMPTZOID)
+					return false;
+				if (pk->pk_opfamily != get_opclass_family(GetDefaultOpClass(type, BTREE_AM_OID)))
+					return false;
+				break;
+			}
+		}
+
+		if (pos == 0)
+			return false;
+
+#if PG_VERSION_NUM >= 180000
+		fr->orderby = lappend_int(fr->orderby, pk->pk_cmptype == COMPARE_GT ? -pos : pos);
+#else
+		fr->orderby = lappend_int(fr->orderby, pk->pk_strategy == BTGreaterStrategyNumber ? -pos : pos);
+#endif
+	}
+
+	return fr->orderby != NIL;
+}
+
+
+/*
+ * Take LIMIT and OFFSET when both are constants
+ */
+bool kfdw_limit(PlannerInfo *root, KFdwRel *fr, void *extra)
+{
+	FinalPathExtraData *fextra = (FinalPathExtraData *) extra;
+	Query *parse = root->parse;
+	Const *count = (Const *) parse->limitCount;
+	Const *offset = (Const *) parse->limitOffset;
+
+	if (!fextra->limit_needed || parse->rowMarks != NIL)
+		return false;
+#if PG_VERSION_NUM >= 130000
+	if (parse->limitOption != LIMIT_OPTION_COUNT)
+		return false;
+#endif
+	if (count == NULL || !IsA(count, Const) || count->constisnull)
+		return false;
+	if (offset != NULL && (!IsA(offset, Const) || offset->constisnull))
+		return false;
+
+	fr->limit = DatumGetInt64(count->constvalue);
+	fr->offset = offset != NULL ? DatumGetInt64(offset->constvalue) : 0;
+	fr->rows = Min(fr->rows, (double) fr->limit);
+	return fr->limit >= 0 && fr->offset >= 0;
+}
+
+
+/*
+ * Scan target list of a base relation's columns used by an upper target
+ */
+bool kfdw_var_tlist(KFdwRel *fr, PathTarget *target)
+{
+	List *vars = pull_var_clause((Node *) target->exprs, PVC_RECURSE_PLACEHOLDERS);
+	ListCell *lc;
+
+	foreach(lc, vars)
+		if (kfdw_var((Node *) lfirst(lc), fr) == NULL)
+			return false;
+
+	fr->tlist = add_to_flat_tlist(NIL, vars);
+	return true;
+}
+
+
+/*
+ * Return the expression as a (supported) column of the foreign table, or NULL
+ */
+Var *kfdw_var(Node *node, KFdwRel *fr)
+{
+	while (node && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+
+	if (node == NULL || !IsA(node, Var))
+		return NULL;
+
+	Var *var = (Var *) node;
+	if (var->varno != fr->scanrelid || var->varlevelsup != 0 || var->varattno <= 0)
+		return NULL;
+
+	int ind = findOID(var->vartype);
+	if (ind < 0 || todt[ind].k2p == NULL)
+		return NULL;
+
+	return var;
+}
+
+
+/*
+ * Aggregates that map onto a q aggregate over a single column and give the
+ * same result as in Postgres. Ints are summed as longs (Postgres sums them
+ * into a bigint), and avg is only pushed down for floats (Postgres averages
+ * integers as numerics). Aggregates of no rows are made null by kfdw_iterate.
+ */
+bool kfdw_agg(Aggref *agg, KFdwRel *fr)
+{
+	if (agg->aggdistinct != NIL || agg->aggorder != NIL || agg->aggfilter != NULL ||
+		agg->aggkind != AGGKIND_NORMAL || agg->aggsplit != AGGSPLIT_SIMPLE || agg->aggvariadic)
+		return false;
+	if (get_func_namespace(agg->aggfnoid) != PG_CATALOG_NAMESPACE)
+		return false;
+
+	int ind = findOID(agg->aggtype);
+	if (ind < 0 || todt[ind].k2p == NULL)
+		return false;
+
+	char *name = get_func_name(agg->aggfnoid);
+	if (agg->aggstar)
+		return strcmp(name, "count") == 0;
+
+	if (list_length(agg->args) != 1)
+		return false;
+
+	Var *var = kfdw_var((Node *) ((TargetEntry *) linitial(agg->args))->expr, fr);
+	if (var == NULL)
+		return false;
+
+	if (strcmp(name, "count") == 0)
+		return true;
+
+	/* The remaining aggregates only apply to numbers, dates and times */
+	if (strcmp(name, "min") == 0 || strcmp(name, "max") == 0)
+	{
+		switch (var->vartype)
+		{
+			case INT2OID: case INT4OID: case INT8OID: case FLOAT4OID: case FLOAT8OID:
+			case DATEOID: case TIMESTAMPOID: case TIMESTAMPTZOID:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	if (strcmp(name, "sum") == 0)
+		return var->vartype == INT2OID || var->vartype == INT4OID ||
+			var->vartype == INT8OID || var->vartype == FLOAT8OID;
+
+	if (strcmp(name, "avg") == 0)
+		return var->vartype == FLOAT8OID;
+
+	return false;
+}
+
+
+/*
+ * Positions in the scan target list of the aggregates (all but count) that
+ * are null when an aggregate without GROUP BY is over no rows
+ */
+List *kfdw_nullempty(KFdwRel *fr)
+{
+	List *positions = NIL;
+	int i = 0;
+	ListCell *lc;
+
+	if (!fr->grouped)
+		return NIL;
+
+	foreach(lc, fr->tlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		/* A grouping column: groups are never empty */
+		if (!IsA(tle->expr, Aggref))
+			return NIL;
+
+		if (strcmp(get_func_name(((Aggref *) tle->expr)->aggfnoid), "count") != 0)
+			positions = lappend_int(positions, i);
+		i++;
+	}
+
+	return positions;
+}
+
+
+/*
+ * Name of the kdb+ column behind an attribute (the "column" option or the
+ * attribute name)
+ */
+char *kfdw_colname(Oid relid, AttrNumber attnum)
+{
+	ListCell *lc;
+
+	foreach(lc, GetForeignColumnOptions(relid, attnum))
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+		if (strcmp(def->defname, "column") == 0)
+			return defGetString(def);
+	}
+
+	char *name = get_attname(relid, attnum, false);
+	if (!kfdw_qname(name))
+		elog(ERROR, "Column \"%s\" is not a kdb+ column name; name the kdb+ column with "
+			"the \"column\" option", name);
+
+	return name;
+}
+
+
+/*
+ * Whether a name can be written as a q symbol (`name) naming a column
+ */
+bool kfdw_qname(const char *name)
+{
+	if (!isalpha((unsigned char) name[0]))
+		return false;
+
+	for (const char *p = name + 1; *p != '\0'; p++)
+		if (!isalnum((unsigned char) *p) && *p != '_')
+			return false;
+
+	return true;
+}
+
+
+/*
+ * kdb+ type character of an attribute given by its "ktype" option, or 0
+ */
+char kfdw_ktype(Oid relid, AttrNumber attnum)
+{
+	ListCell *lc;
+
+	foreach(lc, GetForeignColumnOptions(relid, attnum))
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+		if (strcmp(def->defname, "ktype") == 0)
+			return defGetString(def)[0];
+	}
+	return 0;
+}
+
+
+/*
+ * Append a constant as a q literal. Symbols are enlisted when used as an
+ * operand (atom) so that kdb+ doesn't take them for column names.
+ */
+bool kfdw_const(StringInfo buf, Oid type, Datum value, bool atom)
+{
+	switch (type)
+	{
+		case BOOLOID:
+			appendStringInfoString(buf, DatumGetBool(value) ? "1b" : "0b");
+			return true;
+
+		case INT2OID:
+			appendStringInfo(buf, "%dh", DatumGetInt16(value));
+			return true;
+
+		case INT4OID:
+			appendStringInfo(buf, "%di", DatumGetInt32(value));
+			return true;
+
+		case INT8OID:
+			appendStringInfo(buf, INT64_FORMAT "j", DatumGetInt64(value));
+			return true;
+
+		case FLOAT4OID:
+		case FLOAT8OID:
+		{
+			double d = type == FLOAT4OID ? DatumGetFloat4(value) : DatumGetFloat8(value);
+			bool real = type == FLOAT4OID;
+			if (isnan(d))
+				appendStringInfoString(buf, real ? "0Ne" : "0n");
+			else if (isinf(d))
+				appendStringInfo(buf, "%s%s", d < 0 ? "-" : "", real ? "0we" : "0w");
+			else
+				appendStringInfo(buf, "(\"%s\"$%.17g)", real ? "e" : "f", d);
+			return true;
+		}
+
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+		{
+			Timestamp ts = DatumGetTimestamp(value);
+			if (TIMESTAMP_NOT_FINITE(ts))
+				return false;
+			appendStringInfo(buf, "(\"p\"$" INT64_FORMAT "j)", (int64) ts * 1000);
+			return true;
+		}
+
+		case DATEOID:
+		{
+			DateADT d = DatumGetDateADT(value);
+			if (DATE_NOT_FINITE(d))
+				return false;
+			appendStringInfo(buf, "(\"d\"$%di)", d);
+			return true;
+		}
+
+		case UUIDOID:
+			appendStringInfo(buf, "(\"G\"$\"%s\")",
+				DatumGetCString(DirectFunctionCall1(uuid_out, value)));
+			return true;
+
+		case VARCHAROID:
+		case TEXTOID:
+		{
+			char *s = TextDatumGetCString(value);
+			appendStringInfoString(buf, atom ? "enlist`$\"" : "`$\"");
+			for (char *p = s; *p; p++)
+			{
+				if (*p == '"' || *p == '\\')
+					appendStringInfoChar(buf, '\\');
+				appendStringInfoChar(buf, *p);
+			}
+			appendStringInfoChar(buf, '"');
+			return true;
+		}
+
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * Append a restriction as a q parse tree. Returns false if kdb+ can't
+ * evaluate it with the same meaning as Postgres.
+ */
+bool kfdw_expr(StringInfo buf, Node *node, KFdwRel *fr)
+{
+	ListCell *lc;
+
+	while (node && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+
+	if (node == NULL)
+		return false;
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+		{
+			/* A boolean column on its own */
+			Var *var = kfdw_var(node, fr);
+			if (var == NULL || var->vartype != BOOLOID)
+				return false;
+			appendStringInfo(buf, "`%s", kfdw_colname(fr->relid, var->varattno));
+			return true;
+		}
+
+		case T_OpExpr:
+		{
+			OpExpr *op = (OpExpr *) node;
+			if (list_length(op->args) != 2 || op->opno >= FirstNormalObjectId)
+				return false;
+
+			char *name = get_opname(op->opno);
+			Node *l = (Node *) linitial(op->args);
+			Node *r = (Node *) lsecond(op->args);
+			Var *lv = kfdw_var(l, fr);
+			Var *rv = kfdw_var(r, fr);
+
+			/* Keep the column on the left */
+			if (lv == NULL && rv != NULL)
+			{
+				Node *t = l; l = r; r = t;
+				lv = rv; rv = NULL;
+				if (strcmp(name, "<") == 0) name = ">";
+				else if (strcmp(name, ">") == 0) name = "<";
+				else if (strcmp(name, "<=") == 0) name = ">=";
+				else if (strcmp(name, ">=") == 0) name = "<=";
+			}
+			if (lv == NULL)
+				return false;
+
+			while (IsA(r, RelabelType))
+				r = (Node *) ((RelabelType *) r)->arg;
+
+			bool equality = strcmp(name, "=") == 0 || strcmp(name, "<>") == 0;
+			if (!equality && strcmp(name, "<") != 0 && strcmp(name, ">") != 0 &&
+				strcmp(name, "<=") != 0 && strcmp(name, ">=") != 0)
+				return false;
+
+			/* Strings compare as symbols (and only for equality) */
+			Oid ltype = lv->vartype;
+			Oid rtype = exprType(r);
+			bool lnum = ltype == INT2OID || ltype == INT4OID || ltype == INT8OID ||
+				ltype == FLOAT4OID || ltype == FLOAT8OID;
+			bool rnum = rtype == INT2OID || rtype == INT4OID || rtype == INT8OID ||
+				rtype == FLOAT4OID || rtype == FLOAT8OID;
+			if (!(lnum && rnum) && ltype != rtype &&
+				!((ltype == VARCHAROID || ltype == TEXTOID) && (rtype == VARCHAROID || rtype == TEXTOID)))
+				return false;
+			if (ltype == VARCHAROID || ltype == TEXTOID)
+			{
+				char kt = kfdw_ktype(fr->relid, lv->varattno);
+				if (!equality || (kt != 0 && kt != 's'))
+					return false;
+			}
+			else if ((ltype == BOOLOID || ltype == UUIDOID) && !equality)
+				return false;
+			else if (ltype == BPCHAROID || ltype == BYTEAOID || ltype == NUMERICOID)
+				return false;
+
+			appendStringInfo(buf, "(%s;`%s;", name, kfdw_colname(fr->relid, lv->varattno));
+			if (rv != NULL)
+				appendStringInfo(buf, "`%s", kfdw_colname(fr->relid, rv->varattno));
+			else if (!IsA(r, Const) || ((Const *) r)->constisnull ||
+				!kfdw_const(buf, rtype, ((Const *) r)->constvalue, true))
+				return false;
+			appendStringInfoChar(buf, ')');
+			return true;
+		}
+
+		case T_ScalarArrayOpExpr:
+		{
+			/* column = any(array constant), i.e. IN (...) */
+			ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) node;
+			if (!op->useOr || op->opno >= FirstNormalObjectId || strcmp(get_opname(op->opno), "=") != 0)
+				return false;
+
+			Var *var = kfdw_var((Node *) linitial(op->args), fr);
+			Node *arr = (Node *) lsecond(op->args);
+			if (var == NULL || !IsA(arr, Const) || ((Const *) arr)->constisnull)
+				return false;
+			if ((var->vartype == VARCHAROID || var->vartype == TEXTOID) &&
+				kfdw_ktype(fr->relid, var->varattno) != 0 && kfdw_ktype(fr->relid, var->varattno) != 's')
+				return false;
+
+			ArrayType *a = DatumGetArrayTypeP(((Const *) arr)->constvalue);
+			Oid elmtype = ARR_ELEMTYPE(a);
+			int16 elmlen;
+			bool elmbyval;
+			char elmalign;
+			Datum *elems;
+			bool *nulls;
+			int n;
+
+			if (elmtype != var->vartype && !(var->vartype == VARCHAROID && elmtype == TEXTOID))
+				return false;
+
+			get_typlenbyvalalign(elmtype, &elmlen, &elmbyval, &elmalign);
+			deconstruct_array(a, elmtype, elmlen, elmbyval, elmalign, &elems, &nulls, &n);
+
+			appendStringInfo(buf, "(in;`%s;enlist(),(", kfdw_colname(fr->relid, var->varattno));
+			for (int i = 0; i < n; i++)
+			{
+				if (nulls[i])
+					return false;
+				if (i > 0)
+					appendStringInfoChar(buf, ';');
+				if (!kfdw_const(buf, elmtype, elems[i], false))
+					return false;
+			}
+			appendStringInfoString(buf, "))");
+			return true;
+		}
+
+		case T_BoolExpr:
+		{
+			BoolExpr *b = (BoolExpr *) node;
+			int n = list_length(b->args);
+			int i = 0;
+
+			if (b->boolop == NOT_EXPR)
+			{
+				appendStringInfoString(buf, "(not;");
+				if (!kfdw_expr(buf, (Node *) linitial(b->args), fr))
+					return false;
+				appendStringInfoChar(buf, ')');
+				return true;
+			}
+
+			/* Binary and/or nested to the right: (&;a;(&;b;c)) */
+			foreach(lc, b->args)
+			{
+				if (i < n - 1)
+					appendStringInfo(buf, "(%s;", b->boolop == AND_EXPR ? "&" : "|");
+				if (!kfdw_expr(buf, (Node *) lfirst(lc), fr))
+					return false;
+				if (i++ < n - 1)
+					appendStringInfoChar(buf, ';');
+			}
+			for (i = 0; i < n - 1; i++)
+				appendStringInfoChar(buf, ')');
+			return true;
+		}
+
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * Append a q dictionary of column names to expressions
+ */
+void kfdw_dict(StringInfo buf, List *keys, List *vals)
+{
+	ListCell *lk, *lv;
+
+	if (list_length(keys) == 1)
+	{
+		appendStringInfo(buf, "(enlist`%s)!enlist %s",
+			(char *) linitial(keys), (char *) linitial(vals));
+		return;
+	}
+
+	appendStringInfoChar(buf, '(');
+	foreach(lk, keys)
+		appendStringInfo(buf, "`%s", (char *) lfirst(lk));
+	appendStringInfoString(buf, ")!(");
+	forboth(lk, keys, lv, vals)
+		appendStringInfo(buf, "%s%s", lk == list_head(keys) ? "" : ";", (char *) lfirst(lv));
+	appendStringInfoChar(buf, ')');
+}
+
+
+/*
+ * q expression computing an entry of an upper relation's scan target list
+ */
+char *kfdw_tle(TargetEntry *tle, KFdwRel *fr)
+{
+	if (IsA(tle->expr, Aggref))
+	{
+		Aggref *agg = (Aggref *) tle->expr;
+		char *name = get_func_name(agg->aggfnoid);
+
+		if (agg->aggstar)
+			return pstrdup("(count;`i)");
+
+		Var *var = kfdw_var((Node *) ((TargetEntry *) linitial(agg->args))->expr, fr);
+		char *col = kfdw_colname(fr->relid, var->varattno);
+
+		/* Summed as longs, which can't overflow as ints and shorts do */
+		if (strcmp(name, "sum") == 0 && (var->vartype == INT2OID || var->vartype == INT4OID))
+			return psprintf("(sum;($;\"j\";`%s))", col);
+
+		return psprintf("(%s;`%s)", name, col);
+	}
+
+	Var *var = kfdw_var((Node *) tle->expr, fr);
+	return psprintf("`%s", kfdw_colname(fr->relid, var->varattno));
+}
+
+
+/*
+ * Generate the q functional select for a base or upper relation
+ */
+char *kfdw_deparse(KFdwRel *fr)
+{
+	StringInfoData where, body, q;
+	List *keys = NIL, *vals = NIL, *bykeys = NIL, *byvals = NIL;
+	ListCell *lc;
+
+	/* Where clause: a list of parse trees */
+	initStringInfo(&where);
+	if (fr->remote_conds == NIL)
+		appendStringInfoString(&where, "()");
+	else
+	{
+		appendStringInfoString(&where, list_length(fr->remote_conds) == 1 ? "enlist " : "(");
+		foreach(lc, fr->remote_conds)
+		{
+			if (lc != list_head(fr->remote_conds))
+				appendStringInfoChar(&where, ';');
+			kfdw_expr(&where, (Node *) lfirst_node(RestrictInfo, lc)->clause, fr);
+		}
+		if (list_length(fr->remote_conds) > 1)
+			appendStringInfoChar(&where, ')');
+	}
+
+	/* Columns of the result */
+	if (fr->tlist == NIL)
+	{
+		Relation rel = table_open(fr->relid, NoLock);
+		TupleDesc tupdesc = RelationGetDescr(rel);
+		bool all = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, fr->attrs_used);
+
+		for (int i = 0; i < tupdesc->natts; i++)
+		{
+			if (TupleDescAttr(tupdesc, i)->attisdropped)
+				continue;
+			if (all || bms_is_member(i + 1 - FirstLowInvalidHeapAttributeNumber, fr->attrs_used))
+			{
+				keys = lappend(keys, psprintf("c%d", i));
+				vals = lappend(vals, psprintf("`%s", kfdw_colname(fr->relid, i + 1)));
+			}
+		}
+		table_close(rel, NoLock);
+
+		/* Nothing needed but the number of rows */
+		if (keys == NIL)
+		{
+			keys = lappend(keys, "i");
+			vals = lappend(vals, "`i");
+		}
+	}
+	else
+	{
+		int i = 0;
+		foreach(lc, fr->tlist)
+		{
+			TargetEntry *tle = (TargetEntry *) lfirst(lc);
+			char *key = psprintf("c%d", i++);
+
+			if (fr->grouped && !IsA(tle->expr, Aggref))
+			{
+				bykeys = lappend(bykeys, key);
+				byvals = lappend(byvals, kfdw_tle(tle, fr));
+			}
+			else
+			{
+				keys = lappend(keys, key);
+				vals = lappend(vals, kfdw_tle(tle, fr));
+			}
+		}
+
+		if (kfdw_nullempty(fr) != NIL)
+		{
+			keys = lappend(keys, "n");
+			vals = lappend(vals, "(count;`i)");
+		}
+	}
+
+	initStringInfo(&body);
+	if (bykeys != NIL)
+		appendStringInfoString(&body, "0!");
+	appendStringInfo(&body, "?[`%s;%s;", fr->table, where.data);
+	if (bykeys != NIL)
+		kfdw_dict(&body, bykeys, byvals);
+	else
+		appendStringInfoString(&body, "0b");
+	appendStringInfoChar(&body, ';');
+	kfdw_dict(&body, keys, vals);
+
+	/* A plain select can stop after the rows it needs */
+	bool take = fr->limit >= 0 && fr->offset == 0 && fr->orderby == NIL && !fr->grouped;
+	if (take)
+		appendStringInfo(&body, ";" INT64_FORMAT, fr->limit);
+	appendStringInfoChar(&body, ']');
+
+	/* 
+	 * q evaluates right to left and its sorts are stable, so the major key 
+	 * is written first and applied last
+	 */
+	initStringInfo(&q);
+	if (fr->limit >= 0 && !take)
+		appendStringInfo(&q, INT64_FORMAT " " INT64_FORMAT " sublist ", fr->offset, fr->limit);
+	foreach(lc, fr->orderby)
+	{
+		int pos = lfirst_int(lc);
+		appendStringInfo(&q, "`c%d %s ", abs(pos) - 1, pos < 0 ? "xdesc" : "xasc");
+	}
+	appendStringInfoString(&q, body.data);
+
+	return q.data;
+}
+
+
+/*
+ * Create the plan node carrying the q text and the server to send it to
+ */
+ForeignScan *kfdw_plan(PlannerInfo *root, RelOptInfo *foreignrel, Oid foreigntableid,
+	ForeignPath *best_path, List *tlist, List *scan_clauses, Plan *outer_plan)
+{
+	KFdwRel *fr = (KFdwRel *) foreignrel->fdw_private;
+	List *local_exprs = NIL;
+	List *fdw_scan_tlist = NIL;
+	Index scan_relid;
+	ListCell *lc;
+
+	if (IS_SIMPLE_REL(foreignrel))
+	{
+		scan_relid = foreignrel->relid;
+		foreach(lc, scan_clauses)
+		{
+			RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+			if (ri->pseudoconstant || list_member_ptr(fr->remote_conds, ri))
+				continue;
+			local_exprs = lappend(local_exprs, ri->clause);
+		}
+	}
+	else
+	{
+		/* Upper relations are only pushed down without local conditions */
+		scan_relid = 0;
+		fdw_scan_tlist = fr->tlist;
+	}
+
+	List *fdw_private = list_make3(makeString(kfdw_deparse(fr)), makeInteger((int) fr->serverid),
+		kfdw_nullempty(fr));
+
+	return make_foreignscan(tlist, local_exprs, scan_relid, NIL, fdw_private,
+		fdw_scan_tlist, NIL, outer_plan);
+}
+
+
+/*
+ * Connection settings: server options and the user mapping, falling back to
+ * the pgtokdb configuration settings
+ */
+void kfdw_connopts(Oid serverid, KFdwScan *st)
+{
+	ForeignServer *server = GetForeignServer(serverid);
+	List *options = list_copy(server->options);
+	ListCell *lc;
+
+	st->host = pstrdup(GetConfigOption("pgtokdb.host", false, false));
+	st->port = atoi(GetConfigOption("pgtokdb.port", false, false));
+	st->userpass = pstrdup(GetConfigOption("pgtokdb.userpass", false, false));
+
+	/* User mapping of the current user, or else PUBLIC */
+	Oid users[2] = { GetUserId(), InvalidOid };
+	for (int i = 0; i < 2; i++)
+	{
+		HeapTuple tp = SearchSysCache2(USERMAPPINGUSERSERVER,
+			ObjectIdGetDatum(users[i]), ObjectIdGetDatum(serverid));
+		if (HeapTupleIsValid(tp))
+		{
+			bool isnull;
+			Datum d = SysCacheGetAttr(USERMAPPINGUSERSERVER, tp,
+				Anum_pg_user_mapping_umoptions, &isnull);
+			if (!isnull)
+				options = list_concat(options, untransformRelOptions(d));
+			ReleaseSysCache(tp);
+			break;
+		}
+	}
+
+	foreach(lc, options)
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+		if (strcmp(def->defname, "host") == 0)
+			st->host = defGetString(def);
+		else if (strcmp(def->defname, "port") == 0)
+			st->port = atoi(defGetString(def));
+		else if (strcmp(def->defname, "userpass") == 0)
+			st->userpass = defGetString(def);
+	}
+}
+
+
+void kfdw_begin(ForeignScanState *node, int eflags)
+{
+	ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	KFdwScan *st = (KFdwScan *) palloc0(sizeof(KFdwScan));
+	st->query = strVal(linitial(plan->fdw_private));
+	kfdw_connopts((Oid) intVal(lsecond(plan->fdw_private)), st);
+	st->nullempty = (List *) lthird(plan->fdw_private);
+
+	node->fdw_state = st;
+}
+
+
+/*
+ * Resolve the conversion kernel of each mapped column of a kdb+ result
+ */
+void kfdw_kernels(KFdwScan *st, K table, TupleDesc tupdesc)
+{
+	K colnames = kK(table->k)[0];
+	K values = kK(table->k)[1];
+
+	for (int i = 0; i < st->ncols; i++)
+		st->kernels[i] = k2p_column(TupleDescAttr(tupdesc, st->att[i])->atttypid,
+			kK(values)[st->kcol[i]], kS(colnames)[st->kcol[i]]);
+}
+
+
+/*
+ * Return the next row of the kdb+ result, fetching it on the first call
+ */
+TupleTableSlot *kfdw_iterate(ForeignScanState *node)
+{
+	KFdwScan *st = (KFdwScan *) node->fdw_state;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	TupleDesc tupdesc = slot->tts_tupleDescriptor;
+
+	if (st->table == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
+
+		/* Stream the result a chunk at a time, unless slices of it are shared */
+		if (kconn_chunk_rows > 0 && st->pcursor == 0)
+		{
+			st->chunked = true;
+			st->cursor = kcursor_open(st->host, st->port, st->userpass, ktn(KS, 0), kp(st->query));
+		}
+		K table = kfdw_fetch(st);
+
+		/* Map result columns c<n> onto scan tuple attributes */
+		K colnames = kK(table->k)[0];
+		st->kcol = (int *) palloc(colnames->n * sizeof(int));
+		st->att = (int *) palloc(colnames->n * sizeof(int));
+		st->kernels = (K2PCOL *) palloc(colnames->n * sizeof(K2PCOL));
+		st->ncols = 0;
+		st->ncount = -1;
+
+		for (int i = 0; i < colnames->n; i++)
+		{
+			char *name = kS(colnames)[i];
+			if (strcmp(name, "n") == 0)
+				st->ncount = i;
+			if (name[0] != 'c' || name[1] < '0' || name[1] > '9')
+				continue;
+
+			int att = atoi(name + 1);
+			if (att >= tupdesc->natts)
+				continue;
+
+			int ind = findOID(TupleDescAttr(tupdesc, att)->atttypid);
+			if (ind < 0 || todt[ind].k2p == NULL)
+				elog(ERROR, "Extension does not support datatype in column \"%s\"",
+					NameStr(TupleDescAttr(tupdesc, att)->attname));
+
+			st->kcol[st->ncols] = i;
+			st->att[st->ncols] = att;
+			st->ncols++;
+		}
+
+		kfdw_kernels(st, table, tupdesc);
+		if (st->symbols == NULL)
+			st->symbols = ksym_create(CurrentMemoryContext);
+		st->table = table;
+		st->nrows = colnames->n > 0 ? kK(kK(table->k)[1])[0]->n : 0;
+		st->row = 0;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* Move on to the next chunk or slice; a short one was the last one */
+	if (st->row >= st->nrows && (st->cursor != 0 || st->pcursor != 0))
+	{
+		if (st->nrows < (st->pcursor != 0 ? kfdw_slice_rows() : kconn_chunk_rows))
+			st->cursor = 0;
+		else
+		{
+			r0(st->table);
+			st->table = NULL;
+			st->table = kfdw_fetch(st);
+			kfdw_kernels(st, st->table, tupdesc);
+			st->nrows = kK(st->table->k)[0]->n > 0 ? kK(kK(st->table->k)[1])[0]->n : 0;
+			st->row = 0;
+		}
+	}
+
+	ExecClearTuple(slot);
+	if (st->row >= st->nrows)
+		return slot;
+
+	K colnames = kK(st->table->k)[0];
+	K values = kK(st->table->k)[1];
+
+	/* Columns that weren't fetched (not needed by the query) are null */
+	memset(slot->tts_isnull, true, tupdesc->natts * sizeof(bool));
+	ksym_use(st->symbols);
+	for (int i = 0; i < st->ncols; i++)
+	{
+		int kc = st->kcol[i];
+		st->kernels[i](kK(values)[kc], st->row, 1, &slot->tts_values[st->att[i]], kS(colnames)[kc]);
+		slot->tts_isnull[st->att[i]] = false;
+	}
+	ksym_use(NULL);
+
+	/* Aggregates of no rows (but count) are null, as in Postgres */
+	if (st->ncount >= 0 && st->nullempty != NIL && kJ(kK(values)[st->ncount])[st->row] == 0)
+	{
+		ListCell *lc;
+		foreach(lc, st->nullempty)
+			slot->tts_isnull[lfirst_int(lc)] = true;
+	}
+
+	st->row++;
+	return ExecStoreVirtualTuple(slot);
+}
+
+
+/*
+ * Fetch the whole kdb+ result, or its next chunk, or the next slice claimed
+ * by this parallel participant
+ */
+K kfdw_fetch(KFdwScan *st)
+{
+	if (st->pcursor != 0)
+		return kcursor_slice(st->host, st->port, st->userpass, st->pcursor, kfdw_slice_rows());
+	if (st->cursor != 0)
+		return kcursor_fetch(st->host, st->port, st->userpass, st->cursor, kconn_chunk_rows);
+
+	K table = kconn_call(st->host, st->port, st->userpass, st->query, NULL);
+	ktable_check(table);
+	return table;
+}
+
+
+J kfdw_slice_rows(void)
+{
+	return kconn_chunk_rows > 0 ? kconn_chunk_rows : KFDW_SLICE_ROWS;
+}
+
+
+/*
+ * Release the kdb+ result, and the cursor if it hasn't been read to the end
+ */
+void kfdw_release(KFdwScan *st)
+{
+	if (st->table != NULL)
+		r0(st->table);
+	if (st->cursor != 0)
+		kcursor_close(st->host, st->port, st->userpass, st->cursor);
+
+	st->table = NULL;
+	st->cursor = 0;
+	st->chunked = false;
+}
+
+
+void kfdw_rescan(ForeignScanState *node)
+{
+	KFdwScan *st = (KFdwScan *) node->fdw_state;
+
+	/* 
+	 * A complete result is simply reread; a streamed one is requested again,
+	 * as is a sliced one (through the cursor reopened by kfdw_dsm_reinit)
+	 */
+	if (st->chunked || st->pcursor != 0)
+		kfdw_release(st);
+	st->row = 0;
+}
+
+
+void kfdw_end(ForeignScanState *node)
+{
+	KFdwScan *st = (KFdwScan *) node->fdw_state;
+
+	if (st != NULL)
+	{
+		kfdw_release(st);
+
+		/* Workers have finished with the shared cursor by now */
+		if (st->powner && st->pcursor != 0)
+			kcursor_close(st->host, st->port, st->userpass, st->pcursor);
+	}
+}
+
+
+/*
+ * Each parallel participant has its own kdb+ connection
+ */
+bool kfdw_parallel_safe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
+{
+	return true;
+}
+
+
+Size kfdw_dsm_size(ForeignScanState *node, ParallelContext *pcxt)
+{
+	return sizeof(KFdwShared);
+}
+
+
+/*
+ * The leader evaluates the query into a kdb+ cursor, whose slices are then
+ * claimed by the participants (kdb+ serves one claim at a time)
+ */
+void kfdw_dsm_init(ForeignScanState *node, ParallelContext *pcxt, void *coordinate)
+{
+	KFdwScan *st = (KFdwScan *) node->fdw_state;
+	KFdwShared *shared = (KFdwShared *) coordinate;
+
+	st->pcursor = kcursor_open(st->host, st->port, st->userpass, ktn(KS, 0), kp(st->query));
+	st->powner = true;
+	shared->cursor = st->pcursor;
+}
+
+
+void kfdw_dsm_reinit(ForeignScanState *node, ParallelContext *pcxt, void *coordinate)
+{
+	KFdwScan *st = (KFdwScan *) node->fdw_state;
+
+	if (st->pcursor != 0)
+		kcursor_close(st->host, st->port, st->userpass, st->pcursor);
+	kfdw_dsm_init(node, pcxt, coordinate);
+}
+
+
+void kfdw_worker_init(ForeignScanState *node, shm_toc *toc, void *coordinate)
+{
+	KFdwScan *st = (KFdwScan *) node->fdw_state;
+
+	st->pcursor = ((KFdwShared *) coordinate)->cursor;
+}
+
+
+/*
+ * EXPLAIN VERBOSE shows the q text sent to kdb+
+ */
+void kfdw_explain(ForeignScanState *node, ExplainState *es)
+{
+	ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+
+	if (es->verbose)
+		ExplainPropertyText("kdb+ Query", strVal(linitial(plan->fdw_private)), es);
+}
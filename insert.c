@@ -0,0 +1,343 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bulk writes from Postgres to kdb+. The pgtokdb.insert(target, record)
+ * aggregate converts each row with the p2k functions and appends the values
+ * to one kdb+ vector per column. Every pgtokdb.insert_batch rows, the columns
+ * are sent in a single call to .pgtokdb.upsertrows (see pgtokdb.q), which
+ * upserts them into the target table.
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/typcache.h>
+
+/* State of the aggregate */
+typedef struct
+{
+	char	   *target;		/* kdb+ table receiving the rows */
+	TupleDesc	tupdesc;	/* Row type of the records */
+	int			ncols;		/* Number of columns sent */
+	int		   *att;		/* Attribute of each column */
+	int		   *todtind;	/* Type-oid dispatch entry of each column */
+	K			names;		/* Column names */
+	K			cols;		/* Columns of the current batch */
+	J			nrows;		/* Rows in the current batch */
+	int64		total;		/* Rows sent so far */
+} KInsert;
+
+/* Configuration globals */
+static int insert_batch = 100000;
+static bool insert_async = false;
+
+/* Prototypes */
+signed char kinsert_ktype(Oid);
+K		kinsert_cols(KInsert *);
+void	kinsert_append(K *, K);
+void	kinsert_null(K *);
+void	kinsert_flush(KInsert *);
+void	kinsert_free(void *);
+KInsert *kinsert_start(MemoryContext, text *, HeapTupleHeader);
+
+
+/*
+ * Define the configuration settings used by pgtokdb.insert
+ */
+void insert_init(void)
+{
+	DefineCustomIntVariable("pgtokdb.insert_batch",
+		"Rows sent to kdb+ per call by pgtokdb.insert.",
+		NULL, &insert_batch, 100000, 1, INT_MAX,
+		PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgtokdb.insert_async",
+		"Send the batches of pgtokdb.insert without waiting for kdb+.",
+		"kdb+ errors are then not reported back.",
+		&insert_async, false, PGC_USERSET, 0, NULL, NULL, NULL);
+}
+
+
+/*
+ * kdb+ type of the values produced by the p2k function of a Postgres type
+ * (0 for those, like varchar, that produce a list per value)
+ */
+signed char kinsert_ktype(Oid typeoid)
+{
+	switch (typeoid)
+	{
+		case BOOLOID: return KB;
+		case INT2OID: return KH;
+		case INT4OID: return KI;
+		case INT8OID: return KJ;
+		case FLOAT4OID: return KE;
+		case FLOAT8OID: return KF;
+		case NUMERICOID: return KF;
+		case BPCHAROID: return KC;
+		case TIMESTAMPOID: return KP;
+		case TIMESTAMPTZOID: return KP;
+		case DATEOID: return KD;
+		case UUIDOID: return UU;
+		default: return 0;
+	}
+}
+
+
+/*
+ * Empty columns for a new batch
+ */
+K kinsert_cols(KInsert *st)
+{
+	K cols = ktn(0, st->ncols);
+	for (int i = 0; i < st->ncols; i++)
+	{
+		Oid typeoid = TupleDescAttr(st->tupdesc, st->att[i])->atttypid;
+		kK(cols)[i] = ktn(kinsert_ktype(typeoid), 0);
+	}
+	return cols;
+}
+
+
+/*
+ * Append a value (consumed) produced by a p2k function to a column
+ */
+void kinsert_append(K *col, K a)
+{
+	if ((*col)->t == 0)
+	{
+		jk(col, a);
+		return;
+	}
+
+	if (a->t == -KS)
+		js(col, a->s);
+	else if (a->t == -UU)
+		ja(col, kG(a));
+	else
+		ja(col, &a->g);
+	r0(a);
+}
+
+
+/*
+ * Append the kdb+ null of a column's type (false, blank or zeros for types
+ * without a null)
+ */
+void kinsert_null(K *col)
+{
+	switch ((*col)->t)
+	{
+		case 0: jk(col, ktn(KC, 0)); break;
+		case KB: { G g = 0; ja(col, &g); break; }
+		case KC: { C c = ' '; ja(col, &c); break; }
+		case KH: { H h = nh; ja(col, &h); break; }
+		case KI: case KD: { I i = ni; ja(col, &i); break; }
+		case KJ: case KP: { J j = nj; ja(col, &j); break; }
+		case KE: { E e = (E) nf; ja(col, &e); break; }
+		case KF: { F f = nf; ja(col, &f); break; }
+		case UU: { U u; memset(&u, 0, sizeof(u)); ja(col, &u); break; }
+	}
+}
+
+
+/*
+ * Send the rows of the current batch to kdb+
+ */
+void kinsert_flush(KInsert *st)
+{
+	if (st->nrows == 0)
+		return;
+
+	const char *host = GetConfigOption("pgtokdb.host", false, false);
+	int port = atoi(GetConfigOption("pgtokdb.port", false, false));
+	const char *userpass = GetConfigOption("pgtokdb.userpass", false, false);
+
+	/* Writes always go to the first of a list of replicas, and are never hedged */
+	kreplica_pick(&host, &port);
+
+	/* The call takes over the columns */
+	K args = knk(3, ks(st->target), r1(st->names), st->cols);
+	st->cols = NULL;
+
+	if (insert_async)
+	{
+		I handle = kconn_open(host, port, userpass);
+		kk(-handle, ".pgtokdb.upsertrows", args);
+		args->n = 0;
+		r0(args);
+	}
+	else
+	{
+		K result = kconn_call(host, port, userpass, ".pgtokdb.upsertrows", args);
+		if (result == NULL)
+			elog(ERROR, "Network error communicating with kdb+");
+		if (result->t == -128)
+		{
+			char *p = pstrdup(result->s);
+			r0(result);
+			elog(ERROR, "kdb: %s", p);
+		}
+		r0(result);
+	}
+
+	st->total += st->nrows;
+	st->nrows = 0;
+	st->cols = kinsert_cols(st);
+}
+
+
+/*
+ * Release the kdb+ objects held by the state when the aggregate's memory
+ * goes away (including on error)
+ */
+void kinsert_free(void *arg)
+{
+	KInsert *st = (KInsert *) arg;
+
+	if (st->cols != NULL)
+		r0(st->cols);
+	if (st->names != NULL)
+		r0(st->names);
+	st->cols = NULL;
+	st->names = NULL;
+}
+
+
+/*
+ * Set up the aggregate state from the first row
+ */
+KInsert *kinsert_start(MemoryContext aggcontext, text *target, HeapTupleHeader rec)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	KInsert *st = (KInsert *) palloc0(sizeof(KInsert));
+	st->target = text_to_cstring(target);
+	st->tupdesc = lookup_rowtype_tupdesc_copy(HeapTupleHeaderGetTypeId(rec),
+		HeapTupleHeaderGetTypMod(rec));
+
+	int natts = st->tupdesc->natts;
+	st->att = (int *) palloc(natts * sizeof(int));
+	st->todtind = (int *) palloc(natts * sizeof(int));
+
+	for (int i = 0; i < natts; i++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(st->tupdesc, i);
+		if (attr->attisdropped)
+			continue;
+
+		int ind = findOID(attr->atttypid);
+		if (ind == -1 || todt[ind].p2k == NULL)
+			elog(ERROR, "Extension does not support datatype in column \"%s\"",
+				NameStr(attr->attname));
+
+		st->att[st->ncols] = i;
+		st->todtind[st->ncols] = ind;
+		st->ncols++;
+	}
+
+	st->names = ktn(KS, st->ncols);
+	for (int i = 0; i < st->ncols; i++)
+		kS(st->names)[i] = ss(NameStr(TupleDescAttr(st->tupdesc, st->att[i])->attname));
+	st->cols = kinsert_cols(st);
+
+	MemoryContextCallback *cb = (MemoryContextCallback *) palloc(sizeof(MemoryContextCallback));
+	cb->func = kinsert_free;
+	cb->arg = st;
+	MemoryContextRegisterResetCallback(aggcontext, cb);
+
+	MemoryContextSwitchTo(oldcontext);
+	return st;
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(insert_sfunc);
+
+/*
+ * Transition function of pgtokdb.insert(target, record): add a row to the
+ * current batch, and send the batch once it is full
+ */
+PGDLLEXPORT Datum insert_sfunc(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "pgtokdb.insert must be called as an aggregate");
+
+	KInsert *st = PG_ARGISNULL(0) ? NULL : (KInsert *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(2)) /* Nothing to insert */
+		PG_RETURN_POINTER(st);
+	if (PG_ARGISNULL(1))
+		elog(ERROR, "The kdb+ target table of pgtokdb.insert must not be null");
+
+	HeapTupleHeader rec = PG_GETARG_HEAPTUPLEHEADER(2);
+	if (st == NULL)
+		st = kinsert_start(aggcontext, PG_GETARG_TEXT_PP(1), rec);
+
+	/* Deconstruct the row */
+	HeapTupleData tuple;
+	tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
+	ItemPointerSetInvalid(&tuple.t_self);
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = rec;
+
+	int natts = st->tupdesc->natts;
+	Datum *values = (Datum *) palloc(natts * sizeof(Datum));
+	bool *nulls = (bool *) palloc(natts * sizeof(bool));
+	heap_deform_tuple(&tuple, st->tupdesc, values, nulls);
+
+	for (int i = 0; i < st->ncols; i++)
+	{
+		int att = st->att[i];
+		K *col = &kK(st->cols)[i];
+
+		if (nulls[att])
+			kinsert_null(col);
+		else
+			kinsert_append(col, (todt[st->todtind[i]].p2k)(values[att]));
+	}
+
+	pfree(values);
+	pfree(nulls);
+
+	if (++st->nrows >= insert_batch)
+		kinsert_flush(st);
+
+	PG_RETURN_POINTER(st);
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(insert_ffunc);
+
+/*
+ * Final function of pgtokdb.insert: send the last batch and return the
+ * number of rows sent
+ */
+PGDLLEXPORT Datum insert_ffunc(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		PG_RETURN_INT64(0);
+
+	KInsert *st = (KInsert *) PG_GETARG_POINTER(0);
+	kinsert_flush(st);
+
+	PG_RETURN_INT64(st->total);
+}
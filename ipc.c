@@ -0,0 +1,508 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Built-in reader of kdb+ IPC responses (used when pgtokdb.builtin_reader is
+ * on). k() of the C API reads a whole response into a buffer of its own
+ * before decoding it, and blocks until the last byte has arrived. Here the
+ * response is decoded as it is received: each object is built as soon as its
+ * header is read, and the data of a vector is received straight into the
+ * vector, so that a large result is held once rather than twice, and decoding
+ * proceeds while the rest of the response is still in transit. Between reads,
+ * a cancel request and pgtokdb.query_timeout are checked (see kconn_poll). A
+ * response that kdb+ compressed (as it does for large messages to other
+ * hosts) is received whole, decompressed, and decoded from memory.
+ *
+ * Objects are allocated with the C API (ktn, ka, ...), so that the rest of the
+ * extension can't tell which reader was used. Functions, enumerations and
+ * other objects that don't appear in query results raise an error.
+ */
+
+#include "pgtokdb.h"
+#include <errno.h>
+#include <limits.h>
+#include <miscadmin.h>
+#include <lib/stringinfo.h>
+#include <utils/memutils.h>
+
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+/* Bytes received from the socket at a time (larger vectors bypass the buffer) */
+#define KIPC_BUFSIZE	65536
+
+/* Deepest nesting of objects decoded */
+#define KIPC_DEPTH		64
+
+/* A response being read */
+typedef struct
+{
+	I			handle;		/* Socket (0 once the message is in memory) */
+	const char *host;		/* kdb+ process, for messages */
+	int			port;
+	instr_time	start;		/* When the call was sent (for pgtokdb.query_timeout) */
+	G		   *buf;		/* Bytes received but not yet decoded */
+	J			pos;		/* Next byte of buf to decode */
+	J			len;		/* Bytes in buf */
+	J			left;		/* Bytes of the message not yet received */
+	K			stack[KIPC_DEPTH];	/* Objects being built, freed on an error */
+	int			depth;
+	StringInfoData sym;		/* Symbol received in several pieces */
+} KIpc;
+
+/* Bytes per item of the vector types */
+static const int kipc_size[] = { 0, 1, 16, 0, 1, 2, 4, 8, 4, 8, 1, 0, 8, 4, 4, 8, 8, 4, 4, 4 };
+
+/* Prototypes */
+bool	kipc_recv(KIpc *, G *, J);
+bool	kipc_fill(KIpc *);
+bool	kipc_bytes(KIpc *, void *, J);
+bool	kipc_symbol(KIpc *, S *);
+void	kipc_push(KIpc *, K);
+K		kipc_decode(KIpc *);
+void	kipc_inflate(G *, J, G *, J);
+
+
+/*
+ * Receive up to n bytes of the message into dst, once the socket is
+ * readable. Returns false when the connection is closed or fails.
+ */
+bool kipc_recv(KIpc *r, G *dst, J n)
+{
+	n = Min(n, r->left);
+	if (n <= 0)
+		elog(ERROR, "Malformed response from kdb+ at %s:%d (truncated)", r->host, r->port);
+
+	for (;;)
+	{
+		kconn_poll(r->handle, r->host, r->port, POLLIN, r->start);
+
+		J got = recv(r->handle, (char *) dst, (size_t) Min(n, INT_MAX), 0);
+		if (got > 0)
+		{
+			r->left -= got;
+			return true;
+		}
+		if (got == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+			return false;
+	}
+}
+
+
+/*
+ * Refill the (empty) buffer from the socket
+ */
+bool kipc_fill(KIpc *r)
+{
+	if (r->handle == 0)
+		elog(ERROR, "Malformed response from kdb+ at %s:%d (truncated)", r->host, r->port);
+
+	J before = r->left;
+	if (!kipc_recv(r, r->buf, KIPC_BUFSIZE))
+		return false;
+
+	r->pos = 0;
+	r->len = before - r->left;
+	return true;
+}
+
+
+/*
+ * Decode the next n bytes into dst. What the buffer doesn't hold of a large
+ * block is received straight into dst.
+ */
+bool kipc_bytes(KIpc *r, void *dst, J n)
+{
+	G *d = (G *) dst;
+
+	while (n > 0)
+	{
+		if (r->pos == r->len)
+		{
+			if (r->handle != 0 && n >= KIPC_BUFSIZE)
+			{
+				J before = r->left;
+				if (!kipc_recv(r, d, n))
+					return false;
+				d += before - r->left;
+				n -= before - r->left;
+				continue;
+			}
+			if (!kipc_fill(r))
+				return false;
+		}
+
+		J m = Min(n, r->len - r->pos);
+		memcpy(d, r->buf + r->pos, m);
+		r->pos += m;
+		d += m;
+		n -= m;
+	}
+
+	return true;
+}
+
+
+/*
+ * Decode a null-terminated symbol, interned as the C API does
+ */
+bool kipc_symbol(KIpc *r, S *s)
+{
+	resetStringInfo(&r->sym);
+
+	for (;;)
+	{
+		if (r->pos == r->len && !kipc_fill(r))
+			return false;
+
+		G *start = r->buf + r->pos;
+		G *end = memchr(start, '\0', r->len - r->pos);
+		if (end != NULL)
+		{
+			r->pos += end - start + 1;
+			if (r->sym.len == 0)
+				*s = sn((S) start, (I) (end - start));
+			else
+			{
+				appendBinaryStringInfo(&r->sym, (char *) start, (int) (end - start));
+				*s = sn(r->sym.data, r->sym.len);
+			}
+			return true;
+		}
+
+		/* Continued in the next read */
+		appendBinaryStringInfo(&r->sym, (char *) start, (int) (r->len - r->pos));
+		r->pos = r->len;
+	}
+}
+
+
+/*
+ * Track an object being built, so that it is freed if reading fails
+ */
+void kipc_push(KIpc *r, K x)
+{
+	if (r->depth == KIPC_DEPTH)
+	{
+		r0(x);
+		elog(ERROR, "Response from kdb+ at %s:%d is nested deeper than %d", r->host, r->port,
+			KIPC_DEPTH);
+	}
+	r->stack[r->depth++] = x;
+}
+
+
+/*
+ * Decode the next object. Returns NULL when the connection fails (whatever
+ * had been built is then on the stack).
+ */
+K kipc_decode(KIpc *r)
+{
+	signed char t;
+	G attr;
+	I n;
+	K x;
+
+	if (!kipc_bytes(r, &t, 1))
+		return NULL;
+
+	/* Atoms */
+	if (t < 0 && t >= -KT)
+	{
+		if (t == -KS)
+		{
+			S s;
+			if (!kipc_symbol(r, &s))
+				return NULL;
+			x = ka(-KS);
+			x->s = s;
+			return x;
+		}
+		if (t == -UU)
+		{
+			U u;
+			if (!kipc_bytes(r, &u, sizeof(U)))
+				return NULL;
+			return ku(u);
+		}
+		if (t == -3)
+			elog(ERROR, "Malformed response from kdb+ at %s:%d (type -3)", r->host, r->port);
+
+		x = ka(t);
+		kipc_push(r, x);
+		if (!kipc_bytes(r, &x->g, kipc_size[-t]))
+			return NULL;
+		r->depth--;
+		return x;
+	}
+
+	switch (t)
+	{
+		case -128:
+		{
+			/* Error raised by the call */
+			S s;
+			if (!kipc_symbol(r, &s))
+				return NULL;
+			x = ka(-128);
+			x->s = s;
+			return x;
+		}
+
+		case 0:
+		{
+			if (!kipc_bytes(r, &attr, 1) || !kipc_bytes(r, &n, sizeof(I)))
+				return NULL;
+			x = ktn(0, 0);
+			x->u = attr;
+			kipc_push(r, x);
+			for (I i = 0; i < n; i++)
+			{
+				K item = kipc_decode(r);
+				if (item == NULL)
+					return NULL;
+				jk(&x, item);
+				r->stack[r->depth - 1] = x;
+			}
+			r->depth--;
+			return x;
+		}
+
+		case XT:
+		{
+			if (!kipc_bytes(r, &attr, 1))
+				return NULL;
+			K d = kipc_decode(r);
+			if (d == NULL)
+				return NULL;
+			if (d->t != XD)
+			{
+				r0(d);
+				elog(ERROR, "Malformed response from kdb+ at %s:%d (table without a dictionary)",
+					r->host, r->port);
+			}
+			return xT(d);
+		}
+
+		case XD:
+		case 127:	/* Sorted dictionary */
+		{
+			K keys = kipc_decode(r);
+			if (keys == NULL)
+				return NULL;
+			kipc_push(r, keys);
+			K values = kipc_decode(r);
+			if (values == NULL)
+				return NULL;
+			r->depth--;
+			return xD(keys, values);
+		}
+
+		case 101:	/* Generic null, and the primitives */
+		case 102:
+		case 103:
+			x = ka(t);
+			kipc_push(r, x);
+			if (!kipc_bytes(r, &x->g, 1))
+				return NULL;
+			r->depth--;
+			return x;
+	}
+
+	if (t < KB || t > KT || t == 3)
+		elog(ERROR, "Response from kdb+ at %s:%d holds an object of type %d, which "
+			"the built-in reader doesn't support (set pgtokdb.builtin_reader to off)",
+			r->host, r->port, t);
+
+	/* Vectors */
+	if (!kipc_bytes(r, &attr, 1) || !kipc_bytes(r, &n, sizeof(I)))
+		return NULL;
+	if (n < 0)
+		elog(ERROR, "Malformed response from kdb+ at %s:%d (vector of %d items)",
+			r->host, r->port, n);
+
+	x = ktn(t, n);
+	x->u = attr;
+	kipc_push(r, x);
+
+	if (t == KS)
+	{
+		for (I i = 0; i < n; i++)
+			if (!kipc_symbol(r, &kS(x)[i]))
+				return NULL;
+	}
+	else if (!kipc_bytes(r, kG(x), (J) n * kipc_size[t]))
+		return NULL;
+
+	r->depth--;
+	return x;
+}
+
+
+/*
+ * Decompress a message compressed by kdb+ (src follows the header, and
+ * starts with the size of the decompressed message). The decompressed
+ * message is written to dst, past the 8 bytes of its header.
+ */
+void kipc_inflate(G *src, J srclen, G *dst, J dstlen)
+{
+	J pairs[256] = { 0 };	/* Last position of each pair of bytes (by xor) */
+	J s = 8, p = 8, d = 4;
+	int flags = 0, bit = 0;
+
+	while (s < dstlen)
+	{
+		if (bit == 0)
+		{
+			if (d >= srclen)
+				goto truncated;
+			flags = src[d++];
+			bit = 1;
+		}
+
+		if (flags & bit)
+		{
+			/* A pair seen before, followed by n more bytes copied from after it */
+			if (d + 1 >= srclen)
+				goto truncated;
+			J from = pairs[src[d++]];
+			int n = src[d++];
+			if (s + 2 + n > dstlen)
+				goto truncated;
+			for (int m = 0; m < 2 + n; m++)
+				dst[s + m] = dst[from + m];
+			s += 2;
+			for (; p < s - 1; p++)
+				pairs[dst[p] ^ dst[p + 1]] = p;
+			p = s += n;
+		}
+		else
+		{
+			if (d >= srclen)
+				goto truncated;
+			dst[s++] = src[d++];
+			for (; p < s - 1; p++)
+				pairs[dst[p] ^ dst[p + 1]] = p;
+		}
+
+		bit = (bit << 1) & 0xff;
+	}
+	return;
+
+truncated:
+	elog(ERROR, "Malformed compressed response from kdb+");
+}
+
+
+/*
+ * Read the response to a synchronous call from a kdb+ handle. Returns NULL
+ * when the connection is closed or fails, as k() does.
+ */
+K kipc_receive(I handle, const char *host, int port, instr_time start)
+{
+	KIpc	   *r = (KIpc *) palloc0(sizeof(KIpc));
+	G			header[8];
+	K volatile	result = NULL;
+	G *volatile	message = NULL;
+
+	r->handle = handle;
+	r->host = host;
+	r->port = port;
+	r->start = start;
+	r->buf = (G *) palloc(KIPC_BUFSIZE);
+	r->left = sizeof(header);
+	initStringInfo(&r->sym);
+
+	PG_TRY();
+	{
+		if (kipc_bytes(r, header, sizeof(header)))
+		{
+			I size;
+			memcpy(&size, header + 4, sizeof(I));
+			kconn_bytes += size;
+
+			if (header[0] != 1)
+				elog(ERROR, "The built-in reader doesn't support big-endian messages "
+					"(from kdb+ at %s:%d)", host, port);
+			if (header[2] > 1 || size < (I) sizeof(header) + 1)
+				elog(ERROR, "Unsupported response header from kdb+ at %s:%d", host, port);
+
+			r->left = size - sizeof(header);
+			bool ok = true;
+
+			if (header[2] == 1)
+			{
+				/* Compressed: received whole, then decoded from memory */
+				J clen = r->left;
+				G *compressed = (G *) MemoryContextAllocHuge(CurrentMemoryContext, clen);
+				ok = kipc_bytes(r, compressed, clen);
+				if (ok)
+				{
+					I dlen = 0;
+					if (clen >= (J) sizeof(I))
+						memcpy(&dlen, compressed, sizeof(I));
+					if (dlen < (I) sizeof(header) + 1)
+						elog(ERROR, "Malformed compressed response from kdb+ at %s:%d", host, port);
+
+					message = (G *) MemoryContextAllocHuge(CurrentMemoryContext, dlen);
+					memset(message, 0, sizeof(header));
+					kipc_inflate(compressed, clen, message, dlen);
+					r->handle = 0;
+					r->buf = message;
+					r->pos = sizeof(header);
+					r->len = dlen;
+				}
+				pfree(compressed);
+			}
+
+			if (ok)
+				result = kipc_decode(r);
+
+			if (result != NULL && (r->pos != r->len || r->left != 0))
+			{
+				K x = result;
+				result = NULL;
+				r0(x);
+				elog(ERROR, "Malformed response from kdb+ at %s:%d (trailing bytes)", host, port);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		while (r->depth > 0)
+			r0(r->stack[--r->depth]);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* A connection that failed leaves objects half built */
+	while (r->depth > 0)
+		r0(r->stack[--r->depth]);
+
+	if (message != NULL)
+		pfree(message);
+	else
+		pfree(r->buf);
+	pfree(r->sym.data);
+	pfree(r);
+
+	return result;
+}
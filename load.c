@@ -0,0 +1,515 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bulk load of a kdb+ result into a Postgres table, e.g.
+ *   select * from pgtokdb.load('pgtbl', 'select j from kdbtbl');
+ * Rather than going through the executor a row at a time (as INSERT ...
+ * SELECT from a getset function does), each batch of rows is converted a
+ * column at a time by the getset kernels straight into the table's slots,
+ * and written with table_multi_insert and a bulk insert state, as COPY FROM
+ * does. Columns of the table that the result doesn't have take their
+ * defaults. Constraints and indexes are maintained; tables with triggers
+ * (including foreign keys) are not supported.
+ */
+
+#include "pgtokdb.h"
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <access/heapam.h>
+#include <access/htup_details.h>
+#include <access/table.h>
+#include <access/tableam.h>
+#include <access/xact.h>
+#include <access/xlog.h>
+#include <catalog/catalog.h>
+#include <catalog/objectaddress.h>
+#include <executor/executor.h>
+#include <nodes/makefuncs.h>
+#include <optimizer/optimizer.h>
+#include <rewrite/rewriteHandler.h>
+#include <tcop/utility.h>
+#include <utils/acl.h>
+#include <utils/guc.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/portal.h>
+#include <utils/rel.h>
+#include <utils/rls.h>
+#include <utils/snapmgr.h>
+#if PG_VERSION_NUM >= 160000
+#include <parser/parse_relation.h>
+#endif
+
+/* Rows written per call of table_multi_insert */
+#define KLOAD_BATCH 1000
+
+/* Subtransactions in which a relation got its (first) new relfilenode */
+#if PG_VERSION_NUM >= 160000
+#define KLOAD_NEW_SUBID(rel)	((rel)->rd_newRelfilelocatorSubid)
+#define KLOAD_FIRST_SUBID(rel)	((rel)->rd_firstRelfilelocatorSubid)
+#elif PG_VERSION_NUM >= 130000
+#define KLOAD_NEW_SUBID(rel)	((rel)->rd_newRelfilenodeSubid)
+#define KLOAD_FIRST_SUBID(rel)	((rel)->rd_firstRelfilenodeSubid)
+#else
+#define KLOAD_NEW_SUBID(rel)	((rel)->rd_newRelfilenodeSubid)
+#define KLOAD_FIRST_SUBID(rel)	((rel)->rd_newRelfilenodeSubid)
+#endif
+
+/* State of a load */
+struct KLoad
+{
+	Relation	rel;		/* Table loaded */
+	EState	   *estate;		/* For constraints, defaults and indexes */
+	ResultRelInfo *rri;
+	TupleTableSlot **slots;	/* One per row of a batch */
+	BulkInsertState bistate;
+	CommandId	cid;
+	int			ti_options;	/* Options of table_multi_insert */
+	int			natts;
+	int		   *perm;		/* kdb+ column of each attribute (-1 if none) */
+	K2PCOL	   *kernels;	/* Conversion of each attribute from its kdb+ column */
+	ExprState **defaults;	/* Default of each attribute (NULL for none) */
+	Datum	   *colbuf;		/* Converted values of one batch, column after column */
+	KSymCache  *symbols;
+	MemoryContext batchctx;	/* Reset after each batch */
+	int64		rows;		/* Rows written so far */
+};
+
+/* Configuration globals */
+static bool load_freeze = false;
+
+/* Prototypes */
+int		kload_options(Relation);
+K		kload_args(FunctionCallInfo);
+void	kload_plan(KLoad *, K);
+
+
+/*
+ * Define the configuration settings used by pgtokdb.load
+ */
+void load_init(void)
+{
+	DefineCustomBoolVariable("pgtokdb.load_freeze",
+		"Have pgtokdb.load write rows already frozen, as COPY FREEZE does.",
+		"The table must have been created or truncated in the current subtransaction.",
+		&load_freeze, false, PGC_USERSET, 0, NULL, NULL, NULL);
+}
+
+
+/*
+ * Check that rows can be loaded into a table by the current user
+ */
+void kload_check(Relation rel)
+{
+	char *relname = RelationGetRelationName(rel);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION || IsCatalogRelation(rel))
+		elog(ERROR, "pgtokdb.load can only load into a table (\"%s\" is not one)", relname);
+
+	AclResult aclresult = pg_class_aclcheck(RelationGetRelid(rel), GetUserId(), ACL_INSERT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind), relname);
+
+	if (check_enable_rls(RelationGetRelid(rel), InvalidOid, false) == RLS_ENABLED)
+		elog(ERROR, "pgtokdb.load does not support row-level security (table \"%s\")", relname);
+
+	TriggerDesc *trig = rel->trigdesc;
+	if (trig != NULL && (trig->trig_insert_before_row || trig->trig_insert_after_row ||
+		trig->trig_insert_instead_row || trig->trig_insert_before_statement ||
+		trig->trig_insert_after_statement))
+		elog(ERROR, "pgtokdb.load does not fire triggers, and table \"%s\" has insert "
+			"triggers (or foreign keys); use INSERT ... SELECT instead", relname);
+
+	if (rel->rd_att->constr != NULL && rel->rd_att->constr->has_generated_stored)
+		elog(ERROR, "pgtokdb.load does not support generated columns (table \"%s\")", relname);
+}
+
+
+/*
+ * Options of table_multi_insert. As for COPY, the free space map is skipped
+ * for a table created or truncated in the current transaction, whose WAL is
+ * also skipped (the table is synced instead) when wal_level is minimal.
+ */
+int kload_options(Relation rel)
+{
+	int ti_options = 0;
+
+	if (rel->rd_createSubid != InvalidSubTransactionId ||
+		KLOAD_FIRST_SUBID(rel) != InvalidSubTransactionId)
+	{
+		ti_options |= TABLE_INSERT_SKIP_FSM;
+#if PG_VERSION_NUM < 130000
+		if (!XLogIsNeeded())
+			ti_options |= TABLE_INSERT_SKIP_WAL;
+#endif
+	}
+
+	if (load_freeze)
+	{
+		if (!ThereAreNoPriorRegisteredSnapshots() || !ThereAreNoReadyPortals())
+			elog(ERROR, "Cannot load frozen rows because of prior transaction activity");
+
+		if (rel->rd_createSubid != GetCurrentSubTransactionId() &&
+			KLOAD_NEW_SUBID(rel) != GetCurrentSubTransactionId())
+			elog(ERROR, "Cannot load frozen rows because table \"%s\" was not created or "
+				"truncated in the current subtransaction", RelationGetRelationName(rel));
+
+		ti_options |= TABLE_INSERT_FROZEN;
+	}
+
+	return ti_options;
+}
+
+
+/*
+ * The arguments that follow the table and the expression, as a kdb+ list
+ */
+K kload_args(FunctionCallInfo fcinfo)
+{
+	if (get_fn_expr_variadic(fcinfo->flinfo))
+		elog(ERROR, "Arguments of pgtokdb.load must be passed one by one, not as a VARIADIC array");
+
+	if (PG_NARGS() - 2 > 8)
+		elog(ERROR, "The number of kdb+ function parameters exceeds 8");
+
+	K args = knk(0);
+
+	for (int i = 2; i < PG_NARGS(); i++)
+	{
+		Oid typeoid = get_fn_expr_argtype(fcinfo->flinfo, i);
+
+		if (PG_ARGISNULL(i))
+			elog(ERROR, "Argument %d is null", i + 1);
+
+		/* A quoted literal that was not cast is passed as a string */
+		if (typeoid == UNKNOWNOID)
+		{
+			jk(&args, kp(DatumGetCString(PG_GETARG_DATUM(i))));
+			continue;
+		}
+
+		int ind = findOID(typeoid);
+		if (ind < 0 || todt[ind].p2k == NULL)
+			elog(ERROR, "Argument %d uses an unsupported type", i + 1);
+		jk(&args, (todt[ind].p2k)(PG_GETARG_DATUM(i)));
+	}
+
+	return args;
+}
+
+
+/*
+ * Set up the executor state, slots and defaults of a load into a table
+ */
+KLoad *kload_start(Relation rel)
+{
+	TupleDesc tupdesc = RelationGetDescr(rel);
+	KLoad *st = (KLoad *) palloc0(sizeof(KLoad));
+
+	st->rel = rel;
+	st->natts = tupdesc->natts;
+	st->ti_options = kload_options(rel);
+	st->cid = GetCurrentCommandId(true);
+
+	/* A range table of the one table, for the messages of ExecConstraints */
+	st->estate = CreateExecutorState();
+	RangeTblEntry *rte = makeNode(RangeTblEntry);
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = rel->rd_rel->relkind;
+	rte->rellockmode = RowExclusiveLock;
+#if PG_VERSION_NUM >= 160000
+	List *perminfos = NIL;
+	RTEPermissionInfo *perminfo = addRTEPermissionInfo(&perminfos, rte);
+	perminfo->requiredPerms = ACL_INSERT;
+	ExecInitRangeTable(st->estate, list_make1(rte), perminfos);
+#else
+	rte->requiredPerms = ACL_INSERT;
+	ExecInitRangeTable(st->estate, list_make1(rte));
+#endif
+
+	st->rri = makeNode(ResultRelInfo);
+	InitResultRelInfo(st->rri, rel, 1, NULL, 0);
+#if PG_VERSION_NUM < 140000
+	st->estate->es_result_relations = st->rri;
+	st->estate->es_num_result_relations = 1;
+	st->estate->es_result_relation_info = st->rri;
+#endif
+	ExecOpenIndices(st->rri, false);
+
+	st->slots = (TupleTableSlot **) palloc(KLOAD_BATCH * sizeof(TupleTableSlot *));
+	for (int r = 0; r < KLOAD_BATCH; r++)
+		st->slots[r] = table_slot_create(rel, NULL);
+	st->bistate = GetBulkInsertState();
+
+	st->perm = (int *) palloc(st->natts * sizeof(int));
+	st->kernels = (K2PCOL *) palloc0(st->natts * sizeof(K2PCOL));
+	st->defaults = (ExprState **) palloc0(st->natts * sizeof(ExprState *));
+	for (int i = 0; i < st->natts; i++)
+	{
+		if (TupleDescAttr(tupdesc, i)->attisdropped)
+			continue;
+		Node *def = build_column_default(rel, i + 1);
+		if (def != NULL)
+			st->defaults[i] = ExecInitExpr(expression_planner((Expr *) def), NULL);
+	}
+
+	st->colbuf = (Datum *) palloc(st->natts * KLOAD_BATCH * sizeof(Datum));
+	st->symbols = ksym_create(CurrentMemoryContext);
+	st->batchctx = AllocSetContextCreate(CurrentMemoryContext,
+		"pgtokdb load batch", ALLOCSET_DEFAULT_SIZES);
+
+	return st;
+}
+
+
+/*
+ * Map the columns of the table to those of a kdb+ result, and pick their
+ * conversions. Columns the result doesn't have take their defaults.
+ */
+void kload_plan(KLoad *st, K table)
+{
+	TupleDesc tupdesc = RelationGetDescr(st->rel);
+	K colnames = kK(table->k)[0];
+	K values = kK(table->k)[1];
+	bool matched = false;
+
+	findNames(tupdesc, colnames, st->perm);
+
+	for (int i = 0; i < st->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+		if (att->attisdropped)
+			st->perm[i] = -1;
+		if (st->perm[i] == -1)
+			continue;
+
+		int pos = findOID(att->atttypid);
+		if (pos == -1 || todt[pos].k2p == NULL)
+			elog(ERROR, "Extension does not support datatype in column \"%s\"", NameStr(att->attname));
+
+		st->kernels[i] = k2p_column(att->atttypid, kK(values)[st->perm[i]], kS(colnames)[st->perm[i]]);
+		matched = true;
+	}
+
+	if (!matched)
+		elog(ERROR, "No column of table \"%s\" is in the kdb+ result", RelationGetRelationName(st->rel));
+}
+
+
+/*
+ * Write the rows of a kdb+ result (an unkeyed table) into the table
+ */
+void kload_write(KLoad *st, K table)
+{
+	K colnames = kK(table->k)[0];
+	K values = kK(table->k)[1];
+	J nrows = values->n > 0 ? kK(values)[0]->n : 0;
+	ExprContext *econtext = GetPerTupleExprContext(st->estate);
+
+	kload_plan(st, table);
+
+	for (J start = 0; start < nrows; start += KLOAD_BATCH)
+	{
+		int n = (int) Min(KLOAD_BATCH, nrows - start);
+
+		CHECK_FOR_INTERRUPTS();
+		MemoryContext oldcontext = MemoryContextSwitchTo(st->batchctx);
+
+		/* Convert the batch one kdb+ column at a time */
+		ksym_use(st->symbols);
+		for (int i = 0; i < st->natts; i++)
+			if (st->perm[i] >= 0)
+				st->kernels[i](kK(values)[st->perm[i]], start, n, st->colbuf + i * KLOAD_BATCH,
+					kS(colnames)[st->perm[i]]);
+		ksym_use(NULL);
+
+		for (int r = 0; r < n; r++)
+		{
+			TupleTableSlot *slot = st->slots[r];
+
+			ExecClearTuple(slot);
+			for (int i = 0; i < st->natts; i++)
+			{
+				if (st->perm[i] >= 0)
+				{
+					slot->tts_values[i] = st->colbuf[i * KLOAD_BATCH + r];
+					slot->tts_isnull[i] = false;
+				}
+				else if (st->defaults[i] != NULL)
+					slot->tts_values[i] = ExecEvalExpr(st->defaults[i], econtext, &slot->tts_isnull[i]);
+				else
+				{
+					slot->tts_values[i] = (Datum) 0;
+					slot->tts_isnull[i] = true;
+				}
+			}
+			ExecStoreVirtualTuple(slot);
+
+			if (st->rel->rd_att->constr != NULL)
+				ExecConstraints(st->rri, slot, st->estate);
+
+			/* As for COPY into a partition, rows outside its bounds are rejected */
+			if (st->rel->rd_rel->relispartition)
+				ExecPartitionCheck(st->rri, slot, st->estate, true);
+		}
+
+		table_multi_insert(st->rel, st->slots, n, st->cid, st->ti_options, st->bistate);
+
+		/* The slots now hold the tuples' TIDs, which the indexes point to */
+		for (int r = 0; r < n && st->rri->ri_NumIndices > 0; r++)
+		{
+#if PG_VERSION_NUM >= 160000
+			List *recheck = ExecInsertIndexTuples(st->rri, st->slots[r], st->estate,
+				false, false, NULL, NIL, false);
+#elif PG_VERSION_NUM >= 140000
+			List *recheck = ExecInsertIndexTuples(st->rri, st->slots[r], st->estate,
+				false, false, NULL, NIL);
+#else
+			List *recheck = ExecInsertIndexTuples(st->slots[r], st->estate, false, NULL, NIL);
+#endif
+			list_free(recheck);
+			ResetPerTupleExprContext(st->estate);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+		ResetPerTupleExprContext(st->estate);
+		MemoryContextReset(st->batchctx);
+		st->rows += n;
+	}
+}
+
+
+/*
+ * Complete a load and release its resources (the table stays open)
+ */
+void kload_finish(KLoad *st)
+{
+	for (int r = 0; r < KLOAD_BATCH; r++)
+		ExecDropSingleTupleTableSlot(st->slots[r]);
+	FreeBulkInsertState(st->bistate);
+
+#if PG_VERSION_NUM < 130000
+	/* Syncs the table when its WAL was skipped */
+	table_finish_bulk_insert(st->rel, st->ti_options);
+#endif
+
+	ExecCloseIndices(st->rri);
+	FreeExecutorState(st->estate);
+	ksym_free(st->symbols);
+	MemoryContextDelete(st->batchctx);
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(load);
+
+/*
+ * pgtokdb.load(target, expr, args...): evaluate expr (a q expression, or a
+ * function applied to args) on kdb+ and write the rows of its result into the
+ * table target. With pgtokdb.chunk_rows set, the result is read and written a
+ * chunk at a time. Returns the rows written, and the time taken.
+ */
+PGDLLEXPORT Datum load(PG_FUNCTION_ARGS)
+{
+	instr_time start, elapsed;
+	INSTR_TIME_SET_CURRENT(start);
+
+	TupleDesc restype;
+	if (get_call_result_type(fcinfo, NULL, &restype) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+
+	PreventCommandIfReadOnly("pgtokdb.load()");
+	PreventCommandIfParallelMode("pgtokdb.load()");
+
+	Relation rel = table_open(PG_GETARG_OID(0), RowExclusiveLock);
+	kload_check(rel);
+
+	S ef = text_to_cstring(PG_GETARG_VARCHAR_PP(1));
+	K args = kload_args(fcinfo);
+
+	const char *host = GetConfigOption("pgtokdb.host", false, false);
+	int port = atoi(GetConfigOption("pgtokdb.port", false, false));
+	const char *userpass = GetConfigOption("pgtokdb.userpass", false, false);
+	bool project = strcmp(GetConfigOption("pgtokdb.project", false, false), "on") == 0;
+
+	/* Have kdb+ send only the columns of the table, as getset does */
+	K cols = project ? getset_cols(RelationGetDescr(rel)) : NULL;
+
+	KLoad *st = kload_start(rel);
+	volatile J cursor = 0;
+	K volatile table = NULL;
+
+	PG_TRY();
+	{
+		if (kconn_chunk_rows > 0)
+		{
+			cursor = kcursor_open(host, port, userpass, cols != NULL ? cols : ktn(KS, 0),
+				getset_expr(ef, args));
+			for (;;)
+			{
+				table = kcursor_fetch(host, port, userpass, cursor, kconn_chunk_rows);
+				J nrows = kK(kK(table->k)[1])[0]->n;
+				kload_write(st, table);
+				r0(table);
+				table = NULL;
+
+				/* A short chunk is the last one (kdb+ has closed the cursor) */
+				if (nrows < kconn_chunk_rows)
+					break;
+			}
+			cursor = 0;
+		}
+		else
+		{
+			K result = cols != NULL ?
+				kconn_call(host, port, userpass, PROJECT_LAMBDA, knk(2, cols, getset_expr(ef, args))) :
+				kconn_call(host, port, userpass, ef, args);
+			ktable_check(result);
+			table = result;
+			kload_write(st, table);
+			r0(table);
+			table = NULL;
+		}
+	}
+	PG_CATCH();
+	{
+		if (table != NULL)
+			r0(table);
+		if (cursor != 0)
+			kcursor_close(host, port, userpass, cursor);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	int64 rows = st->rows;
+	kload_finish(st);
+	table_close(rel, NoLock);
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	double seconds = INSTR_TIME_GET_DOUBLE(elapsed);
+
+	Datum values[3];
+	bool nulls[3] = { false, false, false };
+	values[0] = Int64GetDatum(rows);
+	values[1] = Float8GetDatum(seconds);
+	values[2] = Float8GetDatum(seconds > 0 ? rows / seconds : 0);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(restype), values, nulls)));
+}
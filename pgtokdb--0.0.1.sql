@@ -2,12 +2,22 @@
 
 create schema if not exists pgtokdb;
 
+--
+-- Planner support function for getset functions, which estimates their rows
+-- (see pgtokdb.row_probe) and the cost of calling kdb+, e.g.
+--   create function f(varchar) returns setof f_t as 'pgtokdb', 'getset'
+--     language c rows 5000 support pgtokdb.getset_support;
+--
+create function pgtokdb.getset_support(internal) returns internal
+	as 'pgtokdb', 'getset_support' language c strict;
+
 drop type if exists pgtokdb._genddl cascade;
 
 create type pgtokdb.genddl_t as (script varchar);
 
 create function pgtokdb.genddl(varchar, varchar, varchar, varchar) 
-	returns setof pgtokdb.genddl_t as 'pgtokdb', 'getset' language c; 
+	returns setof pgtokdb.genddl_t as 'pgtokdb', 'getset' language c
+	support pgtokdb.getset_support; 
 
 --
 -- Create a simple function that is used to do a quick end-to-end test to
@@ -20,4 +30,207 @@ create type pgtokdb.getstatus_t as
 	(os varchar, version double precision, release date, timenow timestamp);
 
 create function pgtokdb.getstatus(varchar) returns setof pgtokdb.getstatus_t 
-	as 'pgtokdb', 'getset' language c;
+	as 'pgtokdb', 'getset' language c rows 1 support pgtokdb.getset_support;
+
+--
+-- Report the kdb+ connections that are cached by the current backend, and
+-- how many calls each one has served.
+--
+drop type if exists pgtokdb.connections_t cascade;
+
+create type pgtokdb.connections_t as 
+	(host varchar, port integer, handle integer, uses bigint, 
+	created timestamptz, lastused timestamptz);
+
+create function pgtokdb.connections() returns setof pgtokdb.connections_t 
+	as 'pgtokdb', 'connections' language c;
+
+--
+-- Statistics of the result cache shared by all backends (see
+-- pgtokdb.cache_ttl), and removal of cached results (of one function, or of
+-- all functions when called without an argument).
+--
+drop type if exists pgtokdb.cache_stats_t cascade;
+
+create type pgtokdb.cache_stats_t as
+	(entries integer, bytes bigint, size bigint, hits bigint, misses bigint,
+	waits bigint, evictions bigint);
+
+create function pgtokdb.cache_stats() returns pgtokdb.cache_stats_t
+	as 'pgtokdb', 'cache_stats' language c;
+
+create view pgtokdb.cache_stats as select * from pgtokdb.cache_stats();
+
+create function pgtokdb.cache_invalidate(fn regprocedure default null) returns bigint
+	as 'pgtokdb', 'cache_invalidate' language c;
+
+revoke all on function pgtokdb.cache_invalidate(regprocedure) from public;
+
+--
+-- Statistics of getset calls per function and expression, with the time 
+-- spent opening connections, waiting for kdb+, converting values and forming
+-- tuples (collected when pgtokdb is in shared_preload_libraries).
+--
+drop type if exists pgtokdb.stat_statements_t cascade;
+
+create type pgtokdb.stat_statements_t as
+	(fn regprocedure, expr text, calls bigint, rows bigint, bytes bigint,
+	connect_total_ms float8, connect_max_ms float8,
+	kdb_total_ms float8, kdb_max_ms float8,
+	convert_total_ms float8, convert_max_ms float8,
+	form_total_ms float8, form_max_ms float8);
+
+create function pgtokdb.stat_statements() returns setof pgtokdb.stat_statements_t
+	as 'pgtokdb', 'stat_statements' language c;
+
+create view pgtokdb.stat_statements as
+	select fn, expr, calls, rows, bytes,
+		connect_total_ms + kdb_total_ms + convert_total_ms + form_total_ms as total_ms,
+		(connect_total_ms + kdb_total_ms + convert_total_ms + form_total_ms) / calls as mean_ms,
+		connect_total_ms, connect_total_ms / calls as connect_mean_ms, connect_max_ms,
+		kdb_total_ms, kdb_total_ms / calls as kdb_mean_ms, kdb_max_ms,
+		convert_total_ms, convert_total_ms / calls as convert_mean_ms, convert_max_ms,
+		form_total_ms, form_total_ms / calls as form_mean_ms, form_max_ms
+	from pgtokdb.stat_statements();
+
+create function pgtokdb.stat_statements_reset() returns void
+	as 'pgtokdb', 'stat_statements_reset' language c;
+
+revoke all on function pgtokdb.stat_statements_reset() from public;
+
+--
+-- Foreign data wrapper for kdb+ tables. Filters, the columns needed, simple
+-- aggregates, ORDER BY and LIMIT are pushed down to kdb+ as a functional 
+-- select (shown by EXPLAIN VERBOSE).
+--
+create function pgtokdb.fdw_handler() returns fdw_handler 
+	as 'pgtokdb', 'fdw_handler' language c strict;
+
+create function pgtokdb.fdw_validator(text[], oid) returns void 
+	as 'pgtokdb', 'fdw_validator' language c strict;
+
+create foreign data wrapper pgtokdb_fdw 
+	handler pgtokdb.fdw_handler validator pgtokdb.fdw_validator;
+
+--
+-- Bulk insert of Postgres rows into a kdb+ table, e.g.
+--   select pgtokdb.insert('trade', t) from trades t;
+-- The rows are sent in batches of pgtokdb.insert_batch rows, and the number
+-- of rows sent is returned.
+--
+create function pgtokdb.insert_sfunc(internal, text, record) returns internal 
+	as 'pgtokdb', 'insert_sfunc' language c;
+
+create function pgtokdb.insert_ffunc(internal) returns bigint 
+	as 'pgtokdb', 'insert_ffunc' language c;
+
+create aggregate pgtokdb.insert(text, record) (
+	sfunc = pgtokdb.insert_sfunc,
+	stype = internal,
+	finalfunc = pgtokdb.insert_ffunc,
+	finalfunc_modify = read_write
+);
+
+--
+-- Bulk load of a kdb+ result into a Postgres table, bypassing the executor,
+-- e.g.
+--   select * from pgtokdb.load('pgtbl', 'select j from kdbtbl');
+--   select * from pgtokdb.load('pgtbl', 'trades', 'AAPL'::varchar);
+-- The rows written, and the time taken, are returned.
+--
+drop type if exists pgtokdb.load_t cascade;
+
+create type pgtokdb.load_t as (rows bigint, seconds float8, rows_per_sec float8);
+
+create function pgtokdb.load(target regclass, expr varchar) returns pgtokdb.load_t
+	as 'pgtokdb', 'load' language c strict;
+
+create function pgtokdb.load(target regclass, expr varchar, variadic args "any") 
+	returns pgtokdb.load_t as 'pgtokdb', 'load' language c strict;
+
+--
+-- Incremental copies of kdb+ tables into Postgres tables. Each row of
+-- pgtokdb.sync_marks names a target table, the kdb+ table it mirrors and a
+-- key column (of both tables) whose values only grow, e.g. a timestamp or an
+-- increasing id. pgtokdb.sync(target) finds the largest kdb+ key past the
+-- mark (.pgtokdb.upto in pgtokdb.q), loads the rows up to it (.pgtokdb.since)
+-- and advances the mark to it, in the caller's transaction. The mark is kept
+-- as kdb+ prints the key, so that no precision is lost, e.g.
+--   insert into pgtokdb.sync_marks (target, source, key) 
+--     values ('trade', 'trade', 'time');
+--   select * from pgtokdb.sync('trade');
+--
+create table pgtokdb.sync_marks (
+	target regclass primary key,
+	source varchar not null,
+	key name not null,
+	mark text,
+	rows bigint not null default 0,
+	synced timestamptz
+);
+
+select pg_catalog.pg_extension_config_dump('pgtokdb.sync_marks', '');
+
+drop type if exists pgtokdb.sync_upto_t cascade;
+
+create type pgtokdb.sync_upto_t as (mark varchar);
+
+create function pgtokdb.sync_upto(varchar, varchar, varchar, varchar)
+	returns setof pgtokdb.sync_upto_t as 'pgtokdb', 'getset' language c rows 1;
+
+create function pgtokdb.sync(regclass) returns pgtokdb.load_t as $$
+declare
+	m pgtokdb.sync_marks;
+	upto varchar;
+	result pgtokdb.load_t;
+begin
+	-- Concurrent syncs of a table wait for each other
+	select * into m from pgtokdb.sync_marks where target = $1 for update;
+	if not found then
+		raise exception 'Table % has no entry in pgtokdb.sync_marks', $1;
+	end if;
+
+	if not exists (select from pg_attribute
+		where attrelid = m.target and attname = m.key and attnum > 0 and not attisdropped) then
+		raise exception 'Table % has no column %', m.target, m.key;
+	end if;
+
+	-- The largest kdb+ key past the mark (empty before the first sync) bounds
+	-- the rows loaded, so rows added meanwhile are left to the next sync
+	select u.mark into upto
+		from pgtokdb.sync_upto('.pgtokdb.upto', m.source, m.key::varchar, coalesce(m.mark, '')::varchar) u;
+
+	if upto is null or upto = '' then
+		result := row(0, 0, 0);
+	else
+		select * into result from pgtokdb.load(m.target, '.pgtokdb.since', m.source,
+			m.key::varchar, coalesce(m.mark, '')::varchar, upto);
+		m.mark := upto;
+	end if;
+
+	update pgtokdb.sync_marks 
+		set mark = m.mark, rows = sync_marks.rows + result.rows, synced = now()
+		where target = m.target;
+
+	return result;
+end;
+$$ language plpgsql;
+
+--
+-- Counters of the tickerplant subscriber (see pgtokdb.tick_host), per kdb+
+-- table: the rows received, written and dropped (by failed writes), the rows
+-- waiting to be written, and the age of the oldest row of the last write when
+-- it was committed (lag_ms).
+--
+drop type if exists pgtokdb.tick_stats_t cascade;
+
+create type pgtokdb.tick_stats_t as
+	(source varchar, target varchar, connected boolean, received bigint,
+	inserted bigint, dropped bigint, queued bigint, flushes bigint,
+	lag_ms float8, flush_ms float8, rows_per_sec float8,
+	last_received timestamptz, last_flush timestamptz);
+
+create function pgtokdb.tick_stats() returns setof pgtokdb.tick_stats_t
+	as 'pgtokdb', 'tick_stats' language c;
+
+create view pgtokdb.tick_stats as select * from pgtokdb.tick_stats();
@@ -16,28 +16,69 @@
  */
 
 #include "pgtokdb.h"
+#include <limits.h>
 #include <fmgr.h>
 #include <funcapi.h>
+#include <miscadmin.h>
 #include <access/htup_details.h>
+#include <nodes/execnodes.h>
 #include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/tuplestore.h>
 #include <utils/syscache.h>
 #include <catalog/pg_proc.h>
+#if PG_VERSION_NUM >= 130000
+#include <common/hashfn.h>
+#else
+#include <access/hash.h>
+#endif
 
 PG_MODULE_MAGIC;
 
 /* Configuration globals */
-static char	host[256] = "localhost";
+static char	*host = NULL;
 static int	port = 5000;
-static char userpass[256] = "";
+static char *userpass = NULL;
+static bool	project = true;
+
+/* Number of rows converted per batch when materializing a result */
+#define GETSET_BATCH 1024
+
+/* Up to this many kdb+ columns, names are matched by a linear search */
+#define FINDNAMES_LINEAR 16
+
+/* 
+ * What a function's first call resolves, kept in flinfo->fn_extra for the
+ * calls that follow (e.g. once per outer row of a LATERAL join). Since it
+ * takes the place funcapi uses for its FuncCallContext, the scan returning
+ * rows one at a time is kept here, and the SRF_* macros are not used.
+ */
+typedef struct
+{
+	MemoryContext mcxt;		/* Context of the function's FmgrInfo */
+	TupleDesc	tupdesc;	/* Result type (blessed) */
+	int			nargs;		/* Number of arguments */
+	int			*argind;	/* Indices into type-oid dispatch table of the arguments */
+	bool		planned;	/* Whether the fields below describe a kdb+ result */
+	J			ncols;		/* Number of kdb+ columns planned for */
+	S			*colnames;	/* Their names (interned, so compared as pointers) */
+	signed char	*coltypes;	/* Their types */
+	int 		*perm;		/* Permutation order that map kdb+ columns with result columns */
+	int 		*todtind;	/* Indices into typo-oid dispatch table */
+	K2PCOL		*kernels;	/* Conversion kernel for each column */
+	FuncCallContext *funcctx; /* Scan in progress in ValuePerCall mode (or NULL) */
+} GSMeta;
 
 /* Prototypes */
 void 	_PG_init(void);
-int 	findOID(int);
-int 	findName(char *, K);
-void 	safecpy(char *, const char *, size_t);
-K 		kk(I, char *, K);
-void 	getset_init(FunctionCallInfo);
-K 		getset_args(FunctionCallInfo);
+void 	getset_init(FunctionCallInfo, GSMeta *);
+void	getset_shutdown(Datum);
+Datum	getset_materialize(FunctionCallInfo);
+K 		getset_fetch(FunctionCallInfo, TupleDesc);
+J		getset_open(FunctionCallInfo, TupleDesc);
+K		getset_chunk(J);
+GSMeta *getset_meta(FunctionCallInfo);
+void	getset_replan(GSMeta *, K);
 
 /* Information needed across calls and stored in the function context */
 typedef struct
@@ -45,18 +86,18 @@ typedef struct
 	K   	table;		/* Table result of call to kdb+ */
 	int 	*perm;		/* Permutation order that map kdb+ columns with result columns */
 	int 	*todtind;	/* Indices into typo-oid dispatch table */
+	K2PCOL	*kernels;	/* Conversion kernel for each column */
 	Datum 	*dvalues;	/* Datum for each column in the result */
 	bool 	*nulls;		/* Null indicator (always false) for each column */
+	J		cursor;		/* kdb+ cursor the table is a chunk of (0 if none) */
+	J		base;		/* Row number of the first row of table */
+	KStatCall stat;		/* Time spent so far (see pgtokdb.stat_statements) */
+	KSymCache *symbols;	/* Texts of the symbols converted so far */
+	MemoryContext rowctx; /* Holds the values converted for the current row */
 } UIFC; /* User Information Function Context */
 
 /* Type OID dispatch table used to determine conversion functions */
-struct
-{
-	int     typeoid;				/* OID of Postgres type */
-	Datum   (*k2p)(K, int, char *);	/* Function to convert kdb+ to Postgres */
-	K		(*p2k)(Datum); 			/* Function to convert Postgres to kdb+ */
-	bool    isref;					/* Indicates whether Postgres Datum is a reference */
-} todt[19] =
+TODT todt[] =
 {
 	{ BOOLOID,			k2p_bool,     		p2k_bool,		false },
 	{ INT2OID,			k2p_int2,     		p2k_int2,		false },
@@ -72,11 +113,20 @@ struct
 	{ UUIDOID,			k2p_uuid,			p2k_uuid,		true  },
 	{ TEXTOID,			k2p_varchar,		p2k_varchar,	true  },
 	{ BYTEAOID,			k2p_bytea,			p2k_bytea,		true  },
-	{ INT2ARRAYOID,		k2p_int2array,		NULL,			true  },
-	{ INT4ARRAYOID,		k2p_int4array,		NULL,			true  },
-	{ INT8ARRAYOID,		k2p_int8array,		NULL,			true  },
-	{ FLOAT4ARRAYOID,	k2p_float4array, 	NULL,			true  },
-	{ FLOAT8ARRAYOID,	k2p_float8array, 	NULL,			true  }
+	{ NUMERICOID,		k2p_numeric,		p2k_numeric,	true  },
+	{ INT2ARRAYOID,		k2p_int2array,		p2k_int2array,	true  },
+	{ INT4ARRAYOID,		k2p_int4array,		p2k_int4array,	true  },
+	{ INT8ARRAYOID,		k2p_int8array,		p2k_int8array,	true  },
+	{ FLOAT4ARRAYOID,	k2p_float4array, 	p2k_float4array, true  },
+	{ FLOAT8ARRAYOID,	k2p_float8array, 	p2k_float8array, true  },
+	{ BOOLARRAYOID,		NULL,				p2k_boolarray,	true  },
+	{ DATEARRAYOID,		NULL,				p2k_datearray,	true  },
+	{ TIMESTAMPARRAYOID, NULL,				p2k_timestamparray, true },
+	{ TIMESTAMPTZARRAYOID, NULL,			p2k_timestamptzarray, true },
+	{ NUMERICARRAYOID,	NULL,				p2k_numericarray, true },
+	{ UUIDARRAYOID,		NULL,				p2k_uuidarray,	true  },
+	{ TEXTARRAYOID,		NULL,				p2k_textarray,	true  },
+	{ VARCHARARRAYOID,	NULL,				p2k_varchararray, true }
 	/* ... add support for additional data types here ... */
 };
 
@@ -112,6 +162,50 @@ int findName(char *f, K nv)
 }
 
 
+/*
+ * Find the position in kdb+ column name vector of each result attribute (-1
+ * if missing). Wide tables are indexed by a hash of the column names rather
+ * than searched once per attribute.
+ */
+void findNames(TupleDesc tupdesc, K nv, int *pos)
+{
+	if (nv->n <= FINDNAMES_LINEAR)
+	{
+		for (int i = 0; i < tupdesc->natts; i++)
+			pos[i] = findName(NameStr(TupleDescAttr(tupdesc, i)->attname), nv);
+		return;
+	}
+
+	/* Open addressing table of column positions plus one (0 is a free slot) */
+	uint32 mask = 1;
+	while (mask < 2 * nv->n)
+		mask <<= 1;
+	mask--;
+	int *slots = (int *) palloc0((mask + 1) * sizeof(int));
+
+	for (int c = 0; c < nv->n; c++)
+	{
+		S name = kS(nv)[c];
+		uint32 h = DatumGetUInt32(hash_any((unsigned char *) name, strlen(name))) & mask;
+		while (slots[h] != 0 && strcmp(kS(nv)[slots[h] - 1], name) != 0)
+			h = (h + 1) & mask;
+		if (slots[h] == 0) /* First of any duplicate names wins, as with findName */
+			slots[h] = c + 1;
+	}
+
+	for (int i = 0; i < tupdesc->natts; i++)
+	{
+		char *name = NameStr(TupleDescAttr(tupdesc, i)->attname);
+		uint32 h = DatumGetUInt32(hash_any((unsigned char *) name, strlen(name))) & mask;
+		while (slots[h] != 0 && strcmp(kS(nv)[slots[h] - 1], name) != 0)
+			h = (h + 1) & mask;
+		pos[i] = slots[h] - 1;
+	}
+
+	pfree(slots);
+}
+
+
 /* 
  * A version of strncpy that is safe and always 0-terminates the string 
  */
@@ -123,20 +217,47 @@ void safecpy(char *dest, const char *src, size_t n)
 
 
 /* 
- * Initialize configuration variables upon loading of this extension (once only)
+ * Define configuration variables upon loading of this extension (once only)
  */
 void _PG_init(void)
 {
-	const char *p;
-	
-	if ((p = GetConfigOption("pgtokdb.host", true, false)) != NULL)
-		safecpy(host, p, sizeof(host));
-
-	if ((p = GetConfigOption("pgtokdb.port", true, false)) != NULL)
-		port = atoi(p);
-
-	if ((p = GetConfigOption("pgtokdb.userpass", true, false)) != NULL)
-		safecpy(userpass, p, sizeof(userpass));
+	DefineCustomStringVariable("pgtokdb.host",
+		"Host name or IP address of the kdb+ process.",
+		"A comma-separated list (host or host:port) names replicas of the process.", &host, "localhost", PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.port",
+		"TCP/IP port of the kdb+ process.",
+		NULL, &port, 5000, 1, 65535, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgtokdb.userpass",
+		"Credentials (user:pass) used to connect to kdb+.",
+		NULL, &userpass, "", PGC_SUSET, GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgtokdb.project",
+		"Have kdb+ return only the columns that the result type needs.",
+		NULL, &project, true, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.symbol_cache",
+		"Most distinct kdb+ symbols whose text is reused within a call.",
+		"Zero converts every symbol of a result separately.",
+		&ksym_max, 65536, 0, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	kconn_init();
+	shard_init();
+	insert_init();
+	kcache_init();
+	kstat_init();
+	ksupport_init();
+	kreplica_init();
+	load_init();
+	kproxy_init();
+	ktick_init();
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("pgtokdb");
+#else
+	EmitWarningsOnPlaceholders("pgtokdb");
+#endif
 }
 
 
@@ -147,55 +268,107 @@ PG_FUNCTION_INFO_CUSTOM(getset); /* A variant of PG_FUNCTION_INFO_V1 */
  */
 PGDLLEXPORT Datum getset(PG_FUNCTION_ARGS)
 {
-	/* Initialize on first call */
-	if (SRF_IS_FIRSTCALL())
-		getset_init(fcinfo);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	/* 
+	 * Materialize the whole result in one call whenever the caller allows it,
+	 * unless a streamed result is wanted a row at a time so that the caller
+	 * can stop early (e.g. a LIMIT over a call in the select list)
+	 */
+	if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo) &&
+		(rsinfo->allowedModes & SFRM_Materialize) != 0 &&
+		(kconn_chunk_rows == 0 || (rsinfo->allowedModes & SFRM_ValuePerCall) == 0))
+		return getset_materialize(fcinfo);
+
+	/* Initialize on first call of a scan */
+	GSMeta *meta = getset_meta(fcinfo);
+	if (meta->funcctx == NULL)
+		getset_init(fcinfo, meta);
 
-	FuncCallContext *funcctx = SRF_PERCALL_SETUP();
+	FuncCallContext *funcctx = meta->funcctx;
 
 	/* Get user context values that are kept across calls */
 	UIFC *puifc = (UIFC *) funcctx->user_fctx; 
-	K colnames = kK(puifc->table->k)[0]; /* Column names of kdb+ result */
-	K values = kK(puifc->table->k)[1]; /* Columns of the kdb+ result */
 	int *perm = puifc->perm; /* Permutation order that map table columns with result columns */
 	int *todtind = puifc->todtind; /* Indices into typo-oid dispatch table */
+	K2PCOL *kernels = puifc->kernels; /* Conversion kernel for each column */
+	KStatCall *stat = &puifc->stat; /* Time spent so far */
+
+	TupleDesc tupdesc = funcctx->tuple_desc;
+	int natts = tupdesc->natts; /* Number of attributes (result columns) */
+
+	/* Fetch the next chunk once the current one is used up (if there can be more) */
+	J row = funcctx->call_cntr - puifc->base;
+	if (puifc->cursor != 0 && row == kK(kK(puifc->table->k)[1])[0]->n && row == kconn_chunk_rows)
+	{
+		r0(puifc->table);
+		puifc->table = NULL;
+		kstat_begin(stat);
+		puifc->table = getset_chunk(puifc->cursor);
+		kstat_kdb(stat);
+		puifc->base = funcctx->call_cntr;
+		getset_kernels(tupdesc, puifc->table, perm, kernels);
+		row = 0;
+	}
 
-	AttInMetadata *attinmeta = funcctx->attinmeta;
-	int natts = attinmeta->tupdesc->natts; /* Number of attributes (result columns) */
+	K colnames = kK(puifc->table->k)[0]; /* Column names of kdb+ result */
+	K values = kK(puifc->table->k)[1]; /* Columns of the kdb+ result */
 
 	/* Place a kdb+ table row into a tuple */
-	if (funcctx->call_cntr < kK(values)[0]->n)
+	if (row < kK(values)[0]->n)
 	{
 		/* Initialize components that make up the tuple (data and null indicators) */
 		Datum *dvalues = puifc->dvalues; 
 		bool *nulls = puifc->nulls;  
 
+		kstat_begin(stat);
+
 		/* Convert columns from kdb+ format to Postgres format */
+		MemoryContext oldcontext = MemoryContextSwitchTo(puifc->rowctx);
+		ksym_use(puifc->symbols);
 		for (int i = 0; i < natts; i++)
 		{
-			dvalues[i] = 
-				(todt[todtind[i]].k2p)(
-					kK(values)[perm[i]], /* kdb+ column array */
-					funcctx->call_cntr, /* Current row to fetch */
-					kS(colnames)[perm[i]]); /* kdb+ column name (for error reporting) */
+			kernels[i](
+				kK(values)[perm[i]], /* kdb+ column array */
+				row, 1, /* Current row to fetch */
+				&dvalues[i],
+				kS(colnames)[perm[i]]); /* kdb+ column name (for error reporting) */
 		}
+		ksym_use(NULL);
+		MemoryContextSwitchTo(oldcontext);
+
+		if (stat->active)
+			stat->ms[KSTAT_CONVERT] += kstat_lap(stat);
 
 		/* Create a tuple given a complete row of values */
-		HeapTuple tuple = heap_form_tuple(attinmeta->tupdesc, dvalues, nulls);
+		HeapTuple tuple = heap_form_tuple(tupdesc, dvalues, nulls);
 
-		/* Free up space used by those Datum types that are references */
-		for (int i = 0; i < natts; i++)
-			if (todt[todtind[i]].isref)
-				pfree((void *) dvalues[i]);
+		if (stat->active)
+		{
+			stat->ms[KSTAT_FORM] += kstat_lap(stat);
+			stat->rows++;
+		}
 
-		Datum result = HeapTupleGetDatum(tuple); /* Convert tuple to Datum */
+		/* 
+		 * Free up space used by those Datum types that are references (the
+		 * texts of cached symbols are shared by the rows, and stay)
+		 */
+		MemoryContextReset(puifc->rowctx);
 
-		SRF_RETURN_NEXT(funcctx, result);
+		funcctx->call_cntr++;
+		rsinfo->isDone = ExprMultipleResult;
+		return HeapTupleGetDatum(tuple); /* Convert tuple to Datum */
 	}
 	else /* no more rows to return */
 	{
-		r0(puifc->table); /* Free up memory used up by kdb+: r0(result) */
-		SRF_RETURN_DONE(funcctx);
+		puifc->cursor = 0; /* kdb+ closed it when returning the last chunk */
+
+		/* Free the kdb+ result and the function context, ending the scan */
+		UnregisterExprContextCallback(rsinfo->econtext, getset_shutdown, PointerGetDatum(meta));
+		getset_shutdown(PointerGetDatum(meta));
+
+		rsinfo->isDone = ExprEndResult;
+		PG_RETURN_NULL();
 	}
 }
 
@@ -203,36 +376,334 @@ PGDLLEXPORT Datum getset(PG_FUNCTION_ARGS)
 /* 
  * First call initialization (validation, connection, fetch kdb + table 
  */
-void getset_init(FunctionCallInfo fcinfo)
+void getset_init(FunctionCallInfo fcinfo, GSMeta *meta)
 {
-	/* Create a function context for cross-call persistence */
-	FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc = meta->tupdesc;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("set-valued function called in context that cannot accept a set")));
+
+	/* Create a function context for cross-call persistence (as funcapi would) */
+	MemoryContext mcxt = AllocSetContextCreate(meta->mcxt,
+		"pgtokdb multi-call context", ALLOCSET_SMALL_SIZES);
+	FuncCallContext *funcctx = (FuncCallContext *) MemoryContextAllocZero(mcxt, sizeof(FuncCallContext));
+	funcctx->multi_call_memory_ctx = mcxt;
 
 	/* Switch to memory context appropriate for multiple function calls */
 	MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-	/* Build a tuple descriptor for our result type */
-	TupleDesc tupdesc;
-	TypeFuncClass tfc = get_call_result_type(fcinfo, NULL, &tupdesc);
-	if (tfc != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "Function must use composite types");
+	/* Keep values between calls in user context */
+	UIFC *puifc = (UIFC *) palloc0(sizeof(UIFC));
+	kstat_start(&puifc->stat, fcinfo);
+
+	/* Call kdb+ and retrieve table (or its first chunk) */
+	kstat_begin(&puifc->stat);
+	if (kconn_chunk_rows > 0)
+	{
+		puifc->cursor = getset_open(fcinfo, tupdesc);
+		puifc->table = getset_chunk(puifc->cursor);
+	}
+	else
+		puifc->table = getset_fetch(fcinfo, tupdesc);
+	kstat_kdb(&puifc->stat);
+
+	/* Blessed descriptor used to produce tuples */
+	funcctx->tuple_desc = tupdesc;
+
+	/* 
+	 * Map the kdb+ columns (reusing the previous call's mapping when the
+	 * result has the same columns). The kernels are copied, since those of
+	 * a later chunk can differ.
+	 */
+	int natts = tupdesc->natts; /* Number of attributes (columns) in result */
+	getset_replan(meta, puifc->table);
+	puifc->perm = (int *) palloc(natts * sizeof(int));
+	memcpy(puifc->perm, meta->perm, natts * sizeof(int));
+	puifc->todtind = meta->todtind;
+	puifc->kernels = (K2PCOL *) palloc(natts * sizeof(K2PCOL));
+	memcpy(puifc->kernels, meta->kernels, natts * sizeof(K2PCOL));
+	puifc->dvalues = (Datum *) palloc(natts * sizeof(Datum)); /* Datum for 1 row, all columns */
+	puifc->nulls = (bool *) palloc0(natts * sizeof(bool)); /* We don't support nulls */
+	puifc->symbols = ksym_create(funcctx->multi_call_memory_ctx);
+	puifc->rowctx = AllocSetContextCreate(funcctx->multi_call_memory_ctx, 
+		"pgtokdb row", ALLOCSET_SMALL_SIZES);
 
-	/* Connect to a kdb+ process */
-	I handle = khpu(host, port, userpass); 
-	if (handle <= 0)
-		elog(ERROR, "Socket connection error (%d) attempting to connect to kdb+", handle);
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Release the kdb+ result (and cursor) if the caller stops early */
+	funcctx->user_fctx = puifc;
+	meta->funcctx = funcctx;
+	RegisterExprContextCallback(rsinfo->econtext, getset_shutdown, PointerGetDatum(meta));
+}
+
+
+/*
+ * End a scan: release what is left of a result when rows are no longer
+ * wanted (e.g. the outer query has reached its LIMIT), and the function
+ * context, so that the next call starts a new scan
+ */
+void getset_shutdown(Datum arg)
+{
+	GSMeta *meta = (GSMeta *) DatumGetPointer(arg);
+	FuncCallContext *funcctx = meta->funcctx;
+	UIFC *puifc = (UIFC *) funcctx->user_fctx;
+
+	if (puifc->table != NULL)
+		r0(puifc->table);
+	if (puifc->cursor != 0)
+		kcursor_close(host, port, userpass, puifc->cursor);
+
+	puifc->table = NULL;
+	puifc->cursor = 0;
+
+	/* Account for the rows returned before the caller stopped */
+	kstat_record(&puifc->stat);
+
+	meta->funcctx = NULL;
+	MemoryContextDelete(funcctx->multi_call_memory_ctx);
+}
+
+
+/*
+ * Return the complete result in a tuplestore (SFRM_Materialize). Each kdb+ 
+ * column is converted in a tight loop for a batch of rows at a time, and the 
+ * batch's allocations are released together. The tuplestore spills to disk
+ * once it exceeds work_mem. With pgtokdb.chunk_rows set, the result is read
+ * from a kdb+ cursor a chunk at a time, so only one chunk is held in memory.
+ */
+Datum getset_materialize(FunctionCallInfo fcinfo)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	/* Result type and argument conversions, resolved once per call site */
+	GSMeta *meta = getset_meta(fcinfo);
+
+	/* The tuplestore and its descriptor have to outlive this call */
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	TupleDesc tupdesc = CreateTupleDescCopy(meta->tupdesc);
+	Tuplestorestate *tupstore = tuplestore_begin_heap(
+		(rsinfo->allowedModes & SFRM_Materialize_Random) != 0, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Time the call's phases (see pgtokdb.stat_statements) */
+	KStatCall stat;
+	kstat_start(&stat, fcinfo);
+
+	/* Call kdb+ and retrieve table (or its first chunk) */
+	kstat_begin(&stat);
+	J chunk = kconn_chunk_rows;
+	volatile J cursor = chunk > 0 ? getset_open(fcinfo, tupdesc) : 0;
+	K volatile table = cursor != 0 ? getset_chunk(cursor) : getset_fetch(fcinfo, tupdesc);
+	kstat_kdb(&stat);
+
+	/* Holds the Datum references of a single batch; reset rather than pfree'd */
+	MemoryContext batchctx = AllocSetContextCreate(CurrentMemoryContext, 
+		"pgtokdb batch", ALLOCSET_DEFAULT_SIZES);
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			J nrows = kK(kK(table->k)[1])[0]->n;
+
+			/* Column mapping and kernels of the previous result, if it had the same columns */
+			getset_replan(meta, table);
+			getset_store(tupstore, tupdesc, table, meta->perm, meta->kernels, batchctx, &stat);
+			r0(table); /* Free up memory used up by kdb+ */
+			table = NULL;
+
+			/* A short chunk is the last one (kdb+ has closed the cursor) */
+			if (cursor == 0 || nrows < chunk)
+				break;
+			kstat_begin(&stat);
+			table = getset_chunk(cursor);
+			kstat_kdb(&stat);
+		}
+	}
+	PG_CATCH();
+	{
+		if (table != NULL)
+			r0(table);
+		if (cursor != 0)
+			kcursor_close(host, port, userpass, cursor);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextDelete(batchctx);
+	kstat_record(&stat);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
+
+
+/*
+ * Convert the rows of a kdb+ table into the tuplestore, a batch at a time,
+ * with the kernels resolved for its columns (see getset_kernels), timing the
+ * conversion and the forming of tuples in stat, if given
+ */
+void getset_store(Tuplestorestate *tupstore, TupleDesc tupdesc, K table, 
+	int *perm, K2PCOL *kernels, MemoryContext batchctx, KStatCall *stat)
+{
+	K colnames = kK(table->k)[0]; /* Column names of kdb+ result */
+	K values = kK(table->k)[1]; /* Columns of the kdb+ result */
+	J nrows = kK(values)[0]->n;
+	int natts = tupdesc->natts;
+
+	/* Converted values of one batch, laid out column after column */
+	Datum *colbuf = (Datum *) palloc(natts * GETSET_BATCH * sizeof(Datum));
+	Datum *dvalues = (Datum *) palloc(natts * sizeof(Datum));
+	bool *nulls = (bool *) palloc0(natts * sizeof(bool)); /* We don't support nulls */
+
+	/* Texts of symbols are built once per distinct symbol, outside the batches */
+	KSymCache *symbols = ksym_create(CurrentMemoryContext);
+
+	for (J start = 0; start < nrows; start += GETSET_BATCH)
+	{
+		int n = (int) Min(GETSET_BATCH, nrows - start);
+
+		CHECK_FOR_INTERRUPTS();
+		MemoryContext oldcontext = MemoryContextSwitchTo(batchctx);
+		bool timed = stat != NULL && stat->active;
+		if (timed)
+			kstat_begin(stat);
+
+		/* Convert the batch one kdb+ column at a time */
+		ksym_use(symbols);
+		for (int i = 0; i < natts; i++)
+			kernels[i](kK(values)[perm[i]], start, n, colbuf + i * GETSET_BATCH, 
+				kS(colnames)[perm[i]]);
+		ksym_use(NULL);
+
+		if (timed)
+			stat->ms[KSTAT_CONVERT] += kstat_lap(stat);
+
+		/* Assemble rows from the column buffers; tuplestore copies each one */
+		for (int r = 0; r < n; r++)
+		{
+			for (int i = 0; i < natts; i++)
+				dvalues[i] = colbuf[i * GETSET_BATCH + r];
+			tuplestore_putvalues(tupstore, tupdesc, dvalues, nulls);
+		}
+
+		if (timed)
+		{
+			stat->ms[KSTAT_FORM] += kstat_lap(stat);
+			stat->rows += n;
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(batchctx);
+	}
 
+	pfree(colbuf);
+	pfree(dvalues);
+	pfree(nulls);
+	ksym_free(symbols);
+}
+
+
+/*
+ * Invoke the function's expression on kdb+ with its arguments and return 
+ * the resulting (unkeyed) table
+ */
+K getset_fetch(FunctionCallInfo fcinfo, TupleDesc tupdesc)
+{
 	/* Get Postgres function arguments as a kdb+ array */
 	K args = getset_args(fcinfo);
 
 	/* Convert first argument (q expression or function) to a cstring */
 	S ef = text_to_cstring(PG_GETARG_VARCHAR_PP(0));
 
-	/* Call kdb+ and retrieve table */
-	K table = kk(handle, ef, args);
-	kclose(handle);
+	/* 
+	 * Have kdb+ drop the columns that the result type doesn't use, so they
+	 * are never serialized, sent or decoded
+	 */
+	if (project)
+	{
+		args = knk(2, getset_cols(tupdesc), getset_expr(ef, args));
+		ef = PROJECT_LAMBDA;
+	}
 
-	/* Ensure result is a simple (unkeyed) table */
+	/* Call kdb+ (through a cached connection or the result cache) and retrieve table */
+	K table = kcache_call(fcinfo->flinfo->fn_oid, host, port, userpass, ef, args);
+	ktable_check(table);
+
+	return table;
+}
+
+
+/*
+ * Evaluate the function's expression into a kdb+ cursor (see pgtokdb.q) and 
+ * return the cursor's id
+ */
+J getset_open(FunctionCallInfo fcinfo, TupleDesc tupdesc)
+{
+	K args = getset_args(fcinfo);
+	S ef = text_to_cstring(PG_GETARG_VARCHAR_PP(0));
+
+	return kcursor_open(host, port, userpass, 
+		project ? getset_cols(tupdesc) : ktn(KS, 0), getset_expr(ef, args));
+}
+
+
+/*
+ * Fetch the next chunk of rows from a kdb+ cursor
+ */
+K getset_chunk(J cursor)
+{
+	return kcursor_fetch(host, port, userpass, cursor, kconn_chunk_rows);
+}
+
+
+/*
+ * Symbol list of the result type's column names
+ */
+K getset_cols(TupleDesc tupdesc)
+{
+	K cols = ktn(KS, tupdesc->natts);
+	for (int i = 0; i < tupdesc->natts; i++)
+		kS(cols)[i] = ss(NameStr(TupleDescAttr(tupdesc, i)->attname));
+	return cols;
+}
+
+
+/*
+ * The expression alone, or the function followed by its arguments, as a 
+ * single kdb+ object that q can evaluate with value (consumes args)
+ */
+K getset_expr(S ef, K args)
+{
+	K x;
+
+	if (args->n == 0)
+		x = kp(ef);
+	else
+	{
+		x = ktn(0, args->n + 1);
+		kK(x)[0] = kp(ef);
+		memcpy(&kK(x)[1], kK(args), args->n * sizeof(K));
+	}
+	args->n = 0; /* x now owns the arguments */
+	r0(args);
+
+	return x;
+}
+
+
+/*
+ * Ensure result of a kdb+ call is a simple (unkeyed) table, raising an error
+ * (and releasing the result) otherwise
+ */
+void ktable_check(K table)
+{
 	if (!table)
 		elog(ERROR, "Network error communicating with kdb+");
 	else if (-128 == table->t)
@@ -246,87 +717,184 @@ void getset_init(FunctionCallInfo fcinfo)
 		r0(table);
 		elog(ERROR, "Result from kdb+ must be unkeyed table");
 	}
+}
 
-	/* Generate attribute metadata needed later to produce tuples */
-	AttInMetadata *attinmeta = TupleDescGetAttInMetadata(tupdesc);
-	funcctx->attinmeta = attinmeta;
 
-	/* Number of attributes (columns) in result */
-	int natts = attinmeta->tupdesc->natts;
-	int *perm = (int *) palloc(natts * sizeof(int));
-	int *todtind = (int *) palloc(natts * sizeof(int));
+/*
+ * Map each result attribute to its kdb+ column (perm) and to its entry in the
+ * type-oid dispatch table (todtind)
+ */
+void getset_plan(TupleDesc tupdesc, K table, int *perm, int *todtind)
+{
 	K colnames = kK(table->k)[0]; /* kdb+ column names */
+
+	/* Find matching kdb+ columns */
+	findNames(tupdesc, colnames, perm);
 	
 	/* Loop through each result attribute (column) */
-	for (int i = 0; i < natts; i++)
+	for (int i = 0; i < tupdesc->natts; i++)
 	{
-		/* Find matching kdb+ column */
-		char *attname = attinmeta->tupdesc->attrs[i].attname.data;
-		int pos = findName(attname, colnames);
-		if (pos == -1)
+		char *attname = tupdesc->attrs[i].attname.data;
+		if (perm[i] == -1)
 			elog(ERROR, "Unable to match column name \"%s\" in kdb+ table", attname);
-		perm[i] = pos;
 
 		/* Find matching data type conversion */
-		pos = findOID(attinmeta->tupdesc->attrs[i].atttypid);
+		int pos = findOID(tupdesc->attrs[i].atttypid);
 		if (pos == -1 || todt[pos].k2p == NULL)
 			elog(ERROR, "Extension does not support datatype in column \"%s\"", attname);
 		todtind[i] = pos;
 	}
+}
 
-	/* Keep values between calls in user context */
-	UIFC *puifc = (UIFC *) palloc0(sizeof(UIFC));
-	puifc->table = table; /* Keep kdb+ result in memory until all rows are returned */
-	puifc->perm = perm; 
-	puifc->todtind = todtind;
-	puifc->dvalues = (Datum *) palloc(natts * sizeof(Datum)); /* Datum for 1 row, all columns */
-	puifc->nulls = (bool *) palloc0(natts * sizeof(bool)); /* We don't support nulls */
 
-	funcctx->user_fctx = puifc;
+/*
+ * Resolve the conversion kernel of each result column from the types of the
+ * kdb+ columns it maps to
+ */
+void getset_kernels(TupleDesc tupdesc, K table, int *perm, K2PCOL *kernels)
+{
+	K colnames = kK(table->k)[0]; /* kdb+ column names */
+	K values = kK(table->k)[1]; /* kdb+ columns */
 
-	MemoryContextSwitchTo(oldcontext);
+	for (int i = 0; i < tupdesc->natts; i++)
+		kernels[i] = k2p_column(TupleDescAttr(tupdesc, i)->atttypid, 
+			kK(values)[perm[i]], kS(colnames)[perm[i]]);
 }
 
 
-/* 
- * Get calling Postgres function's arguments 
+/*
+ * Resolve the result type and the argument conversions of the calling 
+ * function on its first call, and keep them in flinfo->fn_extra
  */
-K getset_args(FunctionCallInfo fcinfo)
+GSMeta *getset_meta(FunctionCallInfo fcinfo)
 {
-	/* Get the OID type list of the arguments for this function. */
-	Oid funcid = fcinfo->flinfo->fn_oid; /* Function's OID */
+	FmgrInfo *flinfo = fcinfo->flinfo;
+	if (flinfo->fn_extra != NULL)
+		return (GSMeta *) flinfo->fn_extra;
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(flinfo->fn_mcxt);
+
+	/* Build a tuple descriptor for our result type */
+	TupleDesc tupdesc;
+	TypeFuncClass tfc = get_call_result_type(fcinfo, NULL, &tupdesc);
+	if (tfc != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+
 	/* Get function definition tuple from Postgres */
+	Oid funcid = flinfo->fn_oid; /* Function's OID */
 	HeapTuple tp = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid)); 
 	if (!HeapTupleIsValid(tp))
 		elog(ERROR, "Cache lookup failed for function %u", funcid);
-	Form_pg_proc procform = (Form_pg_proc) GETSTRUCT(tp); /* Copy tuple values */
-	ReleaseSysCache(tp);
-	int *pargoids = (int *) procform->proargtypes.values; /* Shorthand */
+	Form_pg_proc procform = (Form_pg_proc) GETSTRUCT(tp);
 
-	//! Could I use this instead? get_fn_expr_argtype(). Not as fast as above.
+	/* Copy the argument types before the tuple is released */
+	int nargs = PG_NARGS();
+	Oid *pargoids = (Oid *) palloc(Max(procform->pronargs, 1) * sizeof(Oid));
+	memcpy(pargoids, procform->proargtypes.values, procform->pronargs * sizeof(Oid));
+	ReleaseSysCache(tp);
 
 	/* There has to be at least one argument and it must be varchar */
-	int nargs = PG_NARGS();
 	if (nargs == 0)
 		elog(ERROR, "Function must have at least one argument");
 
 	if (pargoids[0] != VARCHAROID)
 		elog(ERROR, "Function first argument must be a varchar (kdb+ expression or function)");
 
-	/* Initialize mixed K array (to be populated below) */
-	K lo = knk(nargs - 1, 0); 
+	/* The most parameters a q function can have */
+	if (nargs - 1 > 8)
+		elog(ERROR, "The number of kdb+ function parameters exceeds 8");
 
+	int *argind = (int *) palloc(nargs * sizeof(int));
 	for (int i = 1; i < nargs; i++)
 	{
-		int oid = pargoids[i]; /* Argument type */
-
-		int ind = findOID(oid); /* Get data conversion */
+		int ind = findOID(pargoids[i]); /* Get data conversion */
 		if (ind < 0 || todt[ind].p2k == NULL)
 			elog(ERROR, "Argument %d uses an unsupported type", i + 1);
+		argind[i] = ind;
+	}
+	pfree(pargoids);
+
+	GSMeta *meta = (GSMeta *) palloc0(sizeof(GSMeta));
+	meta->mcxt = flinfo->fn_mcxt;
+	meta->tupdesc = BlessTupleDesc(CreateTupleDescCopy(tupdesc));
+	meta->nargs = nargs;
+	meta->argind = argind;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	flinfo->fn_extra = meta;
+	return meta;
+}
 
-		/* Call conversion routine via dispatch table */
-		kK(lo)[i - 1] = (todt[ind].p2k)(PG_GETARG_DATUM(i));
+
+/*
+ * Map the result attributes to the columns of a kdb+ result and pick their
+ * conversion kernels, unless the previous result had the same column names
+ * and types. The kernels of empty columns (which may have no type of their
+ * own) are not reused.
+ */
+void getset_replan(GSMeta *meta, K table)
+{
+	K colnames = kK(table->k)[0]; /* kdb+ column names */
+	K values = kK(table->k)[1]; /* kdb+ columns */
+	J n = colnames->n;
+
+	bool same = meta->planned && meta->ncols == n &&
+		memcmp(meta->colnames, kS(colnames), n * sizeof(S)) == 0;
+	for (J i = 0; same && i < n; i++)
+		same = meta->coltypes[i] == kK(values)[i]->t;
+	if (same)
+		return;
+
+	int natts = meta->tupdesc->natts;
+	MemoryContext oldcontext = MemoryContextSwitchTo(meta->mcxt);
+
+	if (meta->perm == NULL)
+	{
+		meta->perm = (int *) palloc(natts * sizeof(int));
+		meta->todtind = (int *) palloc(natts * sizeof(int));
+		meta->kernels = (K2PCOL *) palloc(natts * sizeof(K2PCOL));
 	}
+	if (meta->colnames == NULL || meta->ncols < n)
+	{
+		if (meta->colnames != NULL)
+		{
+			pfree(meta->colnames);
+			pfree(meta->coltypes);
+		}
+		meta->colnames = (S *) palloc(Max(n, 1) * sizeof(S));
+		meta->coltypes = (signed char *) palloc(Max(n, 1));
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Not usable until complete (the columns may not match) */
+	meta->planned = false;
+	getset_plan(meta->tupdesc, table, meta->perm, meta->todtind);
+	getset_kernels(meta->tupdesc, table, meta->perm, meta->kernels);
+
+	memcpy(meta->colnames, kS(colnames), n * sizeof(S));
+	for (J i = 0; i < n; i++)
+		meta->coltypes[i] = kK(values)[i]->t;
+	meta->ncols = n;
+	meta->planned = n > 0 && kK(values)[0]->n > 0;
+}
+
+
+/* 
+ * Get calling Postgres function's arguments 
+ */
+K getset_args(FunctionCallInfo fcinfo)
+{
+	/* Argument conversions, resolved on the first call */
+	GSMeta *meta = getset_meta(fcinfo);
+
+	/* Initialize mixed K array (to be populated below) */
+	K lo = knk(meta->nargs - 1, 0); 
+
+	/* Call conversion routine via dispatch table */
+	for (int i = 1; i < meta->nargs; i++)
+		kK(lo)[i - 1] = (todt[meta->argind[i]].p2k)(PG_GETARG_DATUM(i));
 
 	return lo;
 }
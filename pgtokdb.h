@@ -7,10 +7,44 @@
 #include <utils/builtins.h>
 #include <utils/uuid.h>
 #include <utils/array.h>
+#include <fmgr.h>
+#include <access/tupdesc.h>
+#include <utils/tuplestore.h>
+#include <utils/relcache.h>
+#include <portability/instr_time.h>
+
+/* Array type OIDs that older catalog headers don't name */
+#ifndef BOOLARRAYOID
+#define BOOLARRAYOID 1000
+#endif
+#ifndef TEXTARRAYOID
+#define TEXTARRAYOID 1009
+#endif
+#ifndef VARCHARARRAYOID
+#define VARCHARARRAYOID 1015
+#endif
+#ifndef DATEARRAYOID
+#define DATEARRAYOID 1182
+#endif
+#ifndef TIMESTAMPARRAYOID
+#define TIMESTAMPARRAYOID 1115
+#endif
+#ifndef TIMESTAMPTZARRAYOID
+#define TIMESTAMPTZARRAYOID 1185
+#endif
+#ifndef NUMERICARRAYOID
+#define NUMERICARRAYOID 1231
+#endif
+#ifndef UUIDARRAYOID
+#define UUIDARRAYOID 2951
+#endif
 
 #define KXVER 3
 #include "k.h"
 
+/* SQLSTATE of a kdb+ call exceeding pgtokdb.query_timeout (class PK: pgtokdb) */
+#define ERRCODE_KDB_QUERY_TIMEOUT	MAKE_SQLSTATE('P','K','0','0','1')
+
 /*
  * Redefine PG_FUNCTION_INFO_V1 (found in PG's include\fmgr.h) so that funcname
  * is declared with PGDLLEXPORT -- which is required for a Windows build.
@@ -26,6 +60,159 @@ CppConcat(pg_finfo_,funcname) (void) \
 } \
 extern int no_such_variable
 
+/* Type OID dispatch table entry used to determine conversion functions */
+typedef struct
+{
+	int     typeoid;				/* OID of Postgres type */
+	Datum   (*k2p)(K, int, char *);	/* Function to convert kdb+ to Postgres */
+	K		(*p2k)(Datum); 			/* Function to convert Postgres to kdb+ */
+	bool    isref;					/* Indicates whether Postgres Datum is a reference */
+} TODT;
+
+extern TODT todt[];
+
+/* Phases of a call timed for pgtokdb.stat_statements (stats.c) */
+#define KSTAT_CONNECT	0	/* Opening connections to kdb+ */
+#define KSTAT_KDB		1	/* Waiting for kdb+ (execution, transfer and decoding) */
+#define KSTAT_CONVERT	2	/* Converting kdb+ values to Datums */
+#define KSTAT_FORM		3	/* Forming tuples */
+#define KSTAT_PHASES	4
+
+/* Time spent and data handled by one call of a function */
+typedef struct
+{
+	bool		active;		/* Whether the call is being timed */
+	Oid			fnoid;		/* Function called */
+	char	   *expr;		/* Its kdb+ expression */
+	instr_time	mark;		/* Start of the phase being timed */
+	double		connmark;	/* kconn_connect_ms at the start of a request */
+	int64		bytesmark;	/* kconn_bytes at the start of a request */
+	double		ms[KSTAT_PHASES];	/* Milliseconds spent in each phase */
+	int64		rows;		/* Rows returned */
+	int64		bytes;		/* Size of the kdb+ results (as sent over IPC) */
+} KStatCall;
+
+/* Most replicas in a pgtokdb.host list, and response times kept per replica */
+#define KREPLICA_LIST		16
+#define KREPLICA_SAMPLES	64
+
+/* A replica of a kdb+ process, as seen by this backend (replica.c) */
+typedef struct
+{
+	char		host[256];
+	int			port;
+	double		latency;	/* Moving average of its response time (ms) */
+	double		errors;		/* Moving average of its failures (0 to 1) */
+	TimestampTz	down_until;	/* Avoided until then after a failure */
+	int64		calls;		/* Responses timed */
+	double		samples[KREPLICA_SAMPLES];	/* Last response times (ms) */
+} KReplica;
+
+/* 
+ * Wrapper applied to a call when projecting: x is the expression (or the 
+ * function and its arguments) and c the column names the result type needs 
+ */
+#define PROJECT_LAMBDA "{[c;x] r:value x; $[98h=type r; (c inter cols r)#r; r]}"
+
+/* Converts a run of rows of a kdb+ column into Datums (see k2p_column) */
+typedef void (*K2PCOL)(K, J, int, Datum *, char *);
+
+/* Texts of the kdb+ symbols converted during a call (convert.c) */
+typedef struct KSymCache KSymCache;
+
+/* A bulk load of kdb+ results into a Postgres table (load.c) */
+typedef struct KLoad KLoad;
+
+/* Shared utilities (pgtokdb.c) */
+int 	findOID(int);
+void	safecpy(char *, const char *, size_t);
+K		kk(I, char *, K);
+void	ktable_check(K);
+
+/* Parts of getset shared with the sharded variant (pgtokdb.c) */
+int 	findName(char *, K);
+void	findNames(TupleDesc, K, int *);
+void	getset_plan(TupleDesc, K, int *, int *);
+void	getset_store(Tuplestorestate *, TupleDesc, K, int *, K2PCOL *, MemoryContext, KStatCall *);
+void	getset_kernels(TupleDesc, K, int *, K2PCOL *);
+K		getset_cols(TupleDesc);
+K		getset_expr(S, K);
+K 		getset_args(FunctionCallInfo);
+
+/* Sharded fan-out (shard.c) */
+void	shard_init(void);
+
+/* Bulk writes to kdb+ (insert.c) */
+void	insert_init(void);
+
+/* Bulk loads from kdb+ into Postgres tables (load.c) */
+void	load_init(void);
+void	kload_check(Relation);
+KLoad  *kload_start(Relation);
+void	kload_write(KLoad *, K);
+void	kload_finish(KLoad *);
+
+/* Tickerplant subscriber (tick.c) */
+void	ktick_init(void);
+
+/* Statistics of calls (stats.c) */
+void	kstat_init(void);
+void	kstat_start(KStatCall *, FunctionCallInfo);
+void	kstat_begin(KStatCall *);
+void	kstat_kdb(KStatCall *);
+double	kstat_lap(KStatCall *);
+void	kstat_record(KStatCall *);
+
+/* Planner support (support.c) */
+void	ksupport_init(void);
+
+/* Background workers proxying calls to kdb+ (proxy.c) */
+void	kproxy_init(void);
+int		kproxy_target(const char *, int, const char *);
+K		kproxy_call(int, K, int, bool *);
+
+/* Replica selection (replica.c) */
+void	kreplica_init(void);
+bool	kreplica_is_list(const char *);
+int		kreplica_list(const char *, int, KReplica **);
+void	kreplica_rank(KReplica **, int, int *);
+void	kreplica_pick(const char **, int *);
+void	kreplica_record(KReplica *, double, bool);
+double	kreplica_hedge_ms(KReplica *);
+
+/* Shared result cache (cache.c) */
+void	kcache_init(void);
+K		kcache_call(Oid, const char *, int, const char *, S, K);
+
+/* kdb+ connection cache (connect.c) */
+void	kconn_init(void);
+K		kconn_call(const char *, int, const char *, S, K);
+J		kcursor_open(const char *, int, const char *, K, K);
+K		kcursor_fetch(const char *, int, const char *, J, J);
+K		kcursor_slice(const char *, int, const char *, J, J);
+void	kcursor_close(const char *, int, const char *, J);
+I		kconn_open(const char *, int, const char *);
+void	kconn_discard(I);
+void	kconn_poll(I, const char *, int, short, instr_time);
+void	kconn_timeout(const char *, int);
+K		kconn_receive(I, const char *, int, instr_time);
+
+/* Built-in reader of kdb+ responses (ipc.c) */
+K		kipc_receive(I, const char *, int, instr_time);
+
+extern int kconn_chunk_rows;
+extern double kconn_connect_ms;
+extern int64 kconn_bytes;
+extern int kconn_connect_timeout;
+extern int kconn_query_timeout;
+
+K2PCOL	k2p_column(Oid, K, char *);
+KSymCache *ksym_create(MemoryContext);
+void	ksym_free(KSymCache *);
+void	ksym_use(KSymCache *);
+
+extern int ksym_max;
+
 K p2k_bool(Datum);
 K p2k_uuid(Datum);
 K p2k_int2(Datum);
@@ -38,6 +225,20 @@ K p2k_varchar(Datum);
 K p2k_timestamp(Datum);
 K p2k_date(Datum);
 K p2k_bytea(Datum);
+K p2k_numeric(Datum);
+K p2k_int2array(Datum);
+K p2k_int4array(Datum);
+K p2k_int8array(Datum);
+K p2k_float4array(Datum);
+K p2k_float8array(Datum);
+K p2k_boolarray(Datum);
+K p2k_datearray(Datum);
+K p2k_uuidarray(Datum);
+K p2k_timestamparray(Datum);
+K p2k_timestamptzarray(Datum);
+K p2k_numericarray(Datum);
+K p2k_textarray(Datum);
+K p2k_varchararray(Datum);
 
 Datum k2p_bool(K, int, char *);
 Datum k2p_uuid(K, int, char *);
@@ -51,6 +252,7 @@ Datum k2p_varchar(K, int, char *);
 Datum k2p_timestamp(K, int, char *);
 Datum k2p_date(K, int, char *);
 Datum k2p_bytea(K, int, char *);
+Datum k2p_numeric(K, int, char *);
 Datum k2p_int2array(K, int, char *);
 Datum k2p_int4array(K, int, char *);
 Datum k2p_int8array(K, int, char *);
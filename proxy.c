@@ -0,0 +1,695 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Proxy of kdb+ calls through background workers. Each of the
+ * pgtokdb.proxy_workers workers keeps a connection open to every kdb+
+ * process listed in pgtokdb.proxy_targets, opened as soon as the postmaster
+ * starts it. A backend calling one of those processes (with the server's
+ * credentials) queues the call in shared memory, and exchanges the request
+ * and the response with the worker that takes it through a pair of shm_mq
+ * in a DSM segment. kdb+ then sees a few connections however many backends
+ * there are. Calls are taken by priority (pgtokdb.proxy_priority), then in
+ * the order they were queued. A worker forwards the serialized messages as
+ * they are, so it never decodes a result.
+ *
+ * The workers need the library to be loaded through shared_preload_libraries.
+ */
+
+#include "pgtokdb.h"
+#include <errno.h>
+#include <limits.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <postmaster/bgworker.h>
+#include <storage/dsm.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/lwlock.h>
+#include <storage/proc.h>
+#include <storage/shm_mq.h>
+#include <storage/shmem.h>
+#include <tcop/tcopprot.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+#define KPROXY_MAX_WORKERS	64
+#define KPROXY_MAX_TARGETS	16
+
+/* Calls that can wait for a worker (others are sent directly) */
+#define KPROXY_QUEUE		1024
+
+/* Size of each of the two message queues of a call */
+#define KPROXY_MQ_SIZE		(1024 * 1024)
+
+/* Milliseconds between checks for a cancel request or a dead connection */
+#define KPROXY_POLL_MS		100
+#define KPROXY_IDLE_MS		10000
+
+/* First byte of a response: kdb+ message, network error, or error text */
+#define KPROXY_MESSAGE		'K'
+#define KPROXY_NETWORK		'N'
+#define KPROXY_ERROR		'E'
+
+#if PG_VERSION_NUM >= 150000
+#define kproxy_mq_send(h, n, p, nowait) shm_mq_send(h, n, p, nowait, true)
+#else
+#define kproxy_mq_send(h, n, p, nowait) shm_mq_send(h, n, p, nowait)
+#endif
+
+/* A call waiting for a worker */
+typedef struct
+{
+	bool		used;		/* Slot holds a call */
+	dsm_handle	handle;		/* Segment holding the message queues of the call */
+	int			target;		/* Index into pgtokdb.proxy_targets */
+	int			priority;	/* Taken before calls of lower priority */
+	uint64		seq;		/* Order in which the call was queued */
+} KProxyCall;
+
+/* Proxy state shared by the backends and the workers */
+typedef struct
+{
+	LWLock	   *lock;		/* Protects the queue */
+	uint64		seq;		/* Calls queued so far */
+	int			running;	/* Workers taking calls */
+	char		userpass[256];	/* Credentials the workers connect with */
+	Latch	   *latches[KPROXY_MAX_WORKERS];	/* Of the running workers */
+	KProxyCall	queue[KPROXY_QUEUE];
+} KProxyShared;
+
+/* A kdb+ process served by the proxy */
+typedef struct
+{
+	char	host[256];
+	int		port;
+	I		handle;		/* Connection of this worker (0 if not open) */
+} KProxyTarget;
+
+/* Configuration globals */
+static int kproxy_workers = 0;
+static char *kproxy_targets = NULL;
+static int kproxy_priority = 0;
+
+/* Shared state, as attached by this process */
+static KProxyShared *kproxy = NULL;
+
+/* Targets parsed from pgtokdb.proxy_targets (ntargets < 0 until parsed) */
+static KProxyTarget targets[KPROXY_MAX_TARGETS];
+static int ntargets = -1;
+
+/* Index of this worker */
+static int kproxy_id = -1;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* Prototypes */
+void	kproxy_shmem_request(void);
+void	kproxy_shmem_startup(void);
+void	kproxy_parse(void);
+bool	kproxy_enqueue(int, dsm_handle);
+bool	kproxy_dequeue(KProxyCall *);
+void	kproxy_wait(instr_time, int);
+void	kproxy_detach(int, Datum);
+bool	kproxy_connect(KProxyTarget *);
+bool	kproxy_io(I, char *, Size, bool);
+char   *kproxy_forward(KProxyTarget *, char *, Size, Size *, bool *);
+void	kproxy_serve(KProxyCall *);
+PGDLLEXPORT void kproxy_main(Datum);
+
+
+/*
+ * Define the configuration settings of the proxy, and register its workers
+ * and reserve its shared memory when loaded through shared_preload_libraries
+ */
+void kproxy_init(void)
+{
+	DefineCustomIntVariable("pgtokdb.proxy_workers",
+		"Background workers that send the calls of all backends to kdb+.",
+		"Zero has every backend connect to kdb+ itself.",
+		&kproxy_workers, 0, 0, KPROXY_MAX_WORKERS,
+		PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgtokdb.proxy_targets",
+		"Comma-separated host:port list of the kdb+ processes called through the proxy workers.",
+		NULL, &kproxy_targets, "", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.proxy_priority",
+		"Priority of the calls of the session among those waiting for a proxy worker.",
+		"Calls of higher priority are sent first; calls of equal priority in order. "
+		"Only superusers can set it, e.g. per role with ALTER ROLE ... SET.",
+		&kproxy_priority, 0, -1000, 1000,
+		PGC_SUSET, 0, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || kproxy_workers == 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = kproxy_shmem_request;
+#else
+	kproxy_shmem_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = kproxy_shmem_startup;
+
+	for (int i = 0; i < kproxy_workers; i++)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pgtokdb proxy %d", i);
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pgtokdb proxy");
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgtokdb");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "kproxy_main");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+		worker.bgw_restart_time = 10;
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
+	}
+}
+
+
+/*
+ * Request the shared memory and the lock of the proxy
+ */
+void kproxy_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(KProxyShared)));
+	RequestNamedLWLockTranche("pgtokdb_proxy", 1);
+}
+
+
+/*
+ * Set up (or attach to) the call queue
+ */
+void kproxy_shmem_startup(void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	kproxy = (KProxyShared *) ShmemInitStruct("pgtokdb proxy", sizeof(KProxyShared), &found);
+	if (!found)
+	{
+		memset(kproxy, 0, sizeof(KProxyShared));
+		kproxy->lock = &(GetNamedLWLockTranche("pgtokdb_proxy"))->lock;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Split pgtokdb.proxy_targets into its endpoints (once per process). Invalid
+ * entries are reported and skipped, so that a typo can't stop the workers.
+ */
+void kproxy_parse(void)
+{
+	if (ntargets >= 0)
+		return;
+
+	ntargets = 0;
+	char *list = pstrdup(kproxy_targets);
+
+	for (char *tok = strtok(list, ", "); tok != NULL; tok = strtok(NULL, ", "))
+	{
+		char *colon = strrchr(tok, ':');
+		if (colon == NULL || colon == tok || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535)
+		{
+			elog(WARNING, "Invalid kdb+ process \"%s\" in pgtokdb.proxy_targets (expected host:port)", tok);
+			continue;
+		}
+		if (ntargets == KPROXY_MAX_TARGETS)
+		{
+			elog(WARNING, "The number of pgtokdb.proxy_targets exceeds %d", KPROXY_MAX_TARGETS);
+			break;
+		}
+
+		*colon = '\0';
+		safecpy(targets[ntargets].host, tok, sizeof(targets[ntargets].host));
+		targets[ntargets].port = atoi(colon + 1);
+		targets[ntargets].handle = 0;
+		ntargets++;
+	}
+
+	pfree(list);
+}
+
+
+/*
+ * Index of the proxy target of a call, or -1 when the call is sent directly
+ * (no worker running, a process that isn't a target, or credentials other than
+ * those the workers connect with)
+ */
+int kproxy_target(const char *host, int port, const char *userpass)
+{
+	if (kproxy == NULL)
+		return -1;
+
+	LWLockAcquire(kproxy->lock, LW_SHARED);
+	bool same = kproxy->running > 0 && strcmp(userpass, kproxy->userpass) == 0;
+	LWLockRelease(kproxy->lock);
+	if (!same)
+		return -1;
+
+	kproxy_parse();
+	for (int i = 0; i < ntargets; i++)
+		if (targets[i].port == port && strcmp(targets[i].host, host) == 0)
+			return i;
+
+	return -1;
+}
+
+
+/*
+ * Queue a call and wake up the workers. Returns false when the queue is full.
+ */
+bool kproxy_enqueue(int target, dsm_handle handle)
+{
+	KProxyCall *slot = NULL;
+
+	LWLockAcquire(kproxy->lock, LW_EXCLUSIVE);
+	for (int i = 0; i < KPROXY_QUEUE && slot == NULL; i++)
+		if (!kproxy->queue[i].used)
+			slot = &kproxy->queue[i];
+
+	if (slot != NULL)
+	{
+		slot->used = true;
+		slot->handle = handle;
+		slot->target = target;
+		slot->priority = kproxy_priority;
+		slot->seq = ++kproxy->seq;
+	}
+	LWLockRelease(kproxy->lock);
+
+	if (slot == NULL)
+		return false;
+
+	for (int i = 0; i < KPROXY_MAX_WORKERS; i++)
+	{
+		Latch *latch = kproxy->latches[i];
+		if (latch != NULL)
+			SetLatch(latch);
+	}
+
+	return true;
+}
+
+
+/*
+ * Take the next call off the queue (highest priority, then oldest). Returns
+ * false when there is none.
+ */
+bool kproxy_dequeue(KProxyCall *call)
+{
+	KProxyCall *best = NULL;
+
+	LWLockAcquire(kproxy->lock, LW_EXCLUSIVE);
+	for (int i = 0; i < KPROXY_QUEUE; i++)
+	{
+		KProxyCall *c = &kproxy->queue[i];
+		if (c->used && (best == NULL || c->priority > best->priority ||
+			(c->priority == best->priority && c->seq < best->seq)))
+			best = c;
+	}
+
+	if (best != NULL)
+	{
+		*call = *best;
+		best->used = false;
+	}
+	LWLockRelease(kproxy->lock);
+
+	return best != NULL;
+}
+
+
+/*
+ * Wait a little for a worker, checking for a cancel request and
+ * pgtokdb.query_timeout (counted from start)
+ */
+void kproxy_wait(instr_time start, int timeout)
+{
+	(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+		KPROXY_POLL_MS, PG_WAIT_EXTENSION);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+
+	if (timeout > 0)
+	{
+		instr_time elapsed;
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		if (INSTR_TIME_GET_MILLISEC(elapsed) >= timeout)
+			ereport(ERROR,
+				(errcode(ERRCODE_KDB_QUERY_TIMEOUT),
+				 errmsg("kdb+ proxy did not respond within pgtokdb.query_timeout (%d ms)", timeout)));
+	}
+}
+
+
+/*
+ * Send x (the expression, or the function followed by its arguments) to a
+ * proxy target through a worker, and return the response (NULL on a network
+ * error). Sets *queued to false, without calling kdb+, when the queue is
+ * full.
+ */
+K kproxy_call(int target, K x, int timeout, bool *queued)
+{
+	instr_time start;
+	shm_mq_result res;
+	Size n;
+	void *data;
+	K result = NULL;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* One queue carries the request to the worker, the other the response back */
+	dsm_segment *seg = dsm_create(2 * KPROXY_MQ_SIZE, 0);
+	char *addr = (char *) dsm_segment_address(seg);
+	shm_mq *reqq = shm_mq_create(addr, KPROXY_MQ_SIZE);
+	shm_mq *respq = shm_mq_create(addr + KPROXY_MQ_SIZE, KPROXY_MQ_SIZE);
+	shm_mq_set_sender(reqq, MyProc);
+	shm_mq_set_receiver(respq, MyProc);
+	shm_mq_handle *req = shm_mq_attach(reqq, seg, NULL);
+	shm_mq_handle *resp = shm_mq_attach(respq, seg, NULL);
+
+	*queued = kproxy_enqueue(target, dsm_segment_handle(seg));
+	if (!*queued)
+	{
+		dsm_detach(seg);
+		return NULL;
+	}
+
+	/* The serialized message (as k() sends it), made synchronous */
+	K msg = b9(3, x);
+	if (msg == NULL)
+		elog(ERROR, "Unable to serialize call to kdb+");
+	kG(msg)[1] = 1;
+
+	PG_TRY();
+	{
+		while ((res = kproxy_mq_send(req, msg->n, kG(msg), true)) == SHM_MQ_WOULD_BLOCK)
+			kproxy_wait(start, timeout);
+		if (res == SHM_MQ_SUCCESS)
+			while ((res = shm_mq_receive(resp, &n, &data, true)) == SHM_MQ_WOULD_BLOCK)
+				kproxy_wait(start, timeout);
+	}
+	PG_CATCH();
+	{
+		/* The worker finds the queues detached (a timed out call may be retried elsewhere) */
+		r0(msg);
+		dsm_detach(seg);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	r0(msg);
+
+	if (res != SHM_MQ_SUCCESS)
+		elog(ERROR, "kdb+ proxy worker went away");
+
+	char *p = (char *) data;
+	if (p[0] == KPROXY_ERROR)
+		elog(ERROR, "%.*s", (int) (n - 1), p + 1);
+	else if (p[0] == KPROXY_MESSAGE)
+	{
+		K bytes = ktn(KG, n - 1);
+		memcpy(kG(bytes), p + 1, n - 1);
+		kconn_bytes += n - 1;
+		result = d9(bytes);
+		r0(bytes);
+
+		/* d9 gives nothing back for a kdb+ error, which is rebuilt here */
+		if (result == NULL && n > 10 && (signed char) p[9] == -128)
+		{
+			result = ka(-128);
+			result->s = ss(pnstrdup(p + 10, n - 10));
+		}
+	}
+
+	dsm_detach(seg);
+	return result;
+}
+
+
+/*
+ * Forget this worker's latch when it exits
+ */
+void kproxy_detach(int code, Datum arg)
+{
+	LWLockAcquire(kproxy->lock, LW_EXCLUSIVE);
+	kproxy->latches[kproxy_id] = NULL;
+	kproxy->running--;
+	LWLockRelease(kproxy->lock);
+}
+
+
+/*
+ * Open a worker's connection to a target. A failure is logged rather than
+ * raised, so that the worker keeps serving the other targets.
+ */
+bool kproxy_connect(KProxyTarget *t)
+{
+	if (t->handle > 0)
+		kclose(t->handle);
+
+	t->handle = kconn_connect_timeout > 0 ?
+		khpun(t->host, t->port, (S) GetConfigOption("pgtokdb.userpass", false, false),
+			kconn_connect_timeout) :
+		khpu(t->host, t->port, (S) GetConfigOption("pgtokdb.userpass", false, false));
+
+	if (t->handle > 0)
+		return true;
+
+	elog(LOG, "pgtokdb proxy %d unable to connect to kdb+ at %s:%d (%d)",
+		kproxy_id, t->host, t->port, t->handle);
+	t->handle = 0;
+	return false;
+}
+
+
+/*
+ * Send or receive n bytes on a socket, checking for a shutdown request while
+ * waiting. Returns false on a network error.
+ */
+bool kproxy_io(I handle, char *buf, Size n, bool out)
+{
+	struct pollfd pfd;
+
+	while (n > 0)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		pfd.fd = handle;
+		pfd.events = out ? POLLOUT : POLLIN;
+		pfd.revents = 0;
+
+		int rc = poll(&pfd, 1, KPROXY_POLL_MS);
+		if (rc < 0 && errno != EINTR)
+			return false;
+		if (rc <= 0)
+			continue;
+
+		J done = out ? send(handle, buf, n, 0) : recv(handle, buf, n, 0);
+		if (done == 0 || (done < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+			return false;
+		if (done > 0)
+		{
+			buf += done;
+			n -= done;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Send a request to a target and return its response, preceded by a status
+ * byte, in *len bytes (NULL on a network error, or when *connfailed, on a
+ * failure to connect). A broken connection is reopened and the request sent
+ * once more, as kconn_call does.
+ */
+char *kproxy_forward(KProxyTarget *t, char *msg, Size n, Size *len, bool *connfailed)
+{
+	*connfailed = false;
+
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		char header[8];
+
+		if (t->handle <= 0 && !kproxy_connect(t))
+		{
+			*connfailed = true;
+			return NULL;
+		}
+
+		if (kproxy_io(t->handle, msg, n, true) && kproxy_io(t->handle, header, 8, false))
+		{
+			/* Length of the whole message, in the byte order it states (1 = little endian) */
+			unsigned char *h = (unsigned char *) header;
+			uint32 size = header[0] == 1 ?
+				(uint32) h[4] | (uint32) h[5] << 8 | (uint32) h[6] << 16 | (uint32) h[7] << 24 :
+				(uint32) h[7] | (uint32) h[6] << 8 | (uint32) h[5] << 16 | (uint32) h[4] << 24;
+
+			if (size >= 8)
+			{
+				char *buf = (char *) MemoryContextAllocHuge(CurrentMemoryContext, (Size) size + 1);
+				buf[0] = KPROXY_MESSAGE;
+				memcpy(buf + 1, header, 8);
+				if (kproxy_io(t->handle, buf + 9, size - 8, false))
+				{
+					*len = (Size) size + 1;
+					return buf;
+				}
+			}
+		}
+
+		kclose(t->handle);
+		t->handle = 0;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Serve a call taken off the queue. The backend may have given up on it
+ * (and released its segment), in which case there is nothing to do.
+ */
+void kproxy_serve(KProxyCall *call)
+{
+	Size n;
+	void *data;
+
+	dsm_segment *seg = dsm_attach(call->handle);
+	if (seg == NULL)
+		return;
+
+	char *addr = (char *) dsm_segment_address(seg);
+	shm_mq *reqq = (shm_mq *) addr;
+	shm_mq *respq = (shm_mq *) (addr + KPROXY_MQ_SIZE);
+	shm_mq_set_receiver(reqq, MyProc);
+	shm_mq_set_sender(respq, MyProc);
+	shm_mq_handle *req = shm_mq_attach(reqq, seg, NULL);
+	shm_mq_handle *resp = shm_mq_attach(respq, seg, NULL);
+
+	if (shm_mq_receive(req, &n, &data, false) == SHM_MQ_SUCCESS)
+	{
+		KProxyTarget *t = &targets[call->target];
+		Size len;
+		bool connfailed = false;
+		char *response = call->target < ntargets ?
+			kproxy_forward(t, data, n, &len, &connfailed) : NULL;
+
+		if (response == NULL)
+		{
+			/* The backend reports it as it would a failed direct call */
+			char status[512];
+			if (connfailed)
+				len = 1 + Min(sizeof(status) - 2, snprintf(status + 1, sizeof(status) - 1,
+					"Socket connection error attempting to connect to kdb+ at %s:%d",
+					t->host, t->port));
+			else
+				len = 1;
+			status[0] = len > 1 ? KPROXY_ERROR : KPROXY_NETWORK;
+			(void) kproxy_mq_send(resp, len, status, false);
+		}
+		else
+			(void) kproxy_mq_send(resp, len, response, false);
+	}
+
+	dsm_detach(seg);
+}
+
+
+/*
+ * Entry point of a proxy worker
+ */
+PGDLLEXPORT void kproxy_main(Datum arg)
+{
+	kproxy_id = DatumGetInt32(arg);
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	MemoryContext callctx = AllocSetContextCreate(TopMemoryContext,
+		"pgtokdb proxy call", ALLOCSET_DEFAULT_SIZES);
+
+	/* Warm up the connections before taking calls */
+	kproxy_parse();
+	for (int i = 0; i < ntargets; i++)
+		kproxy_connect(&targets[i]);
+
+	LWLockAcquire(kproxy->lock, LW_EXCLUSIVE);
+	safecpy(kproxy->userpass, GetConfigOption("pgtokdb.userpass", false, false),
+		sizeof(kproxy->userpass));
+	kproxy->latches[kproxy_id] = MyLatch;
+	kproxy->running++;
+	LWLockRelease(kproxy->lock);
+	on_shmem_exit(kproxy_detach, (Datum) 0);
+
+	for (;;)
+	{
+		KProxyCall call;
+
+		while (kproxy_dequeue(&call))
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(callctx);
+			kproxy_serve(&call);
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(callctx);
+		}
+
+		int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+			KPROXY_IDLE_MS, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		/* Reopen the connections that kdb+ has closed while idle */
+		if (rc & WL_TIMEOUT)
+			for (int i = 0; i < ntargets; i++)
+			{
+				struct pollfd pfd = { targets[i].handle, POLLIN, 0 };
+				if (targets[i].handle <= 0 || poll(&pfd, 1, 0) != 0)
+					kproxy_connect(&targets[i]);
+			}
+	}
+}
@@ -0,0 +1,263 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Health of the replicas named by a pgtokdb.host list (e.g. "rdb1,rdb2:5011").
+ * Each backend tracks, per replica, a moving average of its response time
+ * and of its failures, and the response times of its last calls. Calls go to
+ * the fastest replica that is up; one that fails is marked down for
+ * pgtokdb.replica_down_time seconds, and only tried once the others have
+ * failed as well. With pgtokdb.hedge_percentile set, a call that is still
+ * waiting after that percentile of the replica's recent response times is
+ * also sent to the next replica, and the first response is used (see
+ * kconn_call).
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <math.h>
+#include <utils/guc.h>
+#include <utils/timestamp.h>
+
+/* Replicas tracked by a backend (all lists together) */
+#define KREPLICA_MAX		64
+
+/* Weight of the latest call in the moving averages */
+#define KREPLICA_ALPHA		0.2
+
+/* A failure rate of 10% makes a replica look twice as slow */
+#define KREPLICA_ERROR_WEIGHT	10.0
+
+/* Calls needed before a replica's percentile is trusted for hedging */
+#define KREPLICA_MIN_SAMPLES	16
+
+/* Configuration globals */
+static int kreplica_down_time = 30;
+static double kreplica_hedge = 0;
+
+/* Replicas of this backend */
+static KReplica kreplicas[KREPLICA_MAX];
+static int nkreplicas = 0;
+
+/* Prototypes */
+KReplica *kreplica_find(const char *, int);
+double	kreplica_score(KReplica *);
+int		kreplica_compare(const void *, const void *);
+
+/* The list being ranked (for kreplica_compare) */
+static KReplica **kreplica_ranked = NULL;
+static TimestampTz kreplica_now = 0;
+
+
+/*
+ * Define the configuration settings of replica selection
+ */
+void kreplica_init(void)
+{
+	DefineCustomIntVariable("pgtokdb.replica_down_time",
+		"Seconds a replica that failed a call is avoided.",
+		"Applies when pgtokdb.host lists several replicas.",
+		&kreplica_down_time, 30, 0, INT_MAX / 1000,
+		PGC_USERSET, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("pgtokdb.hedge_percentile",
+		"Percentile of a replica's response times after which a call is also sent to another replica.",
+		"Zero never sends a call twice. Only set it for calls that don't change kdb+ data.",
+		&kreplica_hedge, 0, 0, 100,
+		PGC_USERSET, 0, NULL, NULL, NULL);
+}
+
+
+/*
+ * Whether a pgtokdb.host setting lists several replicas
+ */
+bool kreplica_is_list(const char *host)
+{
+	return strchr(host, ',') != NULL;
+}
+
+
+/*
+ * The tracked replica at host:port, added if new (replacing the replica
+ * added longest ago when the table is full)
+ */
+KReplica *kreplica_find(const char *host, int port)
+{
+	for (int i = 0; i < Min(nkreplicas, KREPLICA_MAX); i++)
+		if (kreplicas[i].port == port && strcmp(kreplicas[i].host, host) == 0)
+			return &kreplicas[i];
+
+	KReplica *r = &kreplicas[nkreplicas++ % KREPLICA_MAX];
+	memset(r, 0, sizeof(KReplica));
+	safecpy(r->host, host, sizeof(r->host));
+	r->port = port;
+	return r;
+}
+
+
+/*
+ * Split a list of replicas (host or host:port, port defaulting to
+ * pgtokdb.port) into list, in the order given. Returns the number of
+ * replicas.
+ */
+int kreplica_list(const char *hosts, int port, KReplica **list)
+{
+	int n = 0;
+	char *copy = pstrdup(hosts);
+
+	for (char *tok = strtok(copy, ", "); tok != NULL; tok = strtok(NULL, ", "))
+	{
+		char *colon = strrchr(tok, ':');
+		int p = port;
+
+		if (colon != NULL)
+		{
+			*colon = '\0';
+			p = atoi(colon + 1);
+			if (p <= 0 || p > 65535)
+				elog(ERROR, "Invalid port of kdb+ replica \"%s\" in pgtokdb.host", tok);
+		}
+
+		if (n == KREPLICA_LIST)
+			elog(ERROR, "The number of replicas in pgtokdb.host exceeds %d", KREPLICA_LIST);
+		list[n++] = kreplica_find(tok, p);
+	}
+
+	pfree(copy);
+
+	if (n == 0)
+		elog(ERROR, "pgtokdb.host lists no kdb+ replica");
+	return n;
+}
+
+
+/*
+ * Expected cost of a call to a replica: its average response time, inflated
+ * by its failure rate. A replica not called yet comes first, so that it is
+ * measured.
+ */
+double kreplica_score(KReplica *r)
+{
+	return r->latency * (1.0 + KREPLICA_ERROR_WEIGHT * r->errors);
+}
+
+
+/*
+ * Order of two replicas (by index into the list ranked): those that are up
+ * by score, then those that are down by when they come back
+ */
+int kreplica_compare(const void *a, const void *b)
+{
+	KReplica *ra = kreplica_ranked[*(const int *) a];
+	KReplica *rb = kreplica_ranked[*(const int *) b];
+	bool downa = ra->down_until > kreplica_now;
+	bool downb = rb->down_until > kreplica_now;
+
+	if (downa != downb)
+		return downa ? 1 : -1;
+	if (downa && ra->down_until != rb->down_until)
+		return ra->down_until < rb->down_until ? -1 : 1;
+
+	double sa = kreplica_score(ra);
+	double sb = kreplica_score(rb);
+	if (sa != sb)
+		return sa < sb ? -1 : 1;
+
+	/* Ties keep the order of the list */
+	return *(const int *) a - *(const int *) b;
+}
+
+
+/*
+ * Fill order with the indices of the n replicas of list, best first
+ */
+void kreplica_rank(KReplica **list, int n, int *order)
+{
+	for (int i = 0; i < n; i++)
+		order[i] = i;
+
+	kreplica_ranked = list;
+	kreplica_now = GetCurrentTimestamp();
+	qsort(order, n, sizeof(int), kreplica_compare);
+	kreplica_ranked = NULL;
+}
+
+
+/*
+ * Replace a list of replicas by the first of them, for calls that must always
+ * go to the same replica (e.g. writes)
+ */
+void kreplica_pick(const char **host, int *port)
+{
+	KReplica *list[KREPLICA_LIST];
+
+	if (!kreplica_is_list(*host))
+		return;
+
+	kreplica_list(*host, *port, list);
+	*host = list[0]->host;
+	*port = list[0]->port;
+}
+
+
+/*
+ * Account for a call to a replica that took ms milliseconds (ok = whether
+ * the replica responded). A replica that failed is marked down.
+ */
+void kreplica_record(KReplica *r, double ms, bool ok)
+{
+	if (!ok)
+	{
+		r->errors += KREPLICA_ALPHA * (1.0 - r->errors);
+		r->down_until = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+			kreplica_down_time * 1000);
+		return;
+	}
+
+	r->errors *= 1.0 - KREPLICA_ALPHA;
+	r->latency = r->calls == 0 ? ms : r->latency + KREPLICA_ALPHA * (ms - r->latency);
+	r->samples[r->calls++ % KREPLICA_SAMPLES] = ms;
+	r->down_until = 0;
+}
+
+
+/*
+ * Milliseconds after which a call to a replica is hedged (the
+ * pgtokdb.hedge_percentile of its recent response times), or -1 when it
+ * isn't
+ */
+double kreplica_hedge_ms(KReplica *r)
+{
+	double sorted[KREPLICA_SAMPLES];
+	int n = (int) Min(r->calls, KREPLICA_SAMPLES);
+
+	if (kreplica_hedge <= 0 || n < KREPLICA_MIN_SAMPLES)
+		return -1;
+
+	memcpy(sorted, r->samples, n * sizeof(double));
+	for (int i = 1; i < n; i++)
+	{
+		double v = sorted[i];
+		int j = i - 1;
+		for (; j >= 0 && sorted[j] > v; j--)
+			sorted[j + 1] = sorted[j];
+		sorted[j + 1] = v;
+	}
+
+	int k = (int) ceil(kreplica_hedge / 100.0 * n) - 1;
+	return sorted[Max(0, Min(k, n - 1))];
+}
@@ -0,0 +1,402 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sharded fan-out. getshards sends the same call to every kdb+ process listed
+ * in pgtokdb.shards at once (asynchronously), then collects the replies as
+ * they arrive, so the call takes about as long as the slowest shard. The
+ * results are appended in the order the shards finish, or merged on the
+ * column named by pgtokdb.shard_key when each shard returns its rows sorted.
+ */
+
+#include "pgtokdb.h"
+#include <errno.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <nodes/execnodes.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+/*
+ * Evaluated asynchronously by each shard, which sends back the projected
+ * result, or (`pgtokdb_error;message) if the call fails
+ */
+#define SHARD_LAMBDA "{[c;x] neg[.z.w] @[{[c;x] r:value x; $[98h=type r; (c inter cols r)#r; r]}[c]; x; {(`pgtokdb_error;x)}]}"
+
+#define SHARD_MAX 64
+
+/* Rows merged between resets of the conversion memory */
+#define SHARD_BATCH 1024
+
+/* A kdb+ process taking part in a sharded call */
+typedef struct
+{
+	char	host[256];		/* Host name or IP address */
+	int		port;			/* TCP/IP port */
+	I		handle;			/* Cached connection (0 until opened) */
+	bool	done;			/* Reply has been read */
+	K		table;			/* Result kept for merging */
+} Shard;
+
+/* Configuration globals */
+static char *shards = NULL;
+static char *shard_key = NULL;
+
+/* Prototypes */
+int		shard_parse(Shard *);
+int		shard_wait(Shard *, int, instr_time);
+void	shard_check(Shard *, K);
+int		shard_cmp(K, J, K, J);
+void	shard_merge(Tuplestorestate *, TupleDesc, Shard *, int, MemoryContext);
+
+
+/*
+ * Define the configuration settings used by sharded calls
+ */
+void shard_init(void)
+{
+	DefineCustomStringVariable("pgtokdb.shards",
+		"Comma-separated host:port list of the kdb+ processes queried by getshards.",
+		NULL, &shards, "", PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgtokdb.shard_key",
+		"Column on which the sorted results of the shards are merged.",
+		"Empty appends the results in the order the shards finish.",
+		&shard_key, "", PGC_USERSET, 0, NULL, NULL, NULL);
+}
+
+
+/*
+ * Split pgtokdb.shards into its endpoints and return their number
+ */
+int shard_parse(Shard *sh)
+{
+	int n = 0;
+	char *list = pstrdup(shards);
+
+	for (char *tok = strtok(list, ", "); tok != NULL; tok = strtok(NULL, ", "))
+	{
+		char *colon = strrchr(tok, ':');
+		if (colon == NULL || colon == tok || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535)
+			elog(ERROR, "Invalid kdb+ shard \"%s\" in pgtokdb.shards (expected host:port)", tok);
+		if (n == SHARD_MAX)
+			elog(ERROR, "The number of kdb+ shards exceeds %d", SHARD_MAX);
+
+		*colon = '\0';
+		safecpy(sh[n].host, tok, sizeof(sh[n].host));
+		sh[n].port = atoi(colon + 1);
+
+		for (int i = 0; i < n; i++)
+			if (sh[i].port == sh[n].port && strcmp(sh[i].host, sh[n].host) == 0)
+				elog(ERROR, "kdb+ shard %s:%d is listed more than once", sh[n].host, sh[n].port);
+		n++;
+	}
+
+	if (n == 0)
+		elog(ERROR, "No kdb+ shards are listed in pgtokdb.shards");
+
+	pfree(list);
+	return n;
+}
+
+
+/*
+ * Wait until the reply of one of the shards can be read, and return it. A
+ * cancel request and pgtokdb.query_timeout (counted from start) are checked
+ * meanwhile.
+ */
+int shard_wait(Shard *sh, int nshards, instr_time start)
+{
+	struct pollfd pfd[SHARD_MAX];
+	int map[SHARD_MAX];
+
+	for (;;)
+	{
+		int npending = 0;
+		for (int i = 0; i < nshards; i++)
+		{
+			if (sh[i].done)
+				continue;
+			pfd[npending].fd = sh[i].handle;
+			pfd[npending].events = POLLIN;
+			pfd[npending].revents = 0;
+			map[npending++] = i;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* The slowest shard is the first one still pending */
+		if (kconn_query_timeout > 0)
+		{
+			instr_time elapsed;
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, start);
+			if (INSTR_TIME_GET_MILLISEC(elapsed) >= kconn_query_timeout)
+				kconn_timeout(sh[map[0]].host, sh[map[0]].port);
+		}
+
+		/* Wake up regularly to check for a cancel request and the timeout */
+		if (poll(pfd, npending, 100) < 0 && errno != EINTR)
+			elog(ERROR, "Error waiting for kdb+ shards: %m");
+
+		for (int j = 0; j < npending; j++)
+			if (pfd[j].revents != 0)
+				return map[j];
+	}
+}
+
+
+/*
+ * Ensure the reply of a shard is an unkeyed table. Errors name the shard.
+ */
+void shard_check(Shard *s, K r)
+{
+	if (r == NULL)
+		elog(ERROR, "Network error communicating with kdb+ at %s:%d", s->host, s->port);
+
+	if (r->t == 0 && r->n == 2 && kK(r)[0]->t == -KS &&
+		strcmp(kK(r)[0]->s, "pgtokdb_error") == 0 && kK(r)[1]->t == KC)
+	{
+		char *msg = pnstrdup((char *) kC(kK(r)[1]), kK(r)[1]->n);
+		r0(r);
+		elog(ERROR, "kdb: %s (at %s:%d)", msg, s->host, s->port);
+	}
+
+	if (r->t != XT)
+	{
+		r0(r);
+		elog(ERROR, "Result from kdb+ at %s:%d must be unkeyed table", s->host, s->port);
+	}
+}
+
+
+#define CMP(x, y) (((x) > (y)) - ((x) < (y)))
+
+/*
+ * Compare row i of kdb+ column a with row j of column b (of the same type)
+ */
+int shard_cmp(K a, J i, K b, J j)
+{
+	switch (a->t)
+	{
+		case KB: case KG: return CMP(kG(a)[i], kG(b)[j]);
+		case KC: return CMP((unsigned char) kC(a)[i], (unsigned char) kC(b)[j]);
+		case KH: return CMP(kH(a)[i], kH(b)[j]);
+		case KI: case KD: case KM: case KU: case KV: case KT: return CMP(kI(a)[i], kI(b)[j]);
+		case KJ: case KP: case KN: return CMP(kJ(a)[i], kJ(b)[j]);
+		case KE: return CMP(kE(a)[i], kE(b)[j]);
+		case KF: case KZ: return CMP(kF(a)[i], kF(b)[j]);
+		case KS: return strcmp(kS(a)[i], kS(b)[j]);
+		default: elog(ERROR, "Unsupported type of merge key column \"%s\"", shard_key);
+	}
+	return 0;
+}
+
+
+/*
+ * Merge the (sorted) results of the shards on the key column into the
+ * tuplestore. Rows with equal keys are taken in shard order.
+ */
+void shard_merge(Tuplestorestate *tupstore, TupleDesc tupdesc, Shard *sh, int nshards,
+	MemoryContext batchctx)
+{
+	int natts = tupdesc->natts;
+	int **perm = (int **) palloc(nshards * sizeof(int *));
+	K2PCOL **kernels = (K2PCOL **) palloc(nshards * sizeof(K2PCOL *));
+	K *keys = (K *) palloc(nshards * sizeof(K));
+	J *pos = (J *) palloc0(nshards * sizeof(J));
+	J *nrows = (J *) palloc(nshards * sizeof(J));
+	int *todtind = (int *) palloc(natts * sizeof(int));
+	Datum *dvalues = (Datum *) palloc(natts * sizeof(Datum));
+	bool *nulls = (bool *) palloc0(natts * sizeof(bool)); /* We don't support nulls */
+
+	/* The columns of each result can come in a different order */
+	for (int s = 0; s < nshards; s++)
+	{
+		K table = sh[s].table;
+		K colnames = kK(table->k)[0];
+		K values = kK(table->k)[1];
+
+		perm[s] = (int *) palloc(natts * sizeof(int));
+		kernels[s] = (K2PCOL *) palloc(natts * sizeof(K2PCOL));
+		getset_plan(tupdesc, table, perm[s], todtind);
+		getset_kernels(tupdesc, table, perm[s], kernels[s]);
+
+		int k = findName(shard_key, colnames);
+		if (k == -1)
+			elog(ERROR, "Unable to match merge key column \"%s\" in result from kdb+ at %s:%d",
+				shard_key, sh[s].host, sh[s].port);
+		keys[s] = kK(values)[k];
+		if (keys[s]->t != keys[0]->t)
+			elog(ERROR, "Merge key column \"%s\" has a different type in result from kdb+ at %s:%d",
+				shard_key, sh[s].host, sh[s].port);
+		nrows[s] = kK(values)[0]->n;
+	}
+
+	KSymCache *symbols = ksym_create(CurrentMemoryContext);
+	MemoryContext oldcontext = MemoryContextSwitchTo(batchctx);
+	ksym_use(symbols);
+
+	for (J emitted = 1; ; emitted++)
+	{
+		/* Pick the shard with the smallest key at its current row */
+		int best = -1;
+		for (int s = 0; s < nshards; s++)
+			if (pos[s] < nrows[s] &&
+				(best == -1 || shard_cmp(keys[s], pos[s], keys[best], pos[best]) < 0))
+				best = s;
+		if (best == -1)
+			break;
+
+		K colnames = kK(sh[best].table->k)[0];
+		K values = kK(sh[best].table->k)[1];
+		for (int i = 0; i < natts; i++)
+			kernels[best][i](kK(values)[perm[best][i]], pos[best], 1, &dvalues[i],
+				kS(colnames)[perm[best][i]]);
+		tuplestore_putvalues(tupstore, tupdesc, dvalues, nulls);
+		pos[best]++;
+
+		if (emitted % SHARD_BATCH == 0)
+		{
+			CHECK_FOR_INTERRUPTS();
+			MemoryContextReset(batchctx);
+		}
+	}
+
+	ksym_use(NULL);
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(batchctx);
+	ksym_free(symbols);
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(getshards);
+
+/*
+ * Like getset, but calls every kdb+ process in pgtokdb.shards concurrently
+ * and returns the union of their results
+ */
+PGDLLEXPORT Datum getshards(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "Function must be called in a context that accepts a set");
+
+	TupleDesc tupdesc;
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	Tuplestorestate *tupstore = tuplestore_begin_heap(
+		(rsinfo->allowedModes & SFRM_Materialize_Random) != 0, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	Shard *sh = (Shard *) palloc0(SHARD_MAX * sizeof(Shard));
+	int nshards = shard_parse(sh);
+	bool merge = shard_key[0] != '\0';
+	const char *userpass = GetConfigOption("pgtokdb.userpass", false, false);
+
+	/* Connect to all shards before sending anything */
+	for (int i = 0; i < nshards; i++)
+		sh[i].handle = kconn_open(sh[i].host, sh[i].port, userpass);
+
+	/* Same call for every shard */
+	K cols = getset_cols(tupdesc);
+	K x = getset_expr(text_to_cstring(PG_GETARG_VARCHAR_PP(0)), getset_args(fcinfo));
+
+	instr_time start;
+	INSTR_TIME_SET_CURRENT(start);
+
+	for (int i = 0; i < nshards; i++)
+	{
+		r1(cols); /* k() releases its arguments */
+		r1(x);
+		k(-sh[i].handle, SHARD_LAMBDA, cols, x, (K) 0);
+	}
+	r0(cols);
+	r0(x);
+
+	int natts = tupdesc->natts;
+	int *perm = (int *) palloc(natts * sizeof(int));
+	int *todtind = (int *) palloc(natts * sizeof(int));
+	K2PCOL *kernels = (K2PCOL *) palloc(natts * sizeof(K2PCOL));
+	MemoryContext batchctx = AllocSetContextCreate(CurrentMemoryContext,
+		"pgtokdb shard batch", ALLOCSET_DEFAULT_SIZES);
+
+	PG_TRY();
+	{
+		/* Take each reply as soon as it arrives */
+		for (int left = nshards; left > 0; left--)
+		{
+			int i = shard_wait(sh, nshards, start);
+			K r = kconn_receive(sh[i].handle, sh[i].host, sh[i].port, start);
+
+			sh[i].done = true;
+			if (r == NULL)
+				kconn_discard(sh[i].handle);
+			shard_check(&sh[i], r);
+
+			if (merge)
+				sh[i].table = r;
+			else
+			{
+				sh[i].table = r;
+				getset_plan(tupdesc, r, perm, todtind);
+				getset_kernels(tupdesc, r, perm, kernels);
+				getset_store(tupstore, tupdesc, r, perm, kernels, batchctx, NULL);
+				sh[i].table = NULL;
+				r0(r);
+			}
+		}
+
+		if (merge)
+			shard_merge(tupstore, tupdesc, sh, nshards, batchctx);
+	}
+	PG_CATCH();
+	{
+		/* A connection with a reply still on its way can't be reused */
+		for (int i = 0; i < nshards; i++)
+		{
+			if (!sh[i].done)
+				kconn_discard(sh[i].handle);
+			if (sh[i].table != NULL)
+				r0(sh[i].table);
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (int i = 0; i < nshards; i++)
+		if (sh[i].table != NULL)
+			r0(sh[i].table);
+	MemoryContextDelete(batchctx);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
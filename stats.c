@@ -0,0 +1,395 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Statistics of getset calls, aggregated in shared memory per function and
+ * expression (see the pgtokdb.stat_statements view). The time of each call
+ * is split into phases: opening connections, waiting for kdb+ (execution,
+ * transfer and decoding of the IPC message), converting kdb+ values, and
+ * forming tuples. Phases are timed per call or per batch of rows, and an
+ * entry is only locked (by its spinlock) once per call.
+ *
+ * Like the result cache, the statistics need the library to be loaded
+ * through shared_preload_libraries.
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <storage/spin.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#if PG_VERSION_NUM >= 130000
+#include <common/hashfn.h>
+#else
+#include <access/hash.h>
+#endif
+
+/* Length kept of an expression (including the terminating null) */
+#define KSTAT_EXPR_LEN 256
+
+/* Hash table key */
+typedef struct
+{
+	Oid			fnoid;		/* Function called */
+	uint64		exprhash;	/* Hash of its kdb+ expression */
+} KStatKey;
+
+/* Statistics of a function and expression */
+typedef struct
+{
+	KStatKey	key;
+	slock_t		mutex;		/* Protects the counters */
+	char		expr[KSTAT_EXPR_LEN];
+	int64		calls;
+	int64		rows;
+	int64		bytes;
+	double		total[KSTAT_PHASES];	/* Milliseconds spent in each phase */
+	double		max[KSTAT_PHASES];		/* Most spent by a call */
+} KStatEntry;
+
+/* Configuration globals */
+static bool kstat_track = true;
+static int kstat_max = 1000;
+
+/* Shared state, as attached by this backend */
+static LWLock *kstat_lock = NULL;
+static HTAB *kstat_htab = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* Prototypes */
+void	kstat_shmem_request(void);
+void	kstat_shmem_startup(void);
+KStatEntry *kstat_enter(KStatKey *, const char *);
+
+
+/*
+ * Define the configuration settings of the statistics, and reserve their
+ * shared memory when loaded through shared_preload_libraries
+ */
+void kstat_init(void)
+{
+	DefineCustomBoolVariable("pgtokdb.track",
+		"Collect the statistics shown by pgtokdb.stat_statements.",
+		NULL, &kstat_track, true, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.stat_max",
+		"Number of functions and expressions tracked by pgtokdb.stat_statements.",
+		NULL, &kstat_max, 1000, 100, INT_MAX / 2,
+		PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = kstat_shmem_request;
+#else
+	kstat_shmem_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = kstat_shmem_startup;
+}
+
+
+/*
+ * Request the shared memory and the lock of the statistics
+ */
+void kstat_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(hash_estimate_size(kstat_max, sizeof(KStatEntry)));
+	RequestNamedLWLockTranche("pgtokdb_stats", 1);
+}
+
+
+/*
+ * Set up (or attach to) the hash table of the statistics
+ */
+void kstat_shmem_startup(void)
+{
+	HASHCTL info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	kstat_lock = &(GetNamedLWLockTranche("pgtokdb_stats"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(KStatKey);
+	info.entrysize = sizeof(KStatEntry);
+	kstat_htab = ShmemInitHash("pgtokdb stat_statements",
+		kstat_max, kstat_max, &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Start timing a call of a function (s is left unused when statistics are
+ * not collected)
+ */
+void kstat_start(KStatCall *s, FunctionCallInfo fcinfo)
+{
+	memset(s, 0, sizeof(KStatCall));
+	if (!kstat_track || kstat_htab == NULL)
+		return;
+
+	s->active = true;
+	s->fnoid = fcinfo->flinfo->fn_oid;
+	s->expr = text_to_cstring(PG_GETARG_VARCHAR_PP(0));
+}
+
+
+/*
+ * Mark the start of a request to kdb+
+ */
+void kstat_begin(KStatCall *s)
+{
+	if (!s->active)
+		return;
+
+	INSTR_TIME_SET_CURRENT(s->mark);
+	s->connmark = kconn_connect_ms;
+	s->bytesmark = kconn_bytes;
+}
+
+
+/*
+ * Account for a request to kdb+ that began with kstat_begin: the time spent
+ * opening connections meanwhile, the rest of the time spent waiting for
+ * kdb+, and the size of the responses received (from their IPC headers)
+ */
+void kstat_kdb(KStatCall *s)
+{
+	if (!s->active)
+		return;
+
+	double connect = kconn_connect_ms - s->connmark;
+	s->ms[KSTAT_CONNECT] += connect;
+	s->ms[KSTAT_KDB] += kstat_lap(s) - connect;
+	s->bytes += kconn_bytes - s->bytesmark;
+}
+
+
+/*
+ * Milliseconds since the last mark, moving the mark to now
+ */
+double kstat_lap(KStatCall *s)
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	instr_time elapsed = now;
+	INSTR_TIME_SUBTRACT(elapsed, s->mark);
+	s->mark = now;
+
+	return INSTR_TIME_GET_MILLISEC(elapsed);
+}
+
+
+/*
+ * Find (or add) the entry of a function and expression. When the table is
+ * full, the entry with the fewest calls is dropped to make room.
+ */
+KStatEntry *kstat_enter(KStatKey *key, const char *expr)
+{
+	bool found;
+
+	LWLockAcquire(kstat_lock, LW_EXCLUSIVE);
+
+	KStatEntry *e = (KStatEntry *) hash_search(kstat_htab, key, HASH_FIND, NULL);
+	if (e == NULL)
+	{
+		if (hash_get_num_entries(kstat_htab) >= kstat_max)
+		{
+			HASH_SEQ_STATUS status;
+			KStatEntry *p;
+			KStatEntry *victim = NULL;
+
+			hash_seq_init(&status, kstat_htab);
+			while ((p = (KStatEntry *) hash_seq_search(&status)) != NULL)
+				if (victim == NULL || p->calls < victim->calls)
+					victim = p;
+			hash_search(kstat_htab, &victim->key, HASH_REMOVE, NULL);
+		}
+
+		e = (KStatEntry *) hash_search(kstat_htab, key, HASH_ENTER, &found);
+		SpinLockInit(&e->mutex);
+		safecpy(e->expr, expr, sizeof(e->expr));
+		e->calls = e->rows = e->bytes = 0;
+		memset(e->total, 0, sizeof(e->total));
+		memset(e->max, 0, sizeof(e->max));
+	}
+
+	/* Entries are only removed under an exclusive lock */
+	LWLockRelease(kstat_lock);
+	LWLockAcquire(kstat_lock, LW_SHARED);
+
+	return (KStatEntry *) hash_search(kstat_htab, key, HASH_FIND, NULL);
+}
+
+
+/*
+ * Add a finished call to the statistics of its function and expression
+ */
+void kstat_record(KStatCall *s)
+{
+	KStatKey key;
+
+	if (!s->active)
+		return;
+	s->active = false;
+
+	memset(&key, 0, sizeof(key)); /* Padding is part of the key */
+	key.fnoid = s->fnoid;
+	key.exprhash = DatumGetUInt64(hash_any_extended((unsigned char *) s->expr,
+		strlen(s->expr), 0));
+
+	LWLockAcquire(kstat_lock, LW_SHARED);
+
+	KStatEntry *e = (KStatEntry *) hash_search(kstat_htab, &key, HASH_FIND, NULL);
+	if (e == NULL)
+	{
+		LWLockRelease(kstat_lock);
+		e = kstat_enter(&key, s->expr);
+	}
+
+	/* A concurrent reset can remove the entry again */
+	if (e != NULL)
+	{
+		SpinLockAcquire(&e->mutex);
+		e->calls++;
+		e->rows += s->rows;
+		e->bytes += s->bytes;
+		for (int i = 0; i < KSTAT_PHASES; i++)
+		{
+			e->total[i] += s->ms[i];
+			if (s->ms[i] > e->max[i])
+				e->max[i] = s->ms[i];
+		}
+		SpinLockRelease(&e->mutex);
+	}
+
+	LWLockRelease(kstat_lock);
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(stat_statements);
+
+/*
+ * Report the statistics of each function and expression
+ */
+PGDLLEXPORT Datum stat_statements(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "Function must be called in a context that accepts a set");
+
+	TupleDesc tupdesc;
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	Tuplestorestate *tupstore = tuplestore_begin_heap(false, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	/* Nothing is collected unless the library is preloaded */
+	if (kstat_htab == NULL)
+		return (Datum) 0;
+
+	HASH_SEQ_STATUS status;
+	KStatEntry *e;
+
+	LWLockAcquire(kstat_lock, LW_SHARED);
+
+	hash_seq_init(&status, kstat_htab);
+	while ((e = (KStatEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[5 + 2 * KSTAT_PHASES];
+		bool nulls[5 + 2 * KSTAT_PHASES] = { false };
+		KStatEntry copy;
+
+		SpinLockAcquire(&e->mutex);
+		copy = *e;
+		SpinLockRelease(&e->mutex);
+
+		values[0] = ObjectIdGetDatum(copy.key.fnoid);
+		values[1] = PointerGetDatum(cstring_to_text(copy.expr));
+		values[2] = Int64GetDatum(copy.calls);
+		values[3] = Int64GetDatum(copy.rows);
+		values[4] = Int64GetDatum(copy.bytes);
+		for (int i = 0; i < KSTAT_PHASES; i++)
+		{
+			values[5 + 2 * i] = Float8GetDatum(copy.total[i]);
+			values[6 + 2 * i] = Float8GetDatum(copy.max[i]);
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(kstat_lock);
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(stat_statements_reset);
+
+/*
+ * Discard all statistics
+ */
+PGDLLEXPORT Datum stat_statements_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	KStatEntry *e;
+
+	if (kstat_htab == NULL)
+		PG_RETURN_VOID();
+
+	LWLockAcquire(kstat_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, kstat_htab);
+	while ((e = (KStatEntry *) hash_seq_search(&status)) != NULL)
+		hash_search(kstat_htab, &e->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(kstat_lock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,364 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Planner support for getset functions (attached with SUPPORT
+ * pgtokdb.getset_support). Without it the planner assumes a set returning
+ * function returns its ROWS (1000 by default) at a cost of almost nothing.
+ * Here the rows come from asking kdb+ through the q function named by
+ * pgtokdb.row_probe, when the call's arguments are constants, and otherwise
+ * from the function's ROWS (which genddl sets from a sample result). Probe
+ * results, and failures, are remembered by the backend for
+ * pgtokdb.row_probe_ttl seconds. A probe runs in a subtransaction, so that
+ * its failure doesn't fail the planning of the query, but a cancel request,
+ * statement_timeout and pgtokdb.query_timeout do. The cost is a round trip to
+ * kdb+ plus the conversion of each row.
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <miscadmin.h>
+#include <access/htup_details.h>
+#include <access/xact.h>
+#include <catalog/pg_proc.h>
+#include <nodes/nodeFuncs.h>
+#include <nodes/supportnodes.h>
+#include <optimizer/cost.h>
+#include <optimizer/optimizer.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/lsyscache.h>
+#include <utils/resowner.h>
+#include <utils/syscache.h>
+#if PG_VERSION_NUM >= 130000
+#include <common/hashfn.h>
+#else
+#include <access/hash.h>
+#endif
+
+/* Cost of a round trip to kdb+ and per row converted (as for foreign tables) */
+#define KSUPPORT_STARTUP_COST	100.0
+#define KSUPPORT_TUPLE_COST		0.01
+
+/* A remembered probe result */
+typedef struct
+{
+	uint64		hash;		/* Hash of the probe, connection and call (key) */
+	double		rows;		/* Rows kdb+ reported (-1 if the probe failed) */
+	TimestampTz	when;		/* When the probe was made */
+} KProbeEntry;
+
+/* Configuration globals */
+static char *row_probe = NULL;
+static int row_probe_ttl = 300;
+
+/* Probe results of this backend, pruned of expired ones when it reaches kprobe_prune_at */
+static HTAB *kprobe_htab = NULL;
+static long kprobe_prune_at = 256;
+
+/* Prototypes */
+const char *ksupport_setting(HeapTuple, const char *);
+K		ksupport_call(List *);
+void	ksupport_prune(TimestampTz);
+double	ksupport_ask(const char *, int, const char *, const char *, K);
+double	ksupport_probe(Oid, List *);
+double	ksupport_rows(Oid, Node *);
+
+
+/*
+ * Define the configuration settings used by the planner support function
+ */
+void ksupport_init(void)
+{
+	DefineCustomStringVariable("pgtokdb.row_probe",
+		"q function that kdb+ applies to a call to estimate its rows for the planner.",
+		"Applied to the expression, or the function and its arguments, of calls "
+		"whose arguments are constants, e.g. {count value x}. Empty disables probes.",
+		&row_probe, "", PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.row_probe_ttl",
+		"Seconds a row estimate obtained from kdb+ is reused.",
+		NULL, &row_probe_ttl, 300, 0, INT_MAX, PGC_USERSET, GUC_UNIT_S, NULL, NULL, NULL);
+}
+
+
+/*
+ * Value of a setting for a function: the one it was created with (SET
+ * clauses only take effect when it is executed, not when it is planned), or
+ * the session's
+ */
+const char *ksupport_setting(HeapTuple proctup, const char *name)
+{
+	bool isnull;
+	Datum config = SysCacheGetAttr(PROCOID, proctup, Anum_pg_proc_proconfig, &isnull);
+	size_t len = strlen(name);
+
+	if (!isnull)
+	{
+		Datum *items;
+		int nitems;
+
+		deconstruct_array(DatumGetArrayTypeP(config), TEXTOID, -1, false, 'i',
+			&items, NULL, &nitems);
+
+		for (int i = 0; i < nitems; i++)
+		{
+			char *item = TextDatumGetCString(items[i]);
+			if (pg_strncasecmp(item, name, len) == 0 && item[len] == '=')
+				return item + len + 1;
+		}
+	}
+
+	return GetConfigOption(name, false, false);
+}
+
+
+/*
+ * The call of a function as a kdb+ object (see getset_expr), or NULL when
+ * its arguments are not all constants of supported types
+ */
+K ksupport_call(List *fargs)
+{
+	ListCell *lc;
+	K args = knk(0);
+	S ef = NULL;
+
+	foreach(lc, fargs)
+	{
+		Const *c = (Const *) lfirst(lc);
+		int ind;
+
+		if (!IsA(c, Const) || c->constisnull)
+			break;
+
+		if (ef == NULL)
+		{
+			if (c->consttype != VARCHAROID && c->consttype != TEXTOID)
+				break;
+			ef = TextDatumGetCString(c->constvalue);
+			continue;
+		}
+
+		if ((ind = findOID(c->consttype)) == -1)
+			break;
+		jk(&args, (todt[ind].p2k)(c->constvalue));
+	}
+
+	if (ef == NULL || lc != NULL)
+	{
+		r0(args);
+		return NULL;
+	}
+
+	return getset_expr(ef, args);
+}
+
+
+/*
+ * Remove the expired probe results, so that the table doesn't grow with
+ * every distinct call planned
+ */
+void ksupport_prune(TimestampTz now)
+{
+	HASH_SEQ_STATUS status;
+	KProbeEntry *e;
+
+	hash_seq_init(&status, kprobe_htab);
+	while ((e = (KProbeEntry *) hash_seq_search(&status)) != NULL)
+		if (TimestampDifferenceExceeds(e->when, now, row_probe_ttl * 1000))
+			hash_search(kprobe_htab, &e->hash, HASH_REMOVE, NULL);
+
+	kprobe_prune_at = Max(256, 2 * hash_get_num_entries(kprobe_htab));
+}
+
+
+/*
+ * Ask kdb+ to apply probe to the call x (consumed), in a subtransaction.
+ * Returns the rows reported, or -1 when the probe fails. A cancel request,
+ * statement_timeout or pgtokdb.query_timeout is raised again.
+ */
+double ksupport_ask(const char *host, int port, const char *userpass, const char *probe, K x)
+{
+	MemoryContext mcxt = CurrentMemoryContext;
+	ResourceOwner owner = CurrentResourceOwner;
+	volatile double rows = -1;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(mcxt);
+
+	PG_TRY();
+	{
+		K r = kconn_call(host, port, userpass, (S) probe, knk(1, x));
+		if (r != NULL)
+		{
+			switch (r->t)
+			{
+				case -KH: rows = r->h; break;
+				case -KI: rows = r->i; break;
+				case -KJ: rows = r->j; break;
+				case -KE: rows = r->e; break;
+				case -KF: rows = r->f; break;
+			}
+			if (-128 == r->t)
+				elog(DEBUG1, "pgtokdb.row_probe failed on kdb+: %s", r->s);
+			r0(r);
+		}
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(mcxt);
+		CurrentResourceOwner = owner;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(mcxt);
+		ErrorData *err = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(mcxt);
+		CurrentResourceOwner = owner;
+
+		if (err->sqlerrcode == ERRCODE_QUERY_CANCELED || err->sqlerrcode == ERRCODE_KDB_QUERY_TIMEOUT)
+			ReThrowError(err);
+
+		elog(DEBUG1, "pgtokdb.row_probe failed: %s", err->message);
+		FreeErrorData(err);
+		rows = -1;
+	}
+	PG_END_TRY();
+
+	return rows;
+}
+
+
+/*
+ * Number of rows kdb+ estimates a call to return, or -1 when there is no
+ * (usable) estimate. A failing probe doesn't fail the planning of the query.
+ */
+double ksupport_probe(Oid funcid, List *fargs)
+{
+	HeapTuple proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(proctup))
+		return -1;
+
+	char *probe = pstrdup(ksupport_setting(proctup, "pgtokdb.row_probe"));
+	char *host = pstrdup(ksupport_setting(proctup, "pgtokdb.host"));
+	int port = atoi(ksupport_setting(proctup, "pgtokdb.port"));
+	char *userpass = pstrdup(ksupport_setting(proctup, "pgtokdb.userpass"));
+	ReleaseSysCache(proctup);
+
+	/* Subtransactions can't be started in parallel mode */
+	K x;
+	if (probe[0] == '\0' || IsInParallelMode() || (x = ksupport_call(fargs)) == NULL)
+		return -1;
+
+	/* The estimate depends on the probe, the kdb+ process and the call */
+	K call = knk(4, kp(probe), kp(host), ki(port), r1(x));
+	K bytes = b9(2, call);
+	r0(call);
+	uint64 hash = DatumGetUInt64(hash_any_extended((unsigned char *) kG(bytes), bytes->n, 0));
+	r0(bytes);
+
+	if (kprobe_htab == NULL)
+	{
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(uint64);
+		info.entrysize = sizeof(KProbeEntry);
+		kprobe_htab = hash_create("pgtokdb row probes", 64, &info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	TimestampTz now = GetCurrentTimestamp();
+	KProbeEntry *e = (KProbeEntry *) hash_search(kprobe_htab, &hash, HASH_FIND, NULL);
+	if (e != NULL && !TimestampDifferenceExceeds(e->when, now, row_probe_ttl * 1000))
+	{
+		r0(x);
+		return e->rows;
+	}
+
+	/* A cancelled probe is not remembered */
+	double rows = ksupport_ask(host, port, userpass, probe, x);
+
+	/* NaN and negative (e.g. null) counts are no estimate either */
+	if (!(rows >= 0))
+		rows = -1;
+
+	if (hash_get_num_entries(kprobe_htab) >= kprobe_prune_at)
+		ksupport_prune(now);
+
+	e = (KProbeEntry *) hash_search(kprobe_htab, &hash, HASH_ENTER, NULL);
+	e->rows = rows;
+	e->when = now;
+
+	return rows;
+}
+
+
+/*
+ * Estimated rows of a call (node may be NULL when only the function is known)
+ */
+double ksupport_rows(Oid funcid, Node *node)
+{
+	if (node != NULL && IsA(node, FuncExpr))
+	{
+		double rows = ksupport_probe(funcid, ((FuncExpr *) node)->args);
+		if (rows >= 0)
+			return clamp_row_est(rows);
+	}
+
+	return -1;
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(getset_support);
+
+/*
+ * Planner support function of getset functions
+ */
+PGDLLEXPORT Datum getset_support(PG_FUNCTION_ARGS)
+{
+	Node *req = (Node *) PG_GETARG_POINTER(0);
+
+	if (IsA(req, SupportRequestRows))
+	{
+		SupportRequestRows *r = (SupportRequestRows *) req;
+		double rows = ksupport_rows(r->funcid, r->node);
+
+		/* Leave the function's ROWS to the planner when kdb+ isn't asked */
+		if (rows < 0)
+			PG_RETURN_POINTER(NULL);
+
+		r->rows = rows;
+		PG_RETURN_POINTER(r);
+	}
+
+	if (IsA(req, SupportRequestCost))
+	{
+		SupportRequestCost *c = (SupportRequestCost *) req;
+		double rows = ksupport_rows(c->funcid, c->node);
+
+		if (rows < 0)
+			rows = get_func_rows(c->funcid);
+
+		/* The whole result is fetched and converted by each call */
+		c->startup = KSUPPORT_STARTUP_COST;
+		c->per_tuple = rows * (cpu_operator_cost + KSUPPORT_TUPLE_COST);
+		PG_RETURN_POINTER(c);
+	}
+
+	PG_RETURN_POINTER(NULL);
+}
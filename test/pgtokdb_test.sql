@@ -267,6 +267,248 @@ create function test44(varchar, integer) returns setof test44_t as 'pgtokdb', 'g
 select count(*) from test44('test44', 1000000);
 \timing off
 
+\echo ** Test45: Materializing 1 million rows across many conversion batches
+create type test45_t as (j bigint, f double precision, s varchar);
+create function test45(varchar, integer) returns setof test45_t as 'pgtokdb', 'getset' language c;
+\timing on
+select count(*), sum(j), count(distinct s) from test45('test45', 1000000);
+\timing off
+
+\echo ** Test46: Cached kdb+ connection is reused across calls
+create type test46_t as (host varchar, port integer, handle integer, uses bigint, 
+	created timestamptz, lastused timestamptz);
+create function test46() returns setof test46_t as 'pgtokdb', 'connections' language c;
+select count(*) from test01('test01', 1);
+select count(*) from test01('test01', 2);
+select count(*) = 1 as onehandle, max(uses) >= 2 as reused from test46();
+
+\echo ** Test47: Foreign table with filter, projection, aggregate, order and limit pushdown
+create function test47_handler() returns fdw_handler as 'pgtokdb', 'fdw_handler' language c;
+create function test47_validator(text[], oid) returns void as 'pgtokdb', 'fdw_validator' language c;
+create foreign data wrapper test47_fdw handler test47_handler validator test47_validator;
+create server test47_srv foreign data wrapper test47_fdw options (host 'localhost', port '5000');
+create foreign table test47 (j bigint, f double precision, s varchar, p timestamp) 
+	server test47_srv options (table 'test47tbl', rows '1000');
+explain (verbose, costs off) select j, s from test47 where j >= 10 and s = 'b';
+select j, s from test47 where j >= 10 and s = 'b' order by j limit 3;
+explain (verbose, costs off) select s, sum(j), count(*), avg(f) from test47 where j < 100 group by s;
+select s, sum(j), count(*), avg(f) from test47 where j < 100 group by s order by s;
+explain (verbose, costs off) select j, p from test47 where j in (1, 5, 9) order by j desc limit 2;
+select j, p from test47 where j in (1, 5, 9) order by j desc limit 2;
+select count(*) from test47;
+
+\echo ** Test48: Only the needed columns of a wide kdb+ table are returned
+create type test48_t as (c7 bigint, c33 double precision);
+create function test48(varchar, integer) returns setof test48_t as 'pgtokdb', 'getset' language c;
+select * from test48('test48', 3);
+set pgtokdb.project = off;
+select * from test48('test48', 3);
+reset pgtokdb.project;
+
+\echo ** Test49: Streaming a result from a kdb+ cursor in chunks
+create type test49_t as (j bigint, s varchar);
+create function test49(varchar, integer) returns setof test49_t as 'pgtokdb', 'getset' language c;
+set pgtokdb.chunk_rows = 1000;
+select count(*), sum(j), count(distinct s) from test49('test49', 10500);
+select count(*), sum(j) from test49('test49', 3000);
+select test49('test49', 1000000) limit 3;
+select count(*) from (select g, test49('test49', 2500) from generate_series(1, 3) g) t;
+select j, s from test47 where j >= 990;
+select count(*) from test47;
+reset pgtokdb.chunk_rows;
+
+\echo ** Test50: Long double precision[] and bigint[] vectors, including empty ones
+create type test50_t as (ff double precision[], jj bigint[]);
+create function test50(varchar, integer) returns setof test50_t as 'pgtokdb', 'getset' language c;
+select cardinality(ff), ff[1], ff[cardinality(ff)], cardinality(jj), jj[cardinality(jj)] 
+	from test50('test50', 4096);
+
+\echo ** Test51: Sharded call to two kdb+ connections, appended and merged on a key
+create type test51_t as (j bigint, s varchar);
+create function test51(varchar, integer) returns setof test51_t as 'pgtokdb', 'getshards' language c
+	set pgtokdb.shards = 'localhost:5000,127.0.0.1:5000';
+select count(*), sum(j) from test51('test51', 1000);
+alter function test51 set pgtokdb.shard_key = 'j';
+select * from test51('test51', 3);
+
+\echo ** Test52: Sharded call names the kdb+ process that failed
+create function test52(varchar) returns setof test51_t as 'pgtokdb', 'getshards' language c
+	set pgtokdb.shards = 'localhost:5000,127.0.0.1:5000';
+select * from test52('''fail');
+
+\echo ** Test53: Foreign table scanned by parallel workers claiming slices of a kdb+ cursor
+set pgtokdb.chunk_rows = 100;
+set max_parallel_workers_per_gather = 2;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+explain (costs off) select count(*), sum(j) from test47 where j % 2 = 0;
+select count(*), sum(j) from test47 where j % 2 = 0;
+reset parallel_tuple_cost;
+reset parallel_setup_cost;
+reset max_parallel_workers_per_gather;
+reset pgtokdb.chunk_rows;
+
+\echo ** Test54: Bulk insert of Postgres rows into a kdb+ table in batches
+create table test54 as 
+	select g::bigint as j, ('s' || (g % 3))::varchar as s, g * 0.5::float8 as f 
+	from generate_series(1, 2500) g;
+set pgtokdb.insert_batch = 1000;
+select pgtokdb.insert('test54tbl', t) from test54 t;
+reset pgtokdb.insert_batch;
+create type test54_t as (n bigint, j bigint, s varchar, f double precision);
+create function test54(varchar) returns setof test54_t as 'pgtokdb', 'getset' language c;
+select * from test54('select n:count i, j:sum j, s:last s, f:sum f from test54tbl');
+
+\echo ** Test55: Array arguments passed as typed kdb+ lists
+create type test55_t as (n bigint, j bigint, f double precision, s varchar, t varchar);
+create function test55(varchar, bigint[], double precision[], text[], varchar[]) 
+	returns setof test55_t as 'pgtokdb', 'getset' language c;
+select * from test55('test55', array[1, 2, null, 4], array[0.5, 1.5], array['a', 'b'], array['xy', null]);
+select n, j from test55('test55', array(select generate_series(1, 50000)::bigint), '{}', '{}', '{}');
+
+\echo ** Test56: Result cache (kdb+ is only called once per key when the library is preloaded)
+create type test56_t as (n bigint, x bigint);
+create function test56(varchar, bigint) returns setof test56_t as 'pgtokdb', 'getset' language c
+	set pgtokdb.cache_ttl = 60;
+select pgtokdb.cache_invalidate('test56(varchar, bigint)') >= 0 as invalidated;
+select * from test56('test56', 1);
+select * from test56('test56', 1);
+select * from test56('test56', 2);
+select entries >= 0 as ok, size >= bytes as fits from pgtokdb.cache_stats;
+
+\echo ** Test57: Repeated calls of a function over a wide kdb+ result (LATERAL join)
+create type test57_t as (c20 bigint, c3 bigint, c17 bigint);
+create function test57(varchar, bigint) returns setof test57_t as 'pgtokdb', 'getset' language c;
+set pgtokdb.project = off;
+select g, t.* from generate_series(1, 3) g, lateral test57('test57', g) t;
+reset pgtokdb.project;
+
+\echo ** Test58: Results compressed by kdb+ (above the threshold only)
+create type test58_t as (j bigint, s varchar);
+create function test58(varchar, bigint) returns setof test58_t as 'pgtokdb', 'getset' language c
+	set pgtokdb.compress = on set pgtokdb.compress_threshold = 1000;
+select count(*), sum(j), max(s) from test58('test58', 100000);
+select * from test58('test58', 3);
+
+\echo ** Test59: Statistics per function and expression (collected when the library is preloaded)
+create function test59(varchar, bigint) returns setof test58_t as 'pgtokdb', 'getset' language c;
+select pgtokdb.stat_statements_reset();
+select count(*) from test59('test58', 1000);
+select count(*) from test59('test58', 1000);
+select count(*) <= 1 as one_entry, coalesce(bool_and(rows = 1000 * calls and kdb_total_ms >= 0), true) as counted
+	from pgtokdb.stat_statements where fn = 'test59(varchar, bigint)'::regprocedure;
+
+\echo ** Test60: Planner row estimates (ROWS of the function, then a kdb+ probe)
+create function test60(varchar, bigint) returns setof test58_t as 'pgtokdb', 'getset' language c
+	rows 50 support pgtokdb.getset_support;
+explain select * from test60('test58', 10);
+set pgtokdb.row_probe = '{count value x}';
+explain select * from test60('test58', 10);
+set pgtokdb.row_probe = '{''nyi}';
+explain select * from test60('test58', 20);
+reset pgtokdb.row_probe;
+
+\echo ** Test61: kdb+ call exceeding pgtokdb.query_timeout
+create function test61(varchar, bigint) returns setof test21_t as 'pgtokdb', 'getset' language c
+	set pgtokdb.query_timeout = 200;
+select * from test61('test61', 2000);
+
+\echo ** Test62: Repeated kdb+ symbols (texts shared within a call, then past pgtokdb.symbol_cache)
+select s, count(*) from test59('test58', 100000) group by s order by s;
+select (test59('test58', 6)).s;
+set pgtokdb.symbol_cache = 2;
+select s, count(*) from test59('test58', 10) group by s order by s;
+reset pgtokdb.symbol_cache;
+
+\echo ** Test63: Replicas in pgtokdb.host (the first refuses connections and is passed over)
+set pgtokdb.host = 'localhost:1,localhost';
+select count(*) from test59('test58', 1000);
+set pgtokdb.chunk_rows = 100;
+select count(*) from test59('test58', 1000);
+reset pgtokdb.chunk_rows;
+reset pgtokdb.host;
+
+\echo ** Test64: Bulk load into a table (the column kdb+ doesn't return takes its default)
+create table test64 (id serial primary key, j bigint not null, s varchar);
+select rows from pgtokdb.load('test64', 'test58', 1000::bigint);
+set pgtokdb.chunk_rows = 300;
+select rows from pgtokdb.load('test64', 'test58', 1000::bigint);
+reset pgtokdb.chunk_rows;
+select count(*), sum(j), max(id) from test64;
+select s, count(*) from test64 group by s order by s;
+
+\echo ** Test65: Incremental sync (only the kdb+ rows added since the last sync are loaded)
+create table test65 (id bigint primary key, v float8);
+create type test65_t as (j bigint);
+create function test65add(varchar, bigint) returns setof test65_t as 'pgtokdb', 'getset' language c;
+insert into pgtokdb.sync_marks (target, source, key) values ('test65', 'test65', 'id');
+select rows from pgtokdb.sync('test65');
+select rows from pgtokdb.sync('test65');
+select * from test65add('test65add', 3);
+select rows from pgtokdb.sync('test65');
+select count(*), sum(v), max(id) from test65;
+select mark, rows from pgtokdb.sync_marks where target = 'test65'::regclass;
+delete from pgtokdb.sync_marks where target = 'test65'::regclass;
+
+\echo ** Test66: Built-in reader of kdb+ responses (every type, then a result read in many pieces)
+create function test66(varchar, integer) returns setof test02_t as 'pgtokdb', 'getset' language c
+	set pgtokdb.builtin_reader = on;
+select * from test66('test02', 4);
+create type test66_t as (j bigint, f double precision, s varchar);
+create function test66big(varchar, integer) returns setof test66_t as 'pgtokdb', 'getset' language c
+	set pgtokdb.builtin_reader = on;
+select count(*), sum(j), count(distinct s) from test66big('test66', 1000000);
+
+\echo ** Test67: Incremental sync on nanosecond timestamp and symbol keys (no row is loaded twice or missed)
+create table test67 (p timestamp, j bigint primary key);
+create table test67s (s varchar primary key, j bigint);
+create function test67add(varchar, bigint) returns setof test65_t as 'pgtokdb', 'getset' language c;
+insert into pgtokdb.sync_marks (target, source, key) values ('test67', 'test67', 'p'), ('test67s', 'test67s', 's');
+select rows from pgtokdb.sync('test67');
+select rows from pgtokdb.sync('test67');
+select rows from pgtokdb.sync('test67s');
+select rows from pgtokdb.sync('test67s');
+select * from test67add('test67add', 2);
+select rows from pgtokdb.sync('test67');
+select rows from pgtokdb.sync('test67s');
+select count(*), count(distinct p), sum(j) from test67;
+select count(*), max(s) from test67s;
+select * from test67late('test67late', 1);
+select rows from pgtokdb.sync('test67');
+select rows from pgtokdb.sync('test67');
+select count(*), sum(j), mark from test67, pgtokdb.sync_marks where target = 'test67'::regclass group by mark;
+delete from pgtokdb.sync_marks where target in ('test67'::regclass, 'test67s'::regclass);
+
+\echo ** Test68: Foreign table aggregates of no rows, int sums past the int range, and kdb+ column names
+create foreign table test68 (i integer, f double precision, s varchar)
+	server test47_srv options (table 'test68tbl');
+explain (verbose, costs off) select sum(i), max(i), min(f), avg(f), count(*) from test68 where i < 0;
+select sum(i), max(i), min(f), avg(f), count(*) from test68 where i < 0;
+select sum(i), max(i), count(*) from test68;
+select s, sum(i), max(f) from test68 group by s order by s;
+explain (verbose, costs off) select avg(i) from test68;
+select avg(i) from test68;
+create foreign table test68bad (j bigint options (column 'j;0')) server test47_srv;
+create foreign table "test68 bad" ("j j" bigint) server test47_srv options (table 'test68tbl');
+select * from "test68 bad";
+
+\echo ** Test69: Sharded call with a shard exceeding pgtokdb.query_timeout
+create function test69(varchar, bigint) returns setof test21_t as 'pgtokdb', 'getshards' language c
+	set pgtokdb.shards = 'localhost:5000,127.0.0.1:5000' set pgtokdb.query_timeout = 200;
+select * from test69('test61', 1000);
+
+\echo ** Test70: Replicas in pgtokdb.host (the first exceeds pgtokdb.query_timeout and the call moves on)
+create function test70(varchar, bigint) returns setof test21_t as 'pgtokdb', 'getset' language c
+	set pgtokdb.host = 'localhost,127.0.0.1' set pgtokdb.query_timeout = 400;
+select * from test70('test70', 600);
+
+\echo ** Test71: Bulk load into a partition (rows outside its bounds are rejected)
+create table test71 (j bigint, s varchar) partition by range (j);
+create table test71a partition of test71 for values from (0) to (100);
+select rows from pgtokdb.load('test71a', 'test58', 100::bigint);
+select rows from pgtokdb.load('test71a', 'test58', 101::bigint);
+select count(*), max(j) from test71;
+
 -- Get rid of all testing artifacts
 \echo Dropping test schema: pgtokdb_test
 drop schema pgtokdb_test cascade;
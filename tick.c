@@ -0,0 +1,699 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Real-time ingest from a kdb+ tickerplant. A background worker connects to
+ * the tickerplant named by pgtokdb.tick_host, subscribes (.u.sub) to each
+ * kdb+ table of pgtokdb.tick_tables, and buffers the tables of the upd
+ * messages it is sent. Every pgtokdb.tick_batch rows or
+ * pgtokdb.tick_flush_interval, the buffered rows of each table are written
+ * to its Postgres table as pgtokdb.load does, in a transaction per table.
+ * While it writes, the worker doesn't read from the tickerplant, so at most
+ * a batch (plus one message) is buffered, and a tickerplant publishing
+ * faster than Postgres can write sees its connection to the worker back up
+ * (as with any slow subscriber). The counters of each table are kept in
+ * shared memory (see pgtokdb.tick_stats).
+ *
+ * The worker needs the library to be loaded through shared_preload_libraries.
+ */
+
+#include "pgtokdb.h"
+#include <limits.h>
+#include <signal.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <access/table.h>
+#include <access/xact.h>
+#include <catalog/namespace.h>
+#include <postmaster/bgworker.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/lwlock.h>
+#include <storage/proc.h>
+#include <storage/shmem.h>
+#include <tcop/tcopprot.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/snapmgr.h>
+#include <utils/varlena.h>
+
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#define KTICK_MAX_TABLES	32
+
+/* Milliseconds between connection attempts, and between idle checks */
+#define KTICK_RETRY_MS		5000
+#define KTICK_IDLE_MS		1000
+
+/* Counters of a subscribed table */
+typedef struct
+{
+	char		kdb[NAMEDATALEN];		/* kdb+ table */
+	char		target[2 * NAMEDATALEN];	/* Postgres table */
+	int64		received;	/* Rows received */
+	int64		inserted;	/* Rows written to Postgres */
+	int64		dropped;	/* Rows lost to a failed write */
+	int64		flushes;	/* Writes to Postgres */
+	int64		queued;		/* Rows received but not yet written */
+	double		lag_ms;		/* Age of the oldest row of the last write when committed */
+	double		flush_ms;	/* Duration of the last write */
+	TimestampTz	last_received;
+	TimestampTz	last_flush;
+} KTickStat;
+
+/* State of the subscriber shared with the backends */
+typedef struct
+{
+	LWLock	   *lock;		/* Protects the counters */
+	bool		connected;	/* Subscribed to the tickerplant */
+	TimestampTz	started;	/* When the worker started */
+	int			ntables;
+	KTickStat	tables[KTICK_MAX_TABLES];
+} KTickShared;
+
+/* Rows of a table buffered by the worker */
+typedef struct
+{
+	char		kdb[NAMEDATALEN];
+	char		target[2 * NAMEDATALEN];
+	K			cols;		/* Column names, from the schema sent by .u.sub */
+	K		   *pending;	/* Tables received since the last write */
+	int			npending;
+	int			maxpending;
+	int64		rows;		/* Rows in pending */
+	instr_time	first;		/* When the oldest of them was received */
+} KTickTable;
+
+/* Configuration globals */
+static char *tick_host = NULL;
+static char *tick_database = NULL;
+static char *tick_user = NULL;
+static char *tick_tables = NULL;
+static int tick_batch = 10000;
+static int tick_flush_interval = 1000;
+
+/* Shared state, as attached by this process */
+static KTickShared *ktick = NULL;
+
+/* Tables of the worker */
+static KTickTable tables[KTICK_MAX_TABLES];
+static int ntables = 0;
+static MemoryContext tickctx = NULL;
+
+static volatile sig_atomic_t ktick_reload = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* Prototypes */
+void	ktick_shmem_request(void);
+void	ktick_shmem_startup(void);
+void	ktick_sighup(SIGNAL_ARGS);
+void	ktick_parse(void);
+I		ktick_subscribe(void);
+void	ktick_receive(K);
+void	ktick_flush(KTickTable *, KTickStat *);
+void	ktick_flush_all(bool);
+void	ktick_detach(int, Datum);
+PGDLLEXPORT void ktick_main(Datum);
+
+
+/*
+ * Define the configuration settings of the tickerplant subscriber, and
+ * register its worker and reserve its shared memory when loaded through
+ * shared_preload_libraries
+ */
+void ktick_init(void)
+{
+	DefineCustomStringVariable("pgtokdb.tick_host",
+		"host:port of the kdb+ tickerplant whose updates are written to Postgres.",
+		"Empty starts no subscriber.",
+		&tick_host, "", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgtokdb.tick_database",
+		"Database the tickerplant subscriber writes to.",
+		NULL, &tick_database, "postgres", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgtokdb.tick_user",
+		"Role the tickerplant subscriber writes as.",
+		"Empty uses the bootstrap superuser.",
+		&tick_user, "", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgtokdb.tick_tables",
+		"Comma-separated kdb+ tables to subscribe to, each optionally followed by =postgres_table.",
+		"e.g. trade,quote=public.quotes; a table without =name is written to the table of the same name.",
+		&tick_tables, "", PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.tick_batch",
+		"Rows buffered by the tickerplant subscriber before they are written.",
+		NULL, &tick_batch, 10000, 1, INT_MAX,
+		PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgtokdb.tick_flush_interval",
+		"Longest time rows received from the tickerplant are buffered before they are written.",
+		NULL, &tick_flush_interval, 1000, 1, INT_MAX,
+		PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || tick_host[0] == '\0')
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = ktick_shmem_request;
+#else
+	ktick_shmem_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ktick_shmem_startup;
+
+	BackgroundWorker worker;
+	memset(&worker, 0, sizeof(worker));
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pgtokdb tickerplant subscriber");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pgtokdb tick");
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgtokdb");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "ktick_main");
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	RegisterBackgroundWorker(&worker);
+}
+
+
+/*
+ * Request the shared memory and the lock of the subscriber's counters
+ */
+void ktick_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(KTickShared)));
+	RequestNamedLWLockTranche("pgtokdb_tick", 1);
+}
+
+
+/*
+ * Set up (or attach to) the counters
+ */
+void ktick_shmem_startup(void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ktick = (KTickShared *) ShmemInitStruct("pgtokdb tick", sizeof(KTickShared), &found);
+	if (!found)
+	{
+		memset(ktick, 0, sizeof(KTickShared));
+		ktick->lock = &(GetNamedLWLockTranche("pgtokdb_tick"))->lock;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Have the worker reread its configuration
+ */
+void ktick_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	ktick_reload = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+/*
+ * Split pgtokdb.tick_tables into the tables of the worker, and reset their
+ * counters. Invalid entries are reported and skipped.
+ */
+void ktick_parse(void)
+{
+	char *list = pstrdup(tick_tables);
+
+	for (int i = 0; i < ntables; i++)
+		if (tables[i].cols != NULL)
+			r0(tables[i].cols);
+	ntables = 0;
+
+	for (char *tok = strtok(list, ", "); tok != NULL; tok = strtok(NULL, ", "))
+	{
+		char *eq = strchr(tok, '=');
+		if (eq != NULL)
+			*eq = '\0';
+
+		if (tok[0] == '\0' || (eq != NULL && eq[1] == '\0') || strlen(tok) >= NAMEDATALEN)
+		{
+			elog(WARNING, "Invalid table \"%s\" in pgtokdb.tick_tables", tok);
+			continue;
+		}
+		if (ntables == KTICK_MAX_TABLES)
+		{
+			elog(WARNING, "The number of pgtokdb.tick_tables exceeds %d", KTICK_MAX_TABLES);
+			break;
+		}
+
+		KTickTable *t = &tables[ntables++];
+		memset(t, 0, sizeof(KTickTable));
+		safecpy(t->kdb, tok, sizeof(t->kdb));
+		safecpy(t->target, eq != NULL ? eq + 1 : tok, sizeof(t->target));
+	}
+
+	pfree(list);
+
+	LWLockAcquire(ktick->lock, LW_EXCLUSIVE);
+	ktick->ntables = ntables;
+	for (int i = 0; i < ntables; i++)
+	{
+		KTickStat *s = &ktick->tables[i];
+		memset(s, 0, sizeof(KTickStat));
+		safecpy(s->kdb, tables[i].kdb, sizeof(s->kdb));
+		safecpy(s->target, tables[i].target, sizeof(s->target));
+	}
+	LWLockRelease(ktick->lock);
+}
+
+
+/*
+ * Connect to the tickerplant and subscribe to all rows of each table.
+ * Returns the handle, or 0 (after logging why) on a failure.
+ */
+I ktick_subscribe(void)
+{
+	char host[256];
+	char *colon = strrchr(tick_host, ':');
+
+	if (colon == NULL || atoi(colon + 1) <= 0)
+	{
+		elog(LOG, "pgtokdb.tick_host \"%s\" is not host:port", tick_host);
+		return 0;
+	}
+	safecpy(host, tick_host, Min(sizeof(host), (size_t) (colon - tick_host) + 1));
+
+	const char *userpass = GetConfigOption("pgtokdb.userpass", false, false);
+	I h = kconn_connect_timeout > 0 ?
+		khpun(host, atoi(colon + 1), (S) userpass, kconn_connect_timeout) :
+		khpu(host, atoi(colon + 1), (S) userpass);
+	if (h <= 0)
+	{
+		elog(LOG, "pgtokdb tick subscriber unable to connect to kdb+ at %s (%d)", tick_host, h);
+		return 0;
+	}
+
+	for (int i = 0; i < ntables; i++)
+	{
+		/* .u.sub returns the table's name and its (empty) schema */
+		K r = k(h, ".u.sub", ks(tables[i].kdb), ks(""), (K) 0);
+
+		if (r == NULL || r->t == -128 || r->t != 0 || r->n != 2 || kK(r)[1]->t != XT)
+		{
+			elog(LOG, "pgtokdb tick subscriber unable to subscribe to %s: %s", tables[i].kdb,
+				r == NULL ? "network error" : r->t == -128 ? r->s : "unexpected response to .u.sub");
+			if (r != NULL)
+				r0(r);
+			kclose(h);
+			return 0;
+		}
+
+		if (tables[i].cols != NULL)
+			r0(tables[i].cols);
+		tables[i].cols = r1(kK(kK(r)[1]->k)[0]);
+		r0(r);
+	}
+
+	elog(LOG, "pgtokdb tick subscriber subscribed to %d tables at %s", ntables, tick_host);
+	return h;
+}
+
+
+/*
+ * Buffer the rows of a message from the tickerplant (consumed). Updates are
+ * (`upd; table; data), with data an unkeyed table, or a list of columns in
+ * the order of the table's schema.
+ */
+void ktick_receive(K x)
+{
+	if (x->t != 0 || x->n != 3 || kK(x)[0]->t != -KS || strcmp(kK(x)[0]->s, "upd") != 0 ||
+		kK(x)[1]->t != -KS)
+	{
+		r0(x);
+		return;
+	}
+
+	KTickTable *t = NULL;
+	int i;
+	for (i = 0; i < ntables && t == NULL; i++)
+		if (strcmp(tables[i].kdb, kK(x)[1]->s) == 0)
+			t = &tables[i];
+	i--;
+
+	K data = kK(x)[2];
+	if (t == NULL || (data->t != XT && data->t != 0))
+	{
+		r0(x);
+		return;
+	}
+
+	if (data->t == 0)
+	{
+		/* Columns of equal length, named by the schema */
+		if (t->cols == NULL || data->n != t->cols->n || data->n == 0 || kK(data)[0]->t < 0)
+		{
+			elog(LOG, "pgtokdb tick subscriber dropped an update of %s it could not read", t->kdb);
+			r0(x);
+			return;
+		}
+		data = xT(xD(r1(t->cols), r1(data)));
+	}
+	else
+		r1(data);
+	r0(x);
+
+	J rows = kK(kK(data->k)[1])[0]->n;
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(tickctx);
+	if (t->npending == t->maxpending)
+	{
+		t->maxpending = Max(16, 2 * t->maxpending);
+		t->pending = t->pending == NULL ?
+			(K *) palloc(t->maxpending * sizeof(K)) :
+			(K *) repalloc(t->pending, t->maxpending * sizeof(K));
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	if (t->rows == 0)
+		INSTR_TIME_SET_CURRENT(t->first);
+	t->pending[t->npending++] = data;
+	t->rows += rows;
+
+	LWLockAcquire(ktick->lock, LW_EXCLUSIVE);
+	KTickStat *s = &ktick->tables[i];
+	s->received += rows;
+	s->queued = t->rows;
+	s->last_received = GetCurrentTimestamp();
+	LWLockRelease(ktick->lock);
+}
+
+
+/*
+ * Write the rows buffered for a table in a transaction of their own. When
+ * the write fails (e.g. on a constraint), the error is logged and the rows
+ * are dropped, so that one bad batch can't stop the subscriber.
+ */
+void ktick_flush(KTickTable *t, KTickStat *s)
+{
+	instr_time start, elapsed;
+	bool ok = true;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, t->target);
+
+	PG_TRY();
+	{
+		RangeVar *rv = makeRangeVarFromNameList(textToQualifiedNameList(cstring_to_text(t->target)));
+		Relation rel = table_openrv(rv, RowExclusiveLock);
+		kload_check(rel);
+
+		KLoad *st = kload_start(rel);
+		for (int i = 0; i < t->npending; i++)
+			kload_write(st, t->pending[i]);
+		kload_finish(st);
+		table_close(rel, NoLock);
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		HOLD_INTERRUPTS();
+		MemoryContextSwitchTo(tickctx);
+		EmitErrorReport();
+		AbortCurrentTransaction();
+		FlushErrorState();
+		RESUME_INTERRUPTS();
+		ok = false;
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(tickctx);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	double flush_ms = INSTR_TIME_GET_MILLISEC(elapsed);
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, t->first);
+
+	LWLockAcquire(ktick->lock, LW_EXCLUSIVE);
+	if (ok)
+		s->inserted += t->rows;
+	else
+		s->dropped += t->rows;
+	s->flushes++;
+	s->queued = 0;
+	s->flush_ms = flush_ms;
+	s->lag_ms = INSTR_TIME_GET_MILLISEC(elapsed);
+	s->last_flush = GetCurrentTimestamp();
+	LWLockRelease(ktick->lock);
+
+	for (int i = 0; i < t->npending; i++)
+		r0(t->pending[i]);
+	t->npending = 0;
+	t->rows = 0;
+}
+
+
+/*
+ * Write the buffered rows of the tables that are due: all of them when force
+ * is set (a batch is full), or else those buffered for the flush interval
+ */
+void ktick_flush_all(bool force)
+{
+	instr_time now;
+	INSTR_TIME_SET_CURRENT(now);
+
+	for (int i = 0; i < ntables; i++)
+	{
+		KTickTable *t = &tables[i];
+		if (t->rows == 0)
+			continue;
+
+		instr_time age = now;
+		INSTR_TIME_SUBTRACT(age, t->first);
+		if (force || INSTR_TIME_GET_MILLISEC(age) >= tick_flush_interval)
+			ktick_flush(t, &ktick->tables[i]);
+	}
+}
+
+
+/*
+ * Report the subscriber as disconnected when it exits
+ */
+void ktick_detach(int code, Datum arg)
+{
+	LWLockAcquire(ktick->lock, LW_EXCLUSIVE);
+	ktick->connected = false;
+	LWLockRelease(ktick->lock);
+}
+
+
+/*
+ * Entry point of the tickerplant subscriber
+ */
+PGDLLEXPORT void ktick_main(Datum arg)
+{
+	I h = 0;
+
+	pqsignal(SIGHUP, ktick_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(tick_database,
+		tick_user[0] != '\0' ? tick_user : NULL, 0);
+
+	tickctx = AllocSetContextCreate(TopMemoryContext,
+		"pgtokdb tick", ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(tickctx);
+
+	ktick_parse();
+	LWLockAcquire(ktick->lock, LW_EXCLUSIVE);
+	ktick->started = GetCurrentTimestamp();
+	LWLockRelease(ktick->lock);
+	on_shmem_exit(ktick_detach, (Datum) 0);
+
+	for (;;)
+	{
+		if (h <= 0 && ntables > 0)
+		{
+			h = ktick_subscribe();
+			LWLockAcquire(ktick->lock, LW_EXCLUSIVE);
+			ktick->connected = h > 0;
+			LWLockRelease(ktick->lock);
+		}
+
+		/* Sleep until a message arrives or the oldest buffered rows are due */
+		long timeout = h > 0 ? KTICK_IDLE_MS : KTICK_RETRY_MS;
+		for (int i = 0; i < ntables; i++)
+			if (tables[i].rows > 0)
+			{
+				instr_time age;
+				INSTR_TIME_SET_CURRENT(age);
+				INSTR_TIME_SUBTRACT(age, tables[i].first);
+				timeout = Min(timeout, Max(0, tick_flush_interval - (long) INSTR_TIME_GET_MILLISEC(age)));
+			}
+
+		int events = WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH;
+		int rc = h > 0 ?
+			WaitLatchOrSocket(MyLatch, events | WL_SOCKET_READABLE, h, timeout, PG_WAIT_EXTENSION) :
+			WaitLatch(MyLatch, events, timeout, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ktick_reload)
+		{
+			/* New tables need a new subscription; what is buffered is written first */
+			ktick_reload = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			ktick_flush_all(true);
+			ktick_parse();
+			if (h > 0)
+				kclose(h);
+			h = 0;
+			continue;
+		}
+
+		/* Read the messages that have arrived, up to a batch */
+		if (h > 0 && (rc & WL_SOCKET_READABLE))
+		{
+			int64 buffered = 0;
+			struct pollfd pfd = { h, POLLIN, 0 };
+			do
+			{
+				K x = k(h, (S) 0);
+				if (x == NULL)
+				{
+					elog(LOG, "pgtokdb tick subscriber lost its connection to %s", tick_host);
+					kclose(h);
+					h = 0;
+					break;
+				}
+				ktick_receive(x);
+
+				buffered = 0;
+				for (int i = 0; i < ntables; i++)
+					buffered += tables[i].rows;
+			} while (buffered < tick_batch && poll(&pfd, 1, 0) > 0);
+
+			if (buffered >= tick_batch)
+			{
+				ktick_flush_all(true);
+				continue;
+			}
+		}
+
+		ktick_flush_all(false);
+	}
+}
+
+
+PG_FUNCTION_INFO_CUSTOM(tick_stats);
+
+/*
+ * Report the counters of the tables of the tickerplant subscriber
+ */
+PGDLLEXPORT Datum tick_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "Function must be called in a context that accepts a set");
+
+	TupleDesc tupdesc;
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Function must use composite types");
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	Tuplestorestate *tupstore = tuplestore_begin_heap(false, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	if (ktick != NULL)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		LWLockAcquire(ktick->lock, LW_SHARED);
+		for (int i = 0; i < ktick->ntables; i++)
+		{
+			KTickStat *s = &ktick->tables[i];
+			Datum values[13];
+			bool nulls[13] = { false };
+
+			/* Rows written per second since the worker started */
+			long secs;
+			int usecs;
+			TimestampDifference(ktick->started, now, &secs, &usecs);
+			double elapsed = secs + usecs / 1e6;
+
+			values[0] = PointerGetDatum(cstring_to_text(s->kdb));
+			values[1] = PointerGetDatum(cstring_to_text(s->target));
+			values[2] = BoolGetDatum(ktick->connected);
+			values[3] = Int64GetDatum(s->received);
+			values[4] = Int64GetDatum(s->inserted);
+			values[5] = Int64GetDatum(s->dropped);
+			values[6] = Int64GetDatum(s->queued);
+			values[7] = Int64GetDatum(s->flushes);
+			values[8] = Float8GetDatum(s->lag_ms);
+			values[9] = Float8GetDatum(s->flush_ms);
+			values[10] = Float8GetDatum(elapsed > 0 ? s->inserted / elapsed : 0);
+			values[11] = TimestampTzGetDatum(s->last_received);
+			values[12] = TimestampTzGetDatum(s->last_flush);
+			nulls[8] = nulls[9] = s->flushes == 0;
+			nulls[11] = s->last_received == 0;
+			nulls[12] = s->flushes == 0;
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+		LWLockRelease(ktick->lock);
+	}
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}